@@ -0,0 +1,875 @@
+/*
+  Benchmarks for the parts of l7-filter that every packet goes through:
+  classification, buffering, making keys, the table of connections, and all
+  of them together in l7_queue::handle_batch().  'make bench' builds and runs
+  it.  'make check' runs it with -a, which only checks that the packets of
+  connections we already know about don't allocate any memory.
+
+  Results are printed one per line as "name value", like the statistics
+  file, so that runs against different versions can be compared with diff
+  or a script.  Names say what the unit is (ns, mb_per_s, ...).  Lines
+  starting with # are comments.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <set>
+#include <list>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+
+#include "l7-classify.h"
+#include "l7-conntrack.h"
+#include "l7-queue.h"
+#include "l7-snapshot.h"
+#include "util.h"
+#include "config.h"
+
+extern int verbosity;
+extern string l7dir;
+extern unsigned int buflen;
+extern unsigned int classify_cache;
+
+static unsigned int ms = 200; // how long to run each benchmark
+
+// malloc and the rest are replaced for the whole program, including the C
+// and C++ libraries, so that bench_allocations() can count what the packet
+// path asks for.  Counting is only on while it wants it.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+}
+static volatile bool counting_allocations = false;
+static volatile unsigned long nallocations = 0;
+
+extern "C" void *malloc(size_t size) __THROW
+{
+  if(counting_allocations) __sync_fetch_and_add(&nallocations, 1);
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) __THROW
+{
+  if(counting_allocations) __sync_fetch_and_add(&nallocations, 1);
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) __THROW
+{
+  if(counting_allocations) __sync_fetch_and_add(&nallocations, 1);
+  return __libc_realloc(p, size);
+}
+
+// Patterns in the style of the l7-protocols set, for when it isn't
+// installed.  The config lists them in this order.
+static const char *builtin_patterns[][2] = {
+  { "http", "http/(0\\.9|1\\.0|1\\.1) [1-5][0-9][0-9] [\\x09-\\x0d -~]*"
+            "(connection:|content-type:|content-length:|date:)|post "
+            "[\\x09-\\x0d -~]* http/[01]\\.[019]" },
+  { "ssl", "^(.?.?\\x16\\x03.*\\x16\\x03|.?.?\\x01\\x03\\x01?.*\\x0b)" },
+  { "ssh", "^ssh-[12]\\.[0-9]" },
+  { "smtp", "^220[\\x09-\\x0d -~]* (e?smtp|simple mail)" },
+  { "ftp", "^220[\\x09-\\x0d -~]*ftp" },
+  { "pop3", "^(\\+ok |-err )" },
+  { "dns", "^.?.?.?.?[\\x01\\x02].?.?.?.?.?.?[\\x01-?][a-z0-9][\\x01-?a-z]*"
+           "[\\x02-\\x06][a-z][a-z][fglmoprstuvz]?[aeop]?(um)?"
+           "[\\x01-\\x10\\x1c][\\x01\\x03\\x04\\xff]" },
+  { "bittorrent", "^(\\x13bittorrent protocol|azver\\x01$|get /scrape\\?"
+                  "info_hash=get /announce\\?info_hash=|get /client/bitcomet/"
+                  "|GET /data\\?fid=)|d1:ad2:id20:|\\x08'7P\\)[RP]" },
+  { "irc", "^(nick[\\x09-\\x0d -~]*user[\\x09-\\x0d -~]*:|user"
+           "[\\x09-\\x0d -~]*:[\\x02-\\x0d -~]*nick[\\x09-\\x0d -~]*"
+           "\\x0d\\x0a)" },
+  { "rtsp", "rtsp/1\\.0 200 ok" },
+};
+
+static vector<string> tempfiles; // to clean up, last first
+
+static void cleanup()
+{
+  for(int i = tempfiles.size() - 1; i >= 0; i--)
+    if(unlink(tempfiles[i].c_str()) != 0) rmdir(tempfiles[i].c_str());
+}
+
+static string make_tempdir()
+{
+  char dir[] = "/tmp/l7-bench.XXXXXX";
+  if(!mkdtemp(dir)){
+    perror("mkdtemp");
+    exit(1);
+  }
+  tempfiles.push_back(dir);
+  return dir;
+}
+
+// Writes the built in patterns out, points l7dir at them and returns a
+// configuration file that uses them all.
+static string write_builtin_patterns()
+{
+  string dir = make_tempdir();
+  tempfiles.push_back(dir + "/builtin");
+  mkdir((dir + "/builtin").c_str(), 0755);
+
+  string conffilename = dir + "/l7-bench.conf";
+  tempfiles.push_back(conffilename);
+  ofstream conf(conffilename.c_str());
+  for(unsigned int i = 0;
+      i < sizeof(builtin_patterns)/sizeof(builtin_patterns[0]); i++){
+    string name = builtin_patterns[i][0];
+    string filename = dir + "/builtin/" + name + ".pat";
+    tempfiles.push_back(filename);
+    ofstream pat(filename.c_str());
+    pat << name << "\n" << builtin_patterns[i][1] << "\n";
+    conf << name << " " << i+3 << "\n";
+  }
+  l7dir = dir;
+  return conffilename;
+}
+
+// Returns a configuration file that uses every pattern in l7dir, or "" if
+// there aren't any.
+static string config_for_all_patterns()
+{
+  set<string> names;
+  DIR *top = opendir(l7dir.c_str());
+  if(!top) return "";
+
+  struct dirent *sub;
+  while((sub = readdir(top))){
+    if(sub->d_name[0] == '.') continue;
+    DIR *d = opendir((l7dir + "/" + sub->d_name).c_str());
+    if(!d) continue;
+    struct dirent *f;
+    while((f = readdir(d))){
+      string name = f->d_name;
+      if(name.size() > 4 && name.substr(name.size() - 4) == ".pat")
+        names.insert(name.substr(0, name.size() - 4));
+    }
+    closedir(d);
+  }
+  closedir(top);
+  if(names.empty()) return "";
+
+  string conffilename = make_tempdir() + "/l7-bench.conf";
+  tempfiles.push_back(conffilename);
+  ofstream conf(conffilename.c_str());
+  int mark = 3;
+  for(set<string>::iterator i = names.begin(); i != names.end(); i++)
+    conf << *i << " " << mark++ << "\n";
+  return conffilename;
+}
+
+static double now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1e9 + t.tv_nsec;
+}
+
+static void result(string name, double value)
+{
+  printf("%s %.1f\n", name.c_str(), value);
+  fflush(stdout);
+}
+
+// Kinds of traffic in the synthetic flows
+enum { P_HTTP, P_TLS, P_SSH, P_SMTP, P_DNS, P_BITTORRENT, P_BINARY, P_TEXT,
+       NKINDS };
+static const char *kind_names[NKINDS] = { "http", "tls", "ssh", "smtp", "dns",
+  "bittorrent", "binary", "text" };
+
+static string random_bytes(unsigned int len)
+{
+  string s(len, ' ');
+  for(unsigned int i = 0; i < len; i++) s[i] = random();
+  return s;
+}
+
+static string random_text(unsigned int len)
+{
+  static const char *words[] = { "the ", "data ", "of ", "a ", "packet ",
+    "connection ", "and ", "some ", "more ", "words ", "\r\n" };
+  string s;
+  while(s.size() < len) s += words[random() % 11];
+  return s.substr(0, len);
+}
+
+// Which way packet n of a connection of this kind goes
+static int direction_of(int kind, unsigned int n)
+{
+  // The server speaks first
+  if(kind == P_SMTP) return (n + 1) % 2;
+  return n % 2;
+}
+
+// The application data of packet n of a connection of the given kind
+static string payload(int kind, unsigned int n)
+{
+  switch(kind){
+    case P_HTTP:
+      if(n == 0) return "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0)\r\n"
+        "Accept: text/html,application/xhtml+xml\r\n"
+        "Accept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n\r\n";
+      if(n == 1) return "HTTP/1.1 200 OK\r\nServer: nginx\r\n"
+        "Date: Mon, 19 Oct 2026 10:00:00 GMT\r\nContent-Type: text/html\r\n"
+        "Content-Length: 5120\r\n\r\n<html><head><title>Example</title>"
+        "</head><body>" + random_text(1200);
+      return random_text(1400);
+    case P_TLS:
+      if(n == 0) return string("\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03",
+                               11) + random_bytes(500);
+      if(n == 1) return string("\x16\x03\x03\x00\x7a\x02\x00\x00\x76\x03\x03",
+                               11) + random_bytes(1300);
+      return string("\x17\x03\x03\x05\x00", 5) + random_bytes(1300);
+    case P_SSH:
+      if(n < 2) return "SSH-2.0-OpenSSH_9.6\r\n";
+      return random_bytes(600);
+    case P_SMTP:
+      if(n == 0) return "220 mail.example.com ESMTP Postfix\r\n";
+      if(n == 1) return "EHLO client.example.org\r\n";
+      if(n == 2) return "250-mail.example.com\r\n250-PIPELINING\r\n"
+                        "250-SIZE 10240000\r\n250 8BITMIME\r\n";
+      return random_text(300);
+    case P_DNS:
+      // A query for www.example.com, or the start of the answer
+      return random_bytes(2) + string(n ? "\x81\x80\x00\x01\x00\x01" :
+        "\x01\x00\x00\x01\x00\x00", 6) + string("\x00\x00\x00\x00\x03www"
+        "\x07" "example\x03" "com\x00\x00\x01\x00\x01", 25);
+    case P_BITTORRENT:
+      if(n < 2) return "\x13" "BitTorrent protocol" + random_bytes(48);
+      return random_bytes(1400);
+    case P_BINARY:
+      return random_bytes(n ? 1400 : 200);
+    default:
+      return random_text(n ? 1400 : 200);
+  }
+}
+
+// What a connection's buffer holds after its first packet each way
+static string first_buffer(int kind)
+{
+  string data = payload(kind, 0) + payload(kind, 1), stripped;
+  for(unsigned int i = 0; i < data.size(); i++)
+    if(data[i] != '\0') stripped += data[i];
+  return stripped;
+}
+
+// Makes an IPv4 packet carrying data in the given direction of the
+// connection.  Only what l7-filter looks at is filled in.
+static string make_packet(const l7_tuple & t, int direction, u_int32_t seq,
+                          const string & data)
+{
+  bool tcp = t.proto == IPPROTO_TCP;
+  unsigned int hl = tcp ? 20 : 8;
+  string packet(20 + hl + data.size(), '\0');
+  unsigned char *p = (unsigned char *)&packet[0];
+
+  u_int16_t totlen = htons(packet.size());
+  p[0] = 0x45;
+  memcpy(p + 2, &totlen, 2);
+  p[8] = 64;
+  p[9] = t.proto;
+  memcpy(p + 12, direction ? &t.daddr : &t.saddr, 4);
+  memcpy(p + 16, direction ? &t.saddr : &t.daddr, 4);
+  memcpy(p + 20, direction ? &t.dport : &t.sport, 2);
+  memcpy(p + 22, direction ? &t.sport : &t.dport, 2);
+  if(tcp){
+    u_int32_t nseq = htonl(seq);
+    memcpy(p + 24, &nseq, 4);
+    p[32] = 5 << 4;
+    p[33] = 0x18; // PSH ACK
+  }
+  else{
+    u_int16_t udplen = htons(8 + data.size());
+    memcpy(p + 24, &udplen, 2);
+  }
+  memcpy(p + 20 + hl, data.data(), data.size());
+  return packet;
+}
+
+// A different connection for each n
+static l7_tuple synthetic_tuple(unsigned int n, int kind)
+{
+  static const u_int16_t ports[NKINDS] = { 80, 443, 22, 25, 53, 6881, 5000,
+                                           7000 };
+  l7_tuple t;
+  t.saddr = htonl(0x0a000000 | (n & 0xffffff));
+  t.daddr = htonl(0xc0a80000 | (n >> 24) << 8 | (kind + 1));
+  t.sport = htons(1024 + (n % 60000));
+  t.dport = htons(ports[kind]);
+  t.proto = kind == P_DNS ? IPPROTO_UDP : IPPROTO_TCP;
+  return t;
+}
+
+static void bench_classify(l7_classify *classifier)
+{
+  for(int kind = 0; kind < NKINDS; kind++){
+    string data = first_buffer(kind);
+    vector<char> buffer(data.begin(), data.end());
+    buffer.push_back('\0');
+
+    int mark = classifier->classify(&buffer[0], 0, data.size(), 1);
+    string matched = classifier->get_name(mark);
+    printf("# classify.%s matches %s\n", kind_names[kind],
+           matched == "" ? "nothing" : matched.c_str());
+
+    unsigned long n = 0;
+    double start = now_ns(), elapsed;
+    do{
+      for(int i = 0; i < 64; i++)
+        classifier->classify(&buffer[0], 0, data.size(), 1);
+      n += 64;
+    } while((elapsed = now_ns() - start) < ms*1e6);
+
+    string name = string("classify.") + kind_names[kind];
+    result(name + ".ns", elapsed/n);
+    result(name + ".mb_per_s", data.size()*n/elapsed*1e3);
+  }
+}
+
+static void bench_append(l7_classify *classifier)
+{
+  // Which also makes classifier the one that connections use
+  l7_conntrack *ct = new l7_conntrack(classifier);
+  l7_tuple t = synthetic_tuple(1, P_TEXT);
+  string data = random_text(1460);
+  const char *names[] = { "append.udp", "append.tcp", "append.tcpreordered" };
+
+  for(int test = 0; test < 3; test++){
+    unsigned long n = 0;
+    u_int32_t seq = 0;
+    l7_connection *connection = NULL;
+    double start = now_ns(), elapsed;
+    do{
+      for(int i = 0; i < 64; i++, n++){
+        // Start over with a new connection when the buffer is full
+        if(!connection || connection->lengthsofar + 2*data.size() > connection->bufsize){
+          if(connection) connection->release();
+          connection = new l7_connection("bench", t);
+          connection->start_stream(0, 1000);
+          seq = 1000;
+        }
+        l7_segment segment;
+        segment.direction = test == 0 ? L7_NOT_TCP : 0;
+        segment.seq = seq;
+        if(test == 2){
+          // Every other packet comes before the one in front of it
+          segment.seq = seq + (n % 2 ? -data.size() : data.size());
+        }
+        connection->append_to_buffer((char *)data.c_str(), data.size(),
+                                     segment);
+        seq += data.size();
+      }
+    } while((elapsed = now_ns() - start) < ms*1e6);
+    connection->release();
+
+    result(string(names[test]) + ".ns", elapsed/n);
+    result(string(names[test]) + ".mb_per_s", data.size()*n/elapsed*1e3);
+  }
+  delete ct;
+}
+
+static void bench_keys(l7_classify *classifier)
+{
+  l7_conntrack *ct = new l7_conntrack(classifier);
+  vector<string> packets;
+  for(unsigned int i = 0; i < 1024; i++)
+    packets.push_back(make_packet(synthetic_tuple(i, i % NKINDS), i % 2, i,
+                                  "data"));
+
+  for(int test = 0; test < 2; test++){
+    unsigned long n = 0;
+    double start = now_ns(), elapsed;
+    do{
+      for(unsigned int i = 0; i < packets.size(); i++){
+        const unsigned char *p = (const unsigned char *)packets[i].data();
+        if(test == 0) ct->make_key(p, i % 2);
+        else ct->make_tuple(p, i % 2);
+      }
+      n += packets.size();
+    } while((elapsed = now_ns() - start) < ms*1e6);
+    result(test == 0 ? "key.make.ns" : "key.tuple.ns", elapsed/n);
+  }
+  delete ct;
+}
+
+static void bench_table(l7_classify *classifier, unsigned int nflows)
+{
+  l7_conntrack *ct = new l7_conntrack(classifier);
+  vector<string> keys;
+  vector<l7_tuple> tuples, misses;
+  char name[64];
+
+  for(unsigned int i = 0; i < nflows; i++){
+    l7_tuple t = synthetic_tuple(i, i % NKINDS);
+    string packet = make_packet(t, 0, 0, "");
+    tuples.push_back(t);
+    keys.push_back(ct->make_key((const unsigned char *)packet.data(), false));
+    misses.push_back(ct->make_tuple((const unsigned char *)packet.data(),
+                                    true));
+  }
+
+  // Look them up in a random order, so that the cache doesn't help
+  unsigned int nlookups = nflows < 1000000 ? nflows : 1000000;
+  vector<unsigned int> order;
+  for(unsigned int i = 0; i < nlookups; i++)
+    order.push_back(random() % nflows);
+
+  double start = now_ns();
+  for(unsigned int i = 0; i < nflows; i++)
+    ct->add_l7_connection(new l7_connection(keys[i], tuples[i]));
+  snprintf(name, sizeof(name), "table.%u.insert.ns", nflows);
+  result(name, (now_ns() - start)/nflows);
+
+  start = now_ns();
+  for(unsigned int i = 0; i < nlookups; i++){
+    l7_connection *connection = ct->get_l7_connection(tuples[order[i]]);
+    if(connection) connection->release();
+  }
+  snprintf(name, sizeof(name), "table.%u.lookup.ns", nflows);
+  result(name, (now_ns() - start)/nlookups);
+
+  // The way handle_batch() does it
+  const l7_flow_table & table = ct->get_flows();
+  u_int32_t hashes[L7_QUEUE_BATCH];
+  start = now_ns();
+  for(unsigned int i = 0; i + L7_QUEUE_BATCH <= nlookups;
+      i += L7_QUEUE_BATCH){
+    for(int j = 0; j < L7_QUEUE_BATCH; j++){
+      hashes[j] = l7_tuple_hash(tuples[order[i+j]]);
+      table.prefetch_slot(hashes[j]);
+    }
+    for(int j = 0; j < L7_QUEUE_BATCH; j++)
+      table.prefetch_connection(tuples[order[i+j]], hashes[j]);
+    for(int j = 0; j < L7_QUEUE_BATCH; j++){
+      l7_connection *connection =
+        ct->get_l7_connection(tuples[order[i+j]], hashes[j]);
+      if(connection) connection->release();
+    }
+  }
+  snprintf(name, sizeof(name), "table.%u.lookupbatched.ns", nflows);
+  result(name, (now_ns() - start)/(nlookups/L7_QUEUE_BATCH*L7_QUEUE_BATCH));
+
+  start = now_ns();
+  for(unsigned int i = 0; i < nlookups; i++)
+    ct->get_l7_connection(misses[order[i]]);
+  snprintf(name, sizeof(name), "table.%u.miss.ns", nflows);
+  result(name, (now_ns() - start)/nlookups);
+
+  // Saving them all and reading them back, as a restart does
+  string snapshot = make_tempdir() + "/snapshot";
+  tempfiles.push_back(snapshot);
+  start = now_ns();
+  l7_snapshot_write(table, snapshot);
+  snprintf(name, sizeof(name), "table.%u.snapshot.ms", nflows);
+  result(name, (now_ns() - start)/1e6);
+
+  l7_flow_table *restored = new l7_flow_table();
+  start = now_ns();
+  l7_snapshot_read(snapshot, *restored);
+  snprintf(name, sizeof(name), "table.%u.restore.ms", nflows);
+  result(name, (now_ns() - start)/1e6);
+  for(u_int32_t i = 0; i < restored->get_nslots(); i++)
+    if(restored->get_slot(i)) restored->get_slot(i)->release();
+  delete restored;
+
+  start = now_ns();
+  for(unsigned int i = 0; i < nflows; i++)
+    ct->remove_l7_connection(tuples[i]);
+  snprintf(name, sizeof(name), "table.%u.remove.ns", nflows);
+  result(name, (now_ns() - start)/nflows);
+
+  delete ct;
+}
+
+// One step of the synthetic traffic
+struct l7_bench_step {
+  int type;            // L7_CT_NEW, L7_CT_DESTROY or 0 for a packet
+  unsigned int flow;   // for events, which connection
+  size_t offset;       // for packets, where it is in the trace
+  unsigned int len;
+};
+
+// One of the synthetic connections in progress
+struct l7_bench_flow {
+  unsigned int id;
+  int kind;
+  l7_tuple tuple;
+  unsigned int npackets, sent;
+  u_int32_t seq[2];
+};
+
+static void start_flow(l7_bench_flow & flow, unsigned int id)
+{
+  // Mostly web, as on most networks
+  static const int mix[] = { P_HTTP, P_HTTP, P_TLS, P_TLS, P_TLS, P_TLS,
+    P_SSH, P_SMTP, P_DNS, P_DNS, P_BITTORRENT, P_BINARY, P_TEXT };
+  flow.id = id;
+  flow.kind = mix[random() % (sizeof(mix)/sizeof(mix[0]))];
+  flow.tuple = synthetic_tuple(id, flow.kind);
+  flow.npackets = flow.kind == P_DNS ? 2 : 4 + random() % 16;
+  flow.sent = 0;
+  flow.seq[0] = random();
+  flow.seq[1] = random();
+}
+
+// Drives handle_batch() with a mix of connections, nconcurrent at a time,
+// for npackets packets in all, along with the conntrack events for them.
+// Packets go in batches of up to batchsize, as they would from the queue.
+// There is no worker pipeline, so everything is done inline.
+static void bench_macro(l7_classify *classifier, unsigned int nconcurrent,
+                        unsigned int npackets, int batchsize)
+{
+  l7_conntrack *ct = new l7_conntrack(classifier);
+  l7_queue *queue = new l7_queue(ct, NULL);
+  vector<l7_bench_flow> flows(nconcurrent);
+  vector<l7_bench_step> steps;
+  vector<string> keys;
+  vector<l7_tuple> tuples;
+  string trace;
+  unsigned long databytes = 0;
+
+  // Make all the packets beforehand, so that only l7-filter is timed
+  for(unsigned int i = 0; i < nconcurrent; i++){
+    start_flow(flows[i], keys.size());
+    string packet = make_packet(flows[i].tuple, 0, 0, "");
+    keys.push_back(ct->make_key((const unsigned char *)packet.data(), false));
+    tuples.push_back(flows[i].tuple);
+  }
+
+  for(unsigned int i = 0; i < npackets; i++){
+    l7_bench_flow & flow = flows[random() % nconcurrent];
+    l7_bench_step step;
+
+    if(flow.sent == flow.npackets){
+      step.type = L7_CT_DESTROY;
+      step.flow = flow.id;
+      steps.push_back(step);
+
+      start_flow(flow, keys.size());
+      string packet = make_packet(flow.tuple, 0, 0, "");
+      keys.push_back(ct->make_key((const unsigned char *)packet.data(),
+                                  false));
+      tuples.push_back(flow.tuple);
+      step.type = L7_CT_NEW;
+      step.flow = flow.id;
+      steps.push_back(step);
+    }
+
+    int direction = direction_of(flow.kind, flow.sent);
+    string data = payload(flow.kind, flow.sent++);
+    string packet = make_packet(flow.tuple, direction, flow.seq[direction],
+                                data);
+    flow.seq[direction] += data.size();
+    databytes += data.size();
+
+    step.type = 0;
+    step.offset = trace.size();
+    step.len = packet.size();
+    steps.push_back(step);
+    trace += packet;
+  }
+
+  // Conntrack tells us about the first ones before any of their packets
+  for(unsigned int i = 0; i < nconcurrent; i++){
+    ct->connection_new(keys[i], tuples[i]);
+    ct->handle_events();
+  }
+
+  // handle_batch() takes in the conntrack events before each batch, so a
+  // batch ends where there is an event
+  unsigned long nmarked = 0;
+  unsigned char *packets = (unsigned char *)&trace[0];
+  vector<l7_queued_packet> batch(batchsize);
+  int nbatched = 0;
+  double start = now_ns();
+  for(unsigned int i = 0; i <= steps.size(); i++){
+    if(nbatched && (i == steps.size() || steps[i].type != 0 ||
+                    nbatched == batchsize)){
+      queue->handle_batch(&batch[0], nbatched);
+      for(int j = 0; j < nbatched; j++)
+        if(batch[j].mark != NO_MATCH_YET && batch[j].mark != NO_MATCH)
+          nmarked++;
+      nbatched = 0;
+    }
+    if(i == steps.size()) break;
+
+    const l7_bench_step & step = steps[i];
+    if(step.type == L7_CT_NEW)
+      ct->connection_new(keys[step.flow], tuples[step.flow]);
+    else if(step.type == L7_CT_DESTROY)
+      ct->connection_destroy(tuples[step.flow]);
+    else{
+      l7_queued_packet & packet = batch[nbatched++];
+      packet.data = packets + step.offset;
+      packet.len = step.len;
+      packet.id = i;
+      packet.wholemark = 0;
+      packet.headersonly = false;
+    }
+  }
+  double elapsed = now_ns() - start;
+
+  char name[64];
+  snprintf(name, sizeof(name), "macro.%u.", nconcurrent);
+  result(string(name) + "ns_per_packet", elapsed/npackets);
+  result(string(name) + "packets_per_s", npackets/elapsed*1e9);
+  result(string(name) + "mb_per_s", databytes/elapsed*1e3);
+  result(string(name) + "percent_marked", 100.0*nmarked/npackets);
+
+  for(unsigned int i = 0; i < nconcurrent; i++){
+    ct->connection_destroy(tuples[flows[i].id]);
+    ct->handle_events();
+  }
+  delete queue;
+  delete ct;
+}
+
+// Replays the packets of connections that conntrack has already told us
+// about, one at a time, and counts the memory allocated for each.  Once a
+// connection exists, the only allocation its packets should cause is its
+// buffer, when its first data comes; anything else is contention with the
+// conntrack thread for the allocator, on every packet.  Returns how many
+// other allocations there were.
+static unsigned long bench_allocations(l7_classify *classifier,
+                                       unsigned int nflows)
+{
+  l7_conntrack *ct = new l7_conntrack(classifier);
+  l7_queue *queue = new l7_queue(ct, NULL);
+  vector<l7_bench_flow> flows(nflows);
+  vector<string> keys;
+  vector<unsigned int> owner;
+  vector<size_t> offsets;
+  vector<unsigned int> lengths;
+  string trace;
+
+  for(unsigned int i = 0; i < nflows; i++){
+    start_flow(flows[i], i);
+    string packet = make_packet(flows[i].tuple, 0, 0, "");
+    keys.push_back(ct->make_key((const unsigned char *)packet.data(), false));
+  }
+
+  // Each connection's packets in turn, so that they are interleaved
+  for(bool more = true; more; ){
+    more = false;
+    for(unsigned int i = 0; i < nflows; i++){
+      l7_bench_flow & flow = flows[i];
+      if(flow.sent == flow.npackets) continue;
+      more = true;
+      int direction = direction_of(flow.kind, flow.sent);
+      string data = payload(flow.kind, flow.sent++);
+      string packet = make_packet(flow.tuple, direction, flow.seq[direction],
+                                  data);
+      flow.seq[direction] += data.size();
+      owner.push_back(i);
+      offsets.push_back(trace.size());
+      lengths.push_back(packet.size());
+      trace += packet;
+    }
+  }
+
+  for(unsigned int i = 0; i < nflows; i++)
+    ct->connection_new(keys[i], flows[i].tuple);
+  ct->handle_events();
+
+  unsigned long total = 0, unexpected = 0;
+  unsigned char *packets = (unsigned char *)&trace[0];
+  vector<bool> started(nflows, false);
+  l7_queued_packet packet;
+  for(unsigned int i = 0; i < offsets.size(); i++){
+    packet.data = packets + offsets[i];
+    packet.len = lengths[i];
+    packet.id = i;
+    packet.wholemark = 0;
+    packet.headersonly = false;
+
+    unsigned long before = nallocations;
+    counting_allocations = true;
+    queue->handle_batch(&packet, 1);
+    counting_allocations = false;
+    unsigned long n = nallocations - before;
+
+    total += n;
+    unsigned int allowed = started[owner[i]] ? 0 : 1;
+    started[owner[i]] = true;
+    if(n > allowed) unexpected += n - allowed;
+  }
+
+  result("alloc.packets", offsets.size());
+  result("alloc.per_packet", (double)total/offsets.size());
+  result("alloc.unexpected", unexpected);
+
+  for(unsigned int i = 0; i < nflows; i++)
+    ct->connection_destroy(flows[i].tuple);
+  ct->handle_events();
+  delete queue;
+  delete ct;
+  return unexpected;
+}
+
+static void usage(const char *progname)
+{
+  cerr << "Usage: " << progname << " [options]\n\n"
+       << "Options:\n"
+       << "  -f FILE   Use this configuration file.  By default every "
+          "pattern in the\n"
+       << "            pattern directory is used, or a built in set if "
+          "there are none.\n"
+       << "  -p DIR    Look for patterns here (default /etc/l7-protocols)\n"
+       << "  -t MS     Run each benchmark for about this long (default "
+       << ms << ")\n"
+       << "  -F LIST   Comma separated numbers of connections to time the "
+          "connection\n"
+       << "            table with (default 10000,100000,1000000)\n"
+       << "  -c N      Connections at a time in the whole-path benchmark "
+          "(default 10000)\n"
+       << "  -n N      Packets in the whole-path benchmark (default "
+          "200000)\n"
+       << "  -b N      Packets per batch in it (default " << L7_QUEUE_BATCH
+       << ")\n"
+       << "  -s SEED   Seed for the synthetic traffic (default 1)\n"
+       << "  -C N      Cache up to N classifications, as l7-filter's "
+          "--classify-cache\n"
+       << "  -a        Only check that packets of connections already known "
+          "don't\n"
+       << "            allocate memory, and exit with status 1 if they do.  "
+          "Uses the\n"
+       << "            built in patterns unless -f is given\n"
+       << "  -h        Show this message\n";
+}
+
+int main(int argc, char **argv)
+{
+  string conffilename = "";
+  string tablesizes = "10000,100000,1000000";
+  unsigned int nconcurrent = 10000, npackets = 200000;
+  unsigned int seed = 1;
+  int batchsize = L7_QUEUE_BATCH;
+  bool checkonly = false;
+  int c;
+
+  verbosity = -1;
+  buflen = 8*1500;
+
+  while((c = getopt(argc, argv, "f:p:t:F:c:n:b:s:C:ah")) != -1){
+    switch(c){
+      case 'f':
+        conffilename = optarg;
+        break;
+      case 'p':
+        l7dir = optarg;
+        break;
+      case 't':
+        ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'F':
+        tablesizes = optarg;
+        break;
+      case 'c':
+        nconcurrent = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        npackets = strtoul(optarg, NULL, 10);
+        break;
+      case 'b':
+        batchsize = atoi(optarg);
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'C':
+        classify_cache = strtoul(optarg, NULL, 10);
+        break;
+      case 'a':
+        checkonly = true;
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(0);
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+  if(nconcurrent == 0 || ms == 0 || batchsize < 1){
+    usage(argv[0]);
+    exit(1);
+  }
+  atexit(cleanup);
+  srandom(seed);
+
+  // -a uses the built in patterns unless given others, since installed
+  // ones may need regexec(), which would let it off checking anything
+  bool ownpatterns = conffilename != "";
+  if(conffilename == "" && !checkonly)
+    conffilename = config_for_all_patterns();
+  if(conffilename == "") conffilename = write_builtin_patterns();
+
+  l7_classify *classifier = new l7_classify(conffilename);
+
+  printf("# l7-bench from l7-filter v%s\n", VERSION);
+  printf("# patterns from %s\n", conffilename.c_str());
+  printf("bench.patterns %u\n", (unsigned int)classifier->get_patterns().size());
+
+  // glibc's regexec() allocates as it goes, so patterns it has to match
+  // allocate for every packet they look at
+  unsigned int nregex = 0;
+  const list<l7_pattern *> & patterns = classifier->get_patterns();
+  for(list<l7_pattern *>::const_iterator i = patterns.begin();
+      i != patterns.end(); i++)
+    if((*i)->get_engine() == "regex") nregex++;
+
+  if(checkonly){
+    unsigned long unexpected = bench_allocations(classifier, 1000);
+    delete classifier;
+    if(nregex && ownpatterns){
+      printf("# %u patterns use regexec, which allocates, so that isn't "
+             "counted against us\n", nregex);
+      return 0;
+    }
+    return unexpected ? 1 : 0;
+  }
+
+  bench_classify(classifier);
+  bench_append(classifier);
+  bench_keys(classifier);
+
+  char *list = strdup(tablesizes.c_str()), *save;
+  for(char *s = strtok_r(list, ",", &save); s; s = strtok_r(NULL, ",", &save))
+    if(strtoul(s, NULL, 10) > 0)
+      bench_table(classifier, strtoul(s, NULL, 10));
+  free(list);
+
+  printf("# whole path in batches of up to %d\n", batchsize);
+  bench_macro(classifier, nconcurrent, npackets, batchsize);
+
+  printf("# allocations by packets of known connections%s\n",
+         nregex ? ", including regexec's" : "");
+  bench_allocations(classifier, 1000);
+
+  delete classifier;
+  return 0;
+}
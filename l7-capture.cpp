@@ -0,0 +1,484 @@
+/*
+  Passive mode: classifies copies of packets from an interface or a pcap
+  file.  See l7-capture.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <cstring>
+
+#include "l7-capture.h"
+#include "util.h"
+
+// Seconds without a packet before we forget a connection
+unsigned int capture_timeout = 120;
+
+// The ring each capture thread shares with the kernel.  A block is handed
+// to us when it is full or, if traffic is slow, after BLOCK_TIMEOUT ms.
+#define L7_CAPTURE_BLOCK_SIZE (1 << 20)
+#define L7_CAPTURE_BLOCKS 32
+#define L7_CAPTURE_FRAME_SIZE 2048
+#define L7_CAPTURE_BLOCK_TIMEOUT 10
+
+// How often to look for connections that have gone quiet, in seconds
+#define L7_CAPTURE_EXPIRY_INTERVAL 10
+
+static void read_kernel_stats(void *data)
+{
+  ((l7_capture *)data)->read_kernel_stats();
+}
+
+l7_capture::l7_capture(l7_classify *classifier) :
+  npackets("capture.packets"), nignored("capture.ignored"),
+  nfragments("capture.fragments"), ntruncated("capture.truncated"),
+  nkerneldropped("capture.kerneldropped")
+{
+  tracker = new l7_conntrack(classifier);
+  queue = new l7_queue(tracker, NULL);
+  queue->track_connections();
+  nbatched = 0;
+  now = 0;
+  lastexpiry = 0;
+  fd = -1;
+  ring = NULL;
+}
+
+l7_capture::~l7_capture()
+{
+  if(ring) munmap(ring, L7_CAPTURE_BLOCK_SIZE*L7_CAPTURE_BLOCKS);
+  if(fd >= 0) close(fd);
+  delete queue;
+  delete tracker;
+}
+
+// Puts an IPv4 packet in the batch if it is TCP or UDP that we can look
+// at, and returns whether it did.  The packet has to stay where it is until
+// the batch is flushed.  There must be room in the batch.
+bool l7_capture::add_packet(unsigned char *ip, unsigned int len)
+{
+  npackets.add();
+  if(len < 20 || ip[0] >> 4 != 4 ||
+     (ip[9] != IPPROTO_TCP && ip[9] != IPPROTO_UDP)){
+    nignored.add();
+    return false;
+  }
+
+  // Only the first fragment has the ports, and conntrack would have put
+  // them back together for us, which isn't worth doing here.
+  if((ip[6] & 0x3f) || ip[7]){
+    nfragments.add();
+    return false;
+  }
+
+  unsigned int ip_hl = 4*(ip[0] & 0x0f);
+  unsigned int headers = ip_hl + (ip[9] == IPPROTO_TCP ? 20 : 8);
+  if(len >= ip_hl + 13 && ip[9] == IPPROTO_TCP)
+    headers = ip_hl + 4*(ip[ip_hl + 12] >> 4);
+  if(ip_hl < 20 || len < headers || headers < ip_hl + 8){
+    ntruncated.add();
+    return false;
+  }
+
+  // Leave off any padding at the end of the frame.  Large segments from
+  // GSO can say 0.
+  unsigned int totlen = ip[2] << 8 | ip[3];
+  if(totlen >= headers && totlen < len) len = totlen;
+
+  l7_queued_packet & packet = batch[nbatched++];
+  packet.qh = NULL;
+  packet.data = ip;
+  packet.len = len;
+  packet.id = 0;
+  packet.wholemark = 0;
+  packet.headersonly = false;
+  packet.time = now;
+  return true;
+}
+
+// Classifies what is in the batch.  There are no verdicts to give.
+void l7_capture::flush()
+{
+  if(nbatched) queue->handle_batch(batch, nbatched);
+  nbatched = 0;
+}
+
+// Moves the clock on to the time of the latest packet, forgetting
+// connections that have been quiet too long.
+void l7_capture::tick(u_int32_t time)
+{
+  if(time > now) now = time;
+  if(now - lastexpiry < L7_CAPTURE_EXPIRY_INTERVAL) return;
+  flush();
+  tracker->expire_connections(now, capture_timeout);
+  lastexpiry = now;
+}
+
+// Opens a TPACKET_V3 ring on the interface.  If fanoutgroup isn't -1, the
+// socket joins that fanout group, which spreads packets over its sockets by
+// a hash of their addresses and ports that is the same both ways.
+void l7_capture::open_interface(string interface, int fanoutgroup)
+{
+  fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+  if(fd < 0){
+    cerr << "Can't open a packet socket: " << strerror(errno)
+         << ".  Are you root?\n";
+    exit(1);
+  }
+
+  int version = TPACKET_V3;
+  if(setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                sizeof(version)) < 0){
+    cerr << "This kernel can't give us packets with TPACKET_V3.\n";
+    exit(1);
+  }
+
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = L7_CAPTURE_BLOCK_SIZE;
+  req.tp_block_nr = L7_CAPTURE_BLOCKS;
+  req.tp_frame_size = L7_CAPTURE_FRAME_SIZE;
+  req.tp_frame_nr = L7_CAPTURE_BLOCK_SIZE/L7_CAPTURE_FRAME_SIZE *
+                    L7_CAPTURE_BLOCKS;
+  req.tp_retire_blk_tov = L7_CAPTURE_BLOCK_TIMEOUT;
+  if(setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0){
+    cerr << "Can't set up the packet ring: " << strerror(errno) << endl;
+    exit(1);
+  }
+
+  ring = (char *)mmap(NULL, L7_CAPTURE_BLOCK_SIZE*L7_CAPTURE_BLOCKS,
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(ring == MAP_FAILED){
+    ring = NULL;
+    cerr << "Can't map the packet ring: " << strerror(errno) << endl;
+    exit(1);
+  }
+
+  struct sockaddr_ll ll;
+  memset(&ll, 0, sizeof(ll));
+  ll.sll_family = AF_PACKET;
+  ll.sll_protocol = htons(ETH_P_IP);
+  ll.sll_ifindex = if_nametoindex(interface.c_str());
+  if(ll.sll_ifindex == 0){
+    cerr << "There is no interface called " << interface << endl;
+    exit(1);
+  }
+  if(bind(fd, (struct sockaddr *)&ll, sizeof(ll)) < 0){
+    cerr << "Can't capture on " << interface << ": " << strerror(errno)
+         << endl;
+    exit(1);
+  }
+
+  // Mirrored traffic isn't addressed to us
+  struct packet_mreq mr;
+  memset(&mr, 0, sizeof(mr));
+  mr.mr_ifindex = ll.sll_ifindex;
+  mr.mr_type = PACKET_MR_PROMISC;
+  if(setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0)
+    cerr << "Warning: can't put " << interface << " in promiscuous mode.\n";
+
+  if(fanoutgroup >= 0){
+    int fanout = (fanoutgroup & 0xffff) |
+                 (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16;
+    if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                  sizeof(fanout)) < 0){
+      cerr << "Can't spread packets over capture threads: "
+           << strerror(errno) << endl;
+      exit(1);
+    }
+  }
+
+  l7_stats_add_hook(::read_kernel_stats, this);
+  l7printf(1, "Capturing on %s\n", interface.c_str());
+}
+
+// Reads packets from the ring for ever.  Each block's packets are worked
+// on in batches where they are, and then the block goes back to the kernel.
+void l7_capture::run_interface()
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN | POLLERR;
+  unsigned int block = 0;
+
+  while(true){
+    struct tpacket_block_desc *desc = (struct tpacket_block_desc *)
+      (ring + block*L7_CAPTURE_BLOCK_SIZE);
+
+    if(!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+         TP_STATUS_USER)){
+      // Quiet connections still need forgetting if nothing comes
+      if(poll(&pfd, 1, 1000) == 0) tick(time(NULL));
+      continue;
+    }
+
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)
+      ((char *)desc + desc->hdr.bh1.offset_to_first_pkt);
+    for(u_int32_t i = 0; i < desc->hdr.bh1.num_pkts; i++){
+      tick(hdr->tp_sec);
+      if(nbatched == L7_QUEUE_BATCH) flush();
+      add_packet((unsigned char *)hdr + hdr->tp_net, hdr->tp_snaplen);
+      hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+    }
+
+    flush();
+    __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    block = (block + 1) % L7_CAPTURE_BLOCKS;
+  }
+}
+
+// Finds where the IPv4 header is in a frame with the given pcap link type.
+// Returns false if there isn't one.
+static bool find_ip(u_int32_t linktype, const unsigned char *frame,
+                    unsigned int caplen, unsigned int & offset)
+{
+  unsigned int ethertype;
+
+  switch(linktype){
+    case 1: // Ethernet, maybe with VLAN tags
+      offset = 12;
+      while(true){
+        if(caplen < offset + 2) return false;
+        ethertype = frame[offset] << 8 | frame[offset + 1];
+        offset += 2;
+        if(ethertype != 0x8100 && ethertype != 0x88a8) break;
+        offset += 2; // the rest of the tag
+      }
+      return ethertype == ETH_P_IP;
+    case 113: // Linux "cooked", from capturing on "any"
+      offset = 16;
+      return caplen >= offset && (frame[14] << 8 | frame[15]) == ETH_P_IP;
+    case 276: // the same, version 2
+      offset = 20;
+      return caplen >= offset && (frame[0] << 8 | frame[1]) == ETH_P_IP;
+    case 12: case 14: case 101: case 228: // just IP
+      offset = 0;
+      return true;
+  }
+  return false;
+}
+
+static u_int32_t swap32(u_int32_t x, bool swapped)
+{
+  return swapped ? __builtin_bswap32(x) : x;
+}
+
+static u_int16_t swap16(u_int16_t x, bool swapped)
+{
+  return swapped ? __builtin_bswap16(x) : x;
+}
+
+static bool known_linktype(u_int32_t linktype)
+{
+  return linktype == 1 || linktype == 113 || linktype == 276 ||
+         linktype == 12 || linktype == 14 || linktype == 101 ||
+         linktype == 228;
+}
+
+// Reads and classifies the packets in a pcap file, as though they had come
+// from an interface.  Their times come from the file, so connections expire
+// as they would have.
+void l7_capture::run_pcap(string filename)
+{
+  FILE *f = fopen(filename.c_str(), "r");
+  if(!f){
+    cerr << "Can't open " << filename << ": " << strerror(errno) << endl;
+    exit(1);
+  }
+
+  u_int32_t header[6];
+  bool swapped = false;
+  if(fread(header, sizeof(header), 1, f) != 1) header[0] = 0;
+  switch(header[0]){
+    case 0xa1b2c3d4: case 0xa1b23c4d: // microseconds or nanoseconds
+      break;
+    case 0xd4c3b2a1: case 0x4d3cb2a1:
+      swapped = true;
+      break;
+    case 0x0a0d0d0a: // pcapng, which reads the same either way round
+      rewind(f);
+      run_pcapng(f, filename);
+      fclose(f);
+      flush();
+      return;
+    default:
+      cerr << filename << " isn't a pcap or pcapng file.\n";
+      exit(1);
+  }
+  u_int32_t linktype = swap32(header[5], swapped) & 0xffff;
+  if(!known_linktype(linktype)){
+    cerr << "Can't read packets with link type " << linktype << " from "
+         << filename << endl;
+    exit(1);
+  }
+
+  u_int32_t record[4]; // seconds, fraction, length here, length on the wire
+  unsigned int offset;
+  while(fread(record, sizeof(record), 1, f) == 1){
+    u_int32_t caplen = swap32(record[2], swapped);
+    if(caplen > 0x40000){
+      cerr << filename << " looks corrupt, stopping here\n";
+      break;
+    }
+
+    tick(swap32(record[0], swapped));
+    if(nbatched == L7_QUEUE_BATCH) flush();
+    vector<unsigned char> & copy = copies[nbatched];
+    copy.resize(caplen + 1);
+    if(fread(&copy[0], 1, caplen, f) != caplen){
+      cerr << filename << " ends in the middle of a packet\n";
+      break;
+    }
+
+    if(!find_ip(linktype, &copy[0], caplen, offset)){
+      npackets.add();
+      nignored.add();
+      continue;
+    }
+    add_packet(&copy[0] + offset, caplen - offset);
+  }
+
+  fclose(f);
+  flush();
+}
+
+// Reads the packets in a pcapng file, such as those that --record writes
+// (see l7-record.h).  Each section says which byte order the rest of it is
+// in, and each interface its link type and how finely it keeps time.
+// Packets from interfaces we can't read are ignored.
+void l7_capture::run_pcapng(FILE *f, string filename)
+{
+  vector<u_int32_t> linktypes;
+  vector<u_int64_t> ticks; // of each interface's clock in a second
+  bool swapped = false;
+  u_int32_t header[2]; // block type, block length
+  unsigned int offset;
+
+  while(fread(header, sizeof(header), 1, f) == 1){
+    u_int32_t magic = 0;
+    if(header[0] == 0x0a0d0d0a){
+      // A new section, whose byte order is only known from what follows
+      if(fread(&magic, sizeof(magic), 1, f) != 1) break;
+      if(magic != 0x1a2b3c4d && magic != 0x4d3c2b1a){
+        cerr << filename << " looks corrupt, stopping here\n";
+        break;
+      }
+      swapped = magic == 0x4d3c2b1a;
+      linktypes.clear();
+      ticks.clear();
+    }
+
+    u_int32_t type = swap32(header[0], swapped);
+    u_int32_t blocklen = swap32(header[1], swapped);
+    unsigned int done = sizeof(header) + (magic ? sizeof(magic) : 0);
+    if(blocklen < done + 4 || blocklen % 4 || blocklen > 0x40000 + 1024){
+      cerr << filename << " looks corrupt, stopping here\n";
+      break;
+    }
+
+    // The rest of the block, of which the last 4 bytes are its length again
+    if(nbatched == L7_QUEUE_BATCH) flush();
+    vector<unsigned char> & block = copies[nbatched];
+    unsigned int bodylen = blocklen - done - 4;
+    block.resize(blocklen - done + 1);
+    if(fread(&block[0], 1, blocklen - done, f) != blocklen - done){
+      cerr << filename << " ends in the middle of a block\n";
+      break;
+    }
+    const unsigned char *body = &block[0];
+
+    if(type == 1 && bodylen >= 8){ // an interface
+      u_int16_t linktype;
+      memcpy(&linktype, body, 2);
+      linktypes.push_back(swap16(linktype, swapped));
+
+      // Microseconds, unless an if_tsresol option says otherwise
+      u_int64_t persecond = 1000000;
+      unsigned int o = 8;
+      while(o + 4 <= bodylen){
+        u_int16_t option[2];
+        memcpy(option, body + o, 4);
+        u_int16_t code = swap16(option[0], swapped);
+        u_int16_t len = swap16(option[1], swapped);
+        if(code == 0 || o + 4 + len > bodylen) break;
+        if(code == 9 && len >= 1){
+          unsigned char resolution = body[o + 4];
+          persecond = 1;
+          for(int i = 0; i < (resolution & 0x7f) && persecond < 1e18; i++)
+            persecond *= resolution & 0x80 ? 2 : 10;
+        }
+        o += 4 + ((len + 3) & ~3);
+      }
+      ticks.push_back(persecond);
+    }
+    else if(type == 6 && bodylen >= 20){ // a packet
+      u_int32_t fields[5]; // interface, time high, time low, lengths
+      memcpy(fields, body, sizeof(fields));
+      u_int32_t interface = swap32(fields[0], swapped);
+      u_int32_t caplen = swap32(fields[3], swapped);
+      if(caplen > bodylen - 20 || interface >= linktypes.size()){
+        cerr << filename << " looks corrupt, stopping here\n";
+        break;
+      }
+
+      u_int64_t time = (u_int64_t)swap32(fields[1], swapped) << 32 |
+                       swap32(fields[2], swapped);
+      tick(time/ticks[interface]);
+      // If that flushed the batch, the packet has to move to the front of
+      // it, since where it is now will be read into before it is looked at
+      vector<unsigned char> & copy = copies[nbatched];
+      if(&copy != &block) copy.swap(block);
+      unsigned char *frame = &copy[0] + 20;
+
+      if(!known_linktype(linktypes[interface]) ||
+         !find_ip(linktypes[interface], frame, caplen, offset)){
+        npackets.add();
+        nignored.add();
+        continue;
+      }
+      add_packet(frame + offset, caplen - offset);
+    }
+    // Anything else (statistics, name resolution, ...) we don't need
+  }
+}
+
+// Forgets all the connections, for when there are no more packets
+void l7_capture::finish()
+{
+  flush();
+  tracker->expire_connections(now, 0);
+}
+
+// Collects the kernel's count of packets it had no room for in the ring.
+// Reading it resets it.
+void l7_capture::read_kernel_stats()
+{
+  struct tpacket_stats_v3 stats;
+  socklen_t len = sizeof(stats);
+  if(fd >= 0 && getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &stats,
+                           &len) == 0)
+    nkerneldropped.add(stats.tp_drops);
+}
@@ -0,0 +1,69 @@
+/*
+  Passive mode: classifies copies of packets, from an interface that sees
+  mirrored traffic (a span port or tap) or from a pcap file, instead of
+  packets that wait in NFQUEUE for us.  Nothing waits on us, so a slow
+  pattern or a crash costs nothing but results, and the results go out
+  the usual ways (the event log, the shared table and standard out)
+  instead of as marks.
+
+  With no conntrack to tell us about connections, we follow them
+  ourselves (see l7_queue::track_connections()).  Each capture thread has
+  its own table of connections and its own socket, in a fanout group that
+  gives all of a connection's packets, both ways, to the same socket.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_CAPTURE_H
+#define L7_CAPTURE_H
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "l7-conntrack.h"
+#include "l7-queue.h"
+#include "l7-stats.h"
+
+using namespace std;
+
+class l7_capture {
+ private:
+  l7_conntrack *tracker;
+  l7_queue *queue;
+  l7_queued_packet batch[L7_QUEUE_BATCH];
+  int nbatched;
+  vector<unsigned char> copies[L7_QUEUE_BATCH]; // packets read from files
+  u_int32_t now;        // the time of the latest packet
+  u_int32_t lastexpiry;
+  int fd;               // the packet socket, or -1
+  char *ring;           // its blocks of packets, shared with the kernel
+
+  bool add_packet(unsigned char *ip, unsigned int len);
+  void flush();
+  void tick(u_int32_t time);
+  void run_pcapng(FILE *f, string filename);
+
+ public:
+  l7_counter npackets;
+  l7_counter nignored;
+  l7_counter nfragments;
+  l7_counter ntruncated;
+  l7_counter nkerneldropped;
+
+  l7_capture(l7_classify *classifier);
+  ~l7_capture();
+  void open_interface(string interface, int fanoutgroup);
+  void run_interface();
+  void run_pcap(string filename);
+  void finish();
+  void read_kernel_stats();
+};
+
+#endif
@@ -27,6 +27,9 @@ using namespace std;
 #include <errno.h>
 #include <signal.h>
 #include <dirent.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
 
 #define MAX_SUBDIRS 128
 #define MAX_FN_LEN 256
@@ -39,27 +42,118 @@ unsigned int markmask = 0xffffffff; // the mask itself
 unsigned int maskfirstbit = 0; // how far from the LSB does our region start?
 unsigned int masknbits = 32;
 
+// Guard against patterns that take too long on some data.  regexec() can't
+// be interrupted, so this is checked after each match.
+unsigned int pattern_budget = 0; // microseconds per match, 0 for no limit
+unsigned int quarantine_after = 0; // overruns before a pattern is disabled,
+                                   // 0 for never
+int overrun_giveup = 0; // give up on a connection that made a pattern overrun
+
+// Give up on a connection once this many bytes of its data have looked
+// encrypted or compressed (see l7_looks_random()), 0 for never
+unsigned int entropy_giveup = 0;
+
+// Pieces of data shorter than this say too little about how their bytes
+// are spread out, and only this much of longer ones is looked at
+#define L7_ENTROPY_MIN 128
+#define L7_ENTROPY_MAX 2048
+
+// c*log2(c), so that the entropy of a piece of data is a table lookup for
+// each byte value in it.  Filled in by l7_classify's constructor.
+static float clog2c[L7_ENTROPY_MAX + 1];
+
+// Remember what classify() said in a table of this many entries (rounded up
+// to a power of two), 0 for not at all
+unsigned int classify_cache = 0;
+
+// These are the defaults and upper limits for the pattern's own windows
+extern int maxpackets;
+extern unsigned int buflen;
+
 #include "l7-classify.h"
 #include "l7-queue.h"
 #include "l7-parse-patterns.h"
+#include "l7-overload.h"
 #include "util.h"
 
+// auto uses the matchers compiled into l7-filter where there are any (see
+// l7-compiled.h) and the bit-parallel NFA for every other pattern that fits
+// in one (see l7-nfa.h), nfa uses the NFA but complains about the patterns
+// that don't fit, and regex uses regexec() for everything.
+int pattern_engine = L7_ENGINE_AUTO;
+
+static l7_counter nquarantined("patterns.quarantined");
+static l7_counter novergiveups("patterns.overrungiveups");
+static l7_counter ncompiled("patterns.compiled");
+static l7_counter nnfa("patterns.nfa");
+static l7_counter nregex("patterns.regex");
+static l7_counter nskipped("overload.patternsskipped");
+static l7_counter ncachehits("classify.cachehits");
+static l7_counter ncachemisses("classify.cachemisses");
+static l7_counter ncachehitpercent("classify.cachehitpercent");
+
 l7_pattern::l7_pattern(string name, string pattern_string, int eflags, 
-  int cflags, int mark)
+  int cflags, int mark) :
+  noverruns("pattern." + name + ".overruns"),
+  maxusec("pattern." + name + ".maxusec")
 {
   this->name = name;
+  quarantined = 0;
+  window_packets = maxpackets;
+  window_bytes = buflen;
+  lowpriority = false;
+  highentropy = false;
   this->pattern_string = pattern_string;
   this->eflags = eflags;
   this->cflags = cflags;
   this->mark = mark;
   char *preprocessed = pre_process(pattern_string.c_str());
-  
+  regex_string = preprocessed;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
   int rc = regcomp(&preg, preprocessed, cflags);
   if (rc != 0){
     cerr << "error compiling " << name << " -- " << pattern_string << endl;
     exit(1);
   }
+
+  // regcomp() has made sure it is valid, so anything the NFA can't take is 
+  // something it doesn't handle, not a mistake.
+  nfa = NULL;
+  compiled = NULL;
+  if(pattern_engine == L7_ENGINE_AUTO && l7_ncompiled()){
+    string why;
+    compiled = l7_find_compiled(name, regex_string, cflags, eflags, why);
+    if(compiled)
+      l7printf(2, "%s: compiled in, %u NFA states\n", name.c_str(),
+               compiled->npositions);
+    else if(why != "")
+      l7printf(0, "Not using the compiled in matcher for %s: %s\n",
+               name.c_str(), why.c_str());
+  }
+  if(compiled) engine_note = "compiled in";
+  else if(pattern_engine != L7_ENGINE_REGEX){
+    string why;
+    nfa = l7_nfa::compile(preprocessed, cflags, eflags, why);
+    engine_note = why;
+    if(nfa)
+      l7printf(2, "%s: %u NFA states\n", name.c_str(), nfa->get_positions());
+    else if(pattern_engine == L7_ENGINE_NFA)
+      cerr << "Warning: can't use the NFA engine for " << name << " (" 
+           << why << "), using regexec() instead.\n";
+    else
+      l7printf(1, "Using regexec() for %s: %s\n", name.c_str(), why.c_str());
+  }
+  else engine_note = "--engine regex";
+  if(compiled) ncompiled.add();
+  else if(nfa) nnfa.add();
+  else nregex.add();
   free(preprocessed);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  compile_usec = (end.tv_sec - start.tv_sec)*1000000 + 
+                 (end.tv_nsec - start.tv_nsec)/1000;
 }
 
 
@@ -131,16 +225,139 @@ char * l7_pattern::pre_process(const char * s)
 }
 
 
-bool l7_pattern::matches(char *buffer) 
+// len is the length of the data in buffer, which is also null terminated
+bool l7_pattern::matches(char *buffer, unsigned int len) 
 {  
-  int rc = regexec(&preg, buffer, 0, NULL, eflags);
+  int rc;
+
+  if(compiled)
+    return compiled->matches(buffer, len > window_bytes ? window_bytes : len);
+  if(nfa)
+    return nfa->matches(buffer, len > window_bytes ? window_bytes : len);
+
+  if(len > window_bytes){
+    // Only look at the part of the data that's in our window
+    regmatch_t window;
+    window.rm_so = 0;
+    window.rm_eo = window_bytes;
+    rc = regexec(&preg, buffer, 1, &window, eflags|REG_STARTEND);
+  }
+  else
+    rc = regexec(&preg, buffer, 0, NULL, eflags);
 
   if(rc == 0)	return true;
   else		return false;
 }
 
 
-string l7_pattern::getName() 
+// Records that a match took usec microseconds, which is over budget.
+// Returns true if the pattern is (now) quarantined.
+bool l7_pattern::overran(unsigned long usec)
+{
+  noverruns.add();
+  l7printf(1, "Pattern %s took %lu microseconds, over its budget of %u\n",
+           name.c_str(), usec, pattern_budget);
+
+  if(quarantine_after && noverruns.get() >= quarantine_after &&
+     __sync_bool_compare_and_swap(&quarantined, 0, 1)){
+    nquarantined.add();
+    cerr << "Quarantining pattern " << name << ": it has gone over its "
+         << pattern_budget << " microsecond budget " << noverruns.get()
+         << " times.  It won't be used again.\n";
+  }
+  return quarantined;
+}
+
+
+// Sets how far into a connection this pattern looks.  Zero means use the 
+// global limit (-n or -b), which is also the most that is allowed.
+void l7_pattern::set_window(unsigned int packets, unsigned int bytes)
+{
+  if(packets > (unsigned int)maxpackets || bytes > buflen)
+    l7printf(1, "%s asks to look further into connections than -n or -b "
+                "allow.  Using the smaller value.\n", name.c_str());
+
+  if(packets && packets < (unsigned int)maxpackets) window_packets = packets;
+  if(bytes && bytes < buflen) window_bytes = bytes;
+}
+
+
+unsigned int l7_pattern::get_window_packets()
+{
+  return window_packets;
+}
+
+
+unsigned int l7_pattern::get_window_bytes()
+{
+  return window_bytes;
+}
+
+
+void l7_pattern::set_low_priority(bool low)
+{
+  lowpriority = low;
+}
+
+bool l7_pattern::is_low_priority()
+{
+  return lowpriority;
+}
+
+void l7_pattern::set_high_entropy(bool high)
+{
+  highentropy = high;
+}
+
+bool l7_pattern::is_high_entropy()
+{
+  return highentropy;
+}
+
+bool l7_pattern::is_quarantined()
+{
+  return quarantined;
+}
+
+
+string l7_pattern::get_engine()
+{
+  if(compiled) return "compiled";
+  return nfa ? "nfa" : "regex";
+}
+
+
+string l7_pattern::get_engine_note()
+{
+  return engine_note;
+}
+
+
+const l7_nfa *l7_pattern::get_nfa()
+{
+  return nfa;
+}
+
+
+string l7_pattern::get_regex()
+{
+  return regex_string;
+}
+
+
+int l7_pattern::get_cflags()
+{
+  return cflags;
+}
+
+
+unsigned long l7_pattern::get_compile_usec()
+{
+  return compile_usec;
+}
+
+
+const string & l7_pattern::getName() 
 {
   return name;
 }
@@ -233,6 +450,55 @@ static string findpatternfile(string protocol)
   exit(1);
 }
 
+// MurmurHash3's finalizer: every bit of k affects every bit of the result
+static inline u_int64_t mix64(u_int64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// Hashes len bytes eight at a time, in four lanes that don't depend on
+// each other so that their multiplies overlap.  This isn't a cryptographic
+// hash, but the seed is picked when l7-filter starts, so which data
+// collides can't be worked out in advance.
+static u_int64_t hash_buffer(const char *buffer, unsigned int len,
+                             u_int64_t seed)
+{
+  const u_int64_t k = 0x9e3779b97f4a7c15ULL;
+  u_int64_t h[4] = { seed, seed + k, seed + 2*k, seed + 3*k };
+  const char *p = buffer;
+  unsigned int left = len;
+  u_int64_t w;
+
+  for(; left >= 32; p += 32, left -= 32)
+    for(int i = 0; i < 4; i++){
+      memcpy(&w, p + 8*i, 8);
+      h[i] = (h[i] ^ w)*k;
+      h[i] ^= h[i] >> 29;
+    }
+  for(; left >= 8; p += 8, left -= 8){
+    memcpy(&w, p, 8);
+    h[0] = (h[0] ^ w)*k;
+    h[0] ^= h[0] >> 29;
+  }
+  w = 0;
+  memcpy(&w, p, left);
+
+  u_int64_t result = mix64(h[0] ^ w ^ len);
+  for(int i = 1; i < 4; i++) result = mix64(result ^ h[i]);
+  return result;
+}
+
+static void update_hit_percent(void *)
+{
+  unsigned long hits = ncachehits.get(), total = hits + ncachemisses.get();
+  ncachehitpercent.set(total ? hits*100/total : 0);
+}
+
 // Loads in the configuration file
 l7_classify::l7_classify(string filename)
 {
@@ -286,12 +552,14 @@ l7_classify::l7_classify(string filename)
 
     if(add_pattern_from_file(patternfile, mk)){
       nrules++;
+      string engine = patterns.back()->get_engine();
       if(markmask == 0xffffffff)
-        l7printf(0, "Added: %s\tmark=%d\n", proto.c_str(), mk);
+        l7printf(0, "Added: %s\tmark=%d\tengine=%s\n", proto.c_str(), mk,
+                 engine.c_str());
       else
         l7printf(0, "Added: %s\tGiven mark=%d\t"
-                    "Actual mark (after applying mask)=%#08x\n",
-                    proto.c_str(), mk, (mk << maskfirstbit));
+                    "Actual mark (after applying mask)=%#08x\tengine=%s\n",
+                    proto.c_str(), mk, (mk << maskfirstbit), engine.c_str());
     }
   }
 
@@ -299,12 +567,56 @@ l7_classify::l7_classify(string filename)
     cerr << "No valid rules, exiting.\n";
     exit(1);
   }
+
+  if(entropy_giveup){
+    clog2c[0] = 0;
+    for(int c = 1; c <= L7_ENTROPY_MAX; c++) clog2c[c] = c*log2(c);
+  }
+
+  cache = NULL;
+  cachemask = 0;
+  generation = 0;
+  if(classify_cache){
+    u_int64_t entries = 1;
+    while(entries < classify_cache) entries *= 2;
+    cache = (l7_classify_cache_entry *)calloc(entries, sizeof(*cache));
+    if(!cache){
+      cerr << "Out of memory for the classification cache\n";
+      exit(1);
+    }
+    cachemask = entries - 1;
+    cacheseed = mix64(l7_now_ns() ^ (u_int64_t)getpid() << 32);
+    l7_stats_add_hook(update_hit_percent, NULL);
+    l7printf(1, "Caching classifications in %llu entries\n",
+             (unsigned long long)entries);
+  }
 }
 
 
 l7_classify::~l7_classify() 
 {
+  free(cache);
+}
+
+// Whether data looks encrypted or compressed: are its bytes about as
+// evenly spread out as random ones would be?  For n random bytes (other than
+// 0, which is never in a buffer) the entropy is close to 
+// log2(255) - 254/(2n ln 2) bits per byte.  Half a bit less than that is
+// well above what text, or even base64, reaches, and well below what
+// random data ever comes out as.
+bool l7_looks_random(const char *data, unsigned int len)
+{
+  if(len < L7_ENTROPY_MIN) return false;
+  if(len > L7_ENTROPY_MAX) len = L7_ENTROPY_MAX;
+
+  unsigned int counts[256];
+  memset(counts, 0, sizeof(counts));
+  for(unsigned int i = 0; i < len; i++) counts[(unsigned char)data[i]]++;
 
+  float sum = 0;
+  for(int c = 0; c < 256; c++) sum += clog2c[counts[c]];
+  float entropy = log2(len) - sum/len;
+  return entropy >= log2(255) - 254/(2*len*M_LN2) - 0.5;
 }
 
 // Returns 1 on sucess, 0 on failure
@@ -312,10 +624,11 @@ int l7_classify::add_pattern_from_file(string filename, int mark)
 {
   int eflags, cflags;
   string pattern = "";
+  pattern_attributes attributes;
 
   l7printf(2, "Attempting to load pattern from %s\n", filename.c_str());
 
-  if(!parse_pattern_file(cflags, eflags, pattern, filename)){
+  if(!parse_pattern_file(cflags, eflags, pattern, attributes, filename)){
     cerr << "Failed to parse pattern file " << filename << endl;
     return 0;
   }
@@ -324,17 +637,170 @@ int l7_classify::add_pattern_from_file(string filename, int mark)
   l7printf(2, "eflags=%d cflags=%d\n", eflags, cflags);
 
   l7_pattern *l7p=new l7_pattern(basename(filename),pattern,eflags,cflags,mark);
+  l7p->set_window(attributes.maxpackets, attributes.maxbytes);
+  l7p->set_low_priority(attributes.lowpriority);
+  l7p->set_high_entropy(attributes.highentropy);
+  l7printf(2, "window: %d packets, %d bytes\n", l7p->get_window_packets(),
+           l7p->get_window_bytes());
   patterns.push_back(l7p);
   return 1;
 }
 
-int l7_classify::classify(char * buffer) 
+// Returns the number of packets into a connection after which no pattern 
+// that is still in use wants to look.
+unsigned int l7_classify::get_window_packets()
+{
+  unsigned int most = 0;
+  list<l7_pattern *>::iterator current = patterns.begin();
+  for(; current != patterns.end(); current++)
+    if(!(*current)->is_quarantined() && 
+       (*current)->get_window_packets() > most)
+      most = (*current)->get_window_packets();
+  // When overloaded, only half as far (see l7-overload.h)
+  if(l7_load_level >= L7_LOAD_SHALLOW && most > 1)
+    most = (most + 1)/2;
+  return most;
+}
+
+// Same, but for the number of bytes
+unsigned int l7_classify::get_window_bytes()
+{
+  unsigned int most = 0;
+  list<l7_pattern *>::iterator current = patterns.begin();
+  for(; current != patterns.end(); current++)
+    if(!(*current)->is_quarantined() && (*current)->get_window_bytes() > most)
+      most = (*current)->get_window_bytes();
+  return most;
+}
+
+// Whether any pattern that might still match wants data that looks
+// encrypted or compressed
+bool l7_classify::wants_random(unsigned int oldlen, unsigned int packetnum)
 {
+  list<l7_pattern *>::iterator current = patterns.begin();
+  for(; current != patterns.end(); current++)
+    if((*current)->is_high_entropy() && !(*current)->is_quarantined() &&
+       packetnum <= (*current)->get_window_packets() &&
+       oldlen < (*current)->get_window_bytes())
+      return true;
+  return false;
+}
+
+// Returns the name of the pattern that gives this mark, or "" if none does
+const string & l7_classify::get_name(int mark)
+{
+  static const string none = "";
+  list<l7_pattern *>::iterator current = patterns.begin();
+  for(; current != patterns.end(); current++)
+    if((*current)->getMark() == mark)
+      return (*current)->getName();
+  return none;
+}
+
+// For tools (l7-patterncheck) that want to look at each pattern
+const list<l7_pattern *> & l7_classify::get_patterns()
+{
+  return patterns;
+}
+
+static unsigned long usec_since(const struct timespec & start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec)*1000000 + 
+         (now.tv_nsec - start.tv_nsec)/1000;
+}
+
+// What a classification is remembered under.  Never 0, which is what an
+// empty entry would match.
+u_int64_t l7_classify::cache_key(const char *buffer, unsigned int oldlen,
+                                 unsigned int len, unsigned int packetnum)
+{
+  u_int64_t key = hash_buffer(buffer, len, cacheseed ^ generation);
+  key = mix64(key ^ ((u_int64_t)oldlen << 32 | packetnum));
+  if(l7_load_level >= L7_LOAD_ESSENTIAL) key = mix64(key ^ 1);
+  return key | 1;
+}
+
+// buffer holds len bytes of the connection's data, of which the first 
+// oldlen were there when we last tried.  packetnum is the number of the 
+// packet that brought the rest.
+int l7_classify::classify(char * buffer, unsigned int oldlen, 
+                          unsigned int len, unsigned int packetnum) 
+{
+  bool cacheable;
+  if(!cache) return classify_uncached(buffer, oldlen, len, packetnum,
+                                      cacheable);
+
+  // Patterns only look at the data, so the same data gets the same answer
+  u_int64_t key = cache_key(buffer, oldlen, len, packetnum);
+  l7_classify_cache_entry *entry = &cache[key & cachemask];
+  u_int64_t mark = entry->mark;
+  if((entry->check ^ mark) == key){
+    ncachehits.add();
+    return (int)mark;
+  }
+
+  ncachemisses.add();
+  int result = classify_uncached(buffer, oldlen, len, packetnum, cacheable);
+  if(cacheable){
+    entry->mark = (u_int32_t)result;
+    entry->check = key ^ (u_int32_t)result;
+  }
+  return result;
+}
+
+// cacheable is set to false if the answer depended on how long matching
+// took rather than only on the data
+int l7_classify::classify_uncached(char * buffer, unsigned int oldlen,
+                                   unsigned int len, unsigned int packetnum,
+                                   bool & cacheable)
+{
+  cacheable = true;
   list<l7_pattern *>::iterator current = patterns.begin();
   while (current != patterns.end()) {
+    // Skip patterns that are disabled, that don't look this far into 
+    // connections, or that have already seen all the data they want to.
+    if((*current)->is_quarantined() || 
+       packetnum > (*current)->get_window_packets() ||
+       oldlen >= (*current)->get_window_bytes()){
+      current++;
+      continue;
+    }
+
+    // When overloaded, only the ones that matter most
+    if(l7_load_level >= L7_LOAD_ESSENTIAL && (*current)->is_low_priority()){
+      nskipped.add();
+      current++;
+      continue;
+    }
+
     l7printf(3, "checking against %s\n", (*current)->getName().c_str());
 
-    if((*current)->matches(buffer)){
+    struct timespec start;
+    if(pattern_budget) clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bool matched = (*current)->matches(buffer, len);
+
+    if(pattern_budget){
+      unsigned long usec = usec_since(start);
+      (*current)->maxusec.max(usec);
+      if(usec > pattern_budget){
+        if((*current)->overran(usec))
+          __sync_fetch_and_add(&generation, 1);
+        if(overrun_giveup && !matched){
+          // Whatever is in this connection is expensive to look at.  Don't
+          // let it do it again.
+          novergiveups.add();
+          l7printf(1, "Giving up on connection that made %s overrun\n",
+                   (*current)->getName().c_str());
+          cacheable = false;
+          return NO_MATCH;
+        }
+      }
+    }
+
+    if(matched){
       l7printf(1, "matched %s\n", (*current)->getName().c_str());
       return (*current)->getMark();
     }
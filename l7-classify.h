@@ -25,6 +25,12 @@ using namespace std;
 #include <sys/types.h>
 #include <regex.h>
 #include "l7-conntrack.h"
+#include "l7-stats.h"
+#include "l7-nfa.h"
+#include "l7-compiled.h"
+
+// Which engine patterns are matched with (--engine)
+enum { L7_ENGINE_AUTO, L7_ENGINE_REGEX, L7_ENGINE_NFA };
 
 
 class l7_pattern {
@@ -33,32 +39,91 @@ class l7_pattern {
   int mark; // this is the mark as it appears in the config file
             // before it goes to netfilter, it will get modified by the mask
   string pattern_string;
+  string regex_string; // pattern_string with \x escapes turned into bytes
   int eflags; // for regexec
   int cflags; // for regcomp
   string name;
   regex_t preg;//the compiled regex
+  l7_nfa *nfa; // the same, for the bit-parallel engine, or NULL if unused
+  const l7_compiled_matcher *compiled; // built in (see l7-compiled.h)
+  string engine_note; // why the NFA isn't used, if it isn't
+  unsigned long compile_usec; // how long compiling took
   char * pre_process(const char * s);
   int hex2dec(char c);
+  volatile int quarantined; // set once it has run over its budget too often
+  unsigned int window_packets; // only try the first this many packets
+  unsigned int window_bytes;   // and only this many bytes of them
+  bool lowpriority; // skipped when overloaded (see l7-overload.h)
+  bool highentropy; // can match data that looks encrypted or compressed
 
  public:
+  l7_counter noverruns; // times matching took longer than pattern_budget
+  l7_counter maxusec;   // longest a single match has taken, if timing
+
   l7_pattern(string name,string pattern_string,int eflags,int cflags,int mark);
   ~l7_pattern();
-  bool matches(char * buffer);
-  string getName();
+  bool matches(char * buffer, unsigned int len);
+  void set_window(unsigned int packets, unsigned int bytes);
+  void set_low_priority(bool low);
+  bool is_low_priority();
+  void set_high_entropy(bool high);
+  bool is_high_entropy();
+  unsigned int get_window_packets();
+  unsigned int get_window_bytes();
+  bool overran(unsigned long usec);
+  bool is_quarantined();
+  string get_engine();
+  string get_engine_note();
+  const l7_nfa *get_nfa();
+  string get_regex();
+  int get_cflags();
+  unsigned long get_compile_usec();
+  const string & getName();
   int getMark();
 };
 
+// A classification remembered by l7_classify's cache (--classify-cache).
+// check is the entry's key XORed with mark.  Each is written on its own, so
+// a reader that gets half of one write and half of another finds that they
+// don't go together, and it needs no lock.
+struct l7_classify_cache_entry {
+  volatile u_int64_t check;
+  volatile u_int64_t mark;
+};
+
 class l7_classify {
 
  private:
   int add_pattern_from_file(const string filename, int mark);
   list<l7_pattern *> patterns;
+
+  // Results of classify() by what it was given: the data, how much of it
+  // is new and which packet it is.  Which patterns are tried also depends
+  // on those that are quarantined and on the load level, so generation
+  // changes whenever a pattern is quarantined, and the load level goes in
+  // the key too.
+  l7_classify_cache_entry *cache; // NULL if not caching
+  u_int64_t cachemask;            // entries - 1
+  u_int64_t cacheseed;
+  volatile unsigned int generation;
+  u_int64_t cache_key(const char *buffer, unsigned int oldlen,
+                      unsigned int len, unsigned int packetnum);
+  int classify_uncached(char * buffer, unsigned int oldlen, unsigned int len,
+                        unsigned int packetnum, bool & cacheable);
   
  public:
   l7_classify(string filename);
   ~l7_classify();
-  int classify(char * buffer);
+  int classify(char * buffer, unsigned int oldlen, unsigned int len, 
+               unsigned int packetnum);
+  unsigned int get_window_packets();
+  unsigned int get_window_bytes();
+  bool wants_random(unsigned int oldlen, unsigned int packetnum);
+  const string & get_name(int mark);
+  const list<l7_pattern *> & get_patterns();
 };
 
 
+bool l7_looks_random(const char *data, unsigned int len);
+
 #endif          
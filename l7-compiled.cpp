@@ -0,0 +1,55 @@
+/*
+  Patterns compiled into l7-filter.  See l7-compiled.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <map>
+#include <string>
+
+#include "l7-compiled.h"
+
+// A function rather than a global so that the registrations, which are
+// globals in l7-matchers.cpp, work regardless of initialization order.
+// They all happen before main(), so nothing needs locking.
+static map<string, const l7_compiled_matcher *> & matchers()
+{
+  static map<string, const l7_compiled_matcher *> m;
+  return m;
+}
+
+l7_compiled_registration::l7_compiled_registration(
+  const l7_compiled_matcher *matcher)
+{
+  matchers()[matcher->name] = matcher;
+}
+
+const l7_compiled_matcher *l7_find_compiled(const string & name,
+                                            const string & regex,
+                                            int cflags, int eflags,
+                                            string & why)
+{
+  map<string, const l7_compiled_matcher *>::iterator m;
+  m = matchers().find(name);
+  why = "";
+  if(m == matchers().end()) return NULL;
+  if(m->second->regex != regex || m->second->cflags != cflags ||
+     m->second->eflags != eflags){
+    why = "pattern file has changed since l7-filter was built";
+    return NULL;
+  }
+  return m->second;
+}
+
+unsigned int l7_ncompiled()
+{
+  return matchers().size();
+}
@@ -0,0 +1,157 @@
+/*
+  Patterns compiled into l7-filter.  Most of our patterns change rarely, so
+  the busiest ones can be turned into C++ when l7-filter is built instead of
+  being read from their files at run time: list their .pat files in
+  COMPILED_PATTERNS when running make, and l7-matchergen writes out each
+  one's NFA (see l7-nfa.h) as constant tables, with a matching function
+  made from the template below.  Since the compiler knows how many states
+  there are and which anchors the pattern has, a pattern of 64 states or
+  less is a few scalar operations per byte, and one of up to
+  L7_COMPILED_DENSE_CHUNKS*4 states is stepped without any branches.
+
+  Each function is registered under the protocol's name along with the
+  pattern it was made from.  A pattern file that has changed since (or a
+  protocol that isn't compiled in) just gets the run time engines.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_COMPILED_H
+#define L7_COMPILED_H
+
+#include <sys/types.h>
+#include <string>
+
+using namespace std;
+
+struct l7_compiled_matcher {
+  const char *name;   // the protocol, as in the configuration file
+  const char *regex;  // what it was made from, with \x escapes done
+  int cflags;
+  int eflags;
+  unsigned int npositions;
+  bool (*matches)(const char *buffer, unsigned int len);
+};
+
+// l7-matchergen makes one of these for each matcher, which adds it to the
+// list when the program starts
+class l7_compiled_registration {
+ public:
+  l7_compiled_registration(const l7_compiled_matcher *matcher);
+};
+
+// Returns the matcher for this protocol if there is one and it was made
+// from the same pattern.  Otherwise returns NULL, with why saying what is
+// wrong with the one there is, if there is one.
+const l7_compiled_matcher *l7_find_compiled(const string & name,
+                                            const string & regex,
+                                            int cflags, int eflags,
+                                            string & why);
+unsigned int l7_ncompiled();
+
+// The tables of an l7_nfa, cut down to W words of states and NCHUNKS
+// chunks of four
+template<int W, int NCHUNKS> struct l7_compiled_tables {
+  u_int64_t first[W];
+  u_int64_t last[W];
+  u_int64_t bos[W];
+  u_int64_t eos[W];
+  bool starts[256];
+  u_int64_t chars[256][W];
+  u_int64_t follow[NCHUNKS*16][W];
+};
+
+// Up to this many chunks, every chunk is looked up on every byte, whether
+// any of its states are active or not: more loads, but nothing to
+// mispredict.  Past it, only the active ones, as l7_nfa does.
+#define L7_COMPILED_DENSE_CHUNKS 8
+
+template<int W> inline bool l7_compiled_any(const u_int64_t *a,
+                                            const u_int64_t *b)
+{
+  u_int64_t r = 0;
+  for(int i = 0; i < W; i++) r |= a[i] & b[i];
+  return r;
+}
+
+template<int W, int NCHUNKS>
+inline void l7_compiled_follow(const l7_compiled_tables<W, NCHUNKS> & t,
+                               const u_int64_t *now, u_int64_t *next)
+{
+  for(int i = 0; i < W; i++) next[i] = 0;
+  if(NCHUNKS <= L7_COMPILED_DENSE_CHUNKS){
+    for(int c = 0; c < NCHUNKS; c++){
+      const u_int64_t *f = t.follow[c*16 + ((now[c/16] >> (c%16*4)) & 15)];
+      for(int i = 0; i < W; i++) next[i] |= f[i];
+    }
+  }
+  else{
+    for(int i = 0; i < W; i++){
+      u_int64_t w = now[i];
+      while(w){
+        unsigned int bit = __builtin_ctzll(w) & ~3;
+        const u_int64_t *f = t.follow[(i*64 + bit)/4*16 + ((w >> bit) & 15)];
+        for(int j = 0; j < W; j++) next[j] |= f[j];
+        w &= ~(15ULL << bit);
+      }
+    }
+  }
+}
+
+// The same as l7_nfa::matches(), with the flags known in advance
+template<bool NULLABLE, bool ANCHORED, bool NOTBOL, bool NOTEOL,
+         int W, int NCHUNKS>
+bool l7_compiled_match(const l7_compiled_tables<W, NCHUNKS> & t,
+                       const char *buffer, unsigned int len)
+{
+  if(NULLABLE) return true;
+
+  const unsigned char *p = (const unsigned char *)buffer, *end = p + len;
+  u_int64_t now[W], next[W];
+  u_int64_t active = 0;
+
+  for(int i = 0; i < W; i++){
+    now[i] = NOTBOL ? 0 : t.first[i] & t.bos[i];
+    active |= now[i];
+  }
+  if(!NOTBOL && l7_compiled_any<W>(now, t.last)) return true;
+
+  while(p < end){
+    if(!active){
+      // Nothing started yet, so skip ahead to something that can start it
+      if(ANCHORED) break;
+      while(p < end && !t.starts[*p]) p++;
+      if(p == end) break;
+      const u_int64_t *c = t.chars[*p++];
+      for(int i = 0; i < W; i++){
+        now[i] = t.first[i] & c[i];
+        active |= now[i];
+      }
+    }
+    else{
+      l7_compiled_follow(t, now, next);
+      const u_int64_t *c = t.chars[*p++];
+      active = 0;
+      for(int i = 0; i < W; i++){
+        now[i] = (next[i] | t.first[i]) & c[i];
+        active |= now[i];
+      }
+    }
+    if(l7_compiled_any<W>(now, t.last)) return true;
+  }
+
+  if(!NOTEOL){
+    l7_compiled_follow(t, now, next);
+    for(int i = 0; i < W; i++) now[i] = (next[i] | t.first[i]) & t.eos[i];
+    if(l7_compiled_any<W>(now, t.last)) return true;
+  }
+  return false;
+}
+
+#endif
@@ -20,13 +20,19 @@ using namespace std;
 #include <stdlib.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <unistd.h>
 #include <map>
+#include <vector>
 #include <cstring>
 
 extern "C" {
 #include <linux/types.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <arpa/inet.h>
 #include <linux/netfilter.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 }
@@ -34,28 +40,204 @@ extern "C" {
 #include "l7-conntrack.h"
 #include "l7-classify.h"
 #include "l7-queue.h"
+#include "l7-shared.h"
+#include "l7-events.h"
+#include "l7-predict.h"
+#include "l7-probes.h"
+#include "l7-overload.h"
 #include "util.h"
 
 l7_classify* l7_classifier;
+l7_shared_table* shared_flows = NULL; // set if sharing results with others
+l7_event_log* event_log = NULL; // set if writing results for other programs
+l7_predictor* predictor = NULL; // set if guessing from endpoint history
+int report_results = 0; // print how each connection was classified
 unsigned int buflen; // Shouldn't really be global, but it's SO much easier
 
-l7_connection::l7_connection() 
+extern int maxpackets;
+extern int verbosity;
+extern unsigned int entropy_giveup;
+
+// Conntrack events wait in a ring of this many for the queue thread
+unsigned int ctringsize = 4096;
+int ctdropnew = 0; // when the ring is full: 0 = wait for room, 1 = drop new
+                   // connections (we always wait to pass on their ends)
+
+// Memory accounting.  Every connection counts against the limit for as
+// long as it exists, and its buffer counts for as long as it has one.  Only
+// buffers are subject to the limit, since they are the bulk of it and we
+// can't refuse to track a connection without losing its packets entirely.
+unsigned long memlimit = 0; // in bytes, 0 for no limit
+int memevict = 0; // when over the limit: 0 = don't buffer new connections,
+                  // 1 = take the buffer from the oldest unclassified one
+
+static l7_counter nflowbytes("memory.flowbytes");
+static l7_counter nbufferbytes("memory.bufferbytes");
+static l7_counter nbuffers("memory.buffers");
+static l7_counter nrejected("memory.rejected");
+static l7_counter nevicted("memory.evicted");
+static l7_counter nsegmentsdropped("memory.segmentsdropped");
+
+static l7_histogram happend("latency.append");
+static l7_histogram hclassify("latency.classify");
+static l7_histogram hctevent("latency.ctevent");
+
+static l7_counter ntcpduplicates("tcp.duplicates");
+static l7_counter ntcpduplicatebytes("tcp.duplicatebytes");
+static l7_counter ntcpreordered("tcp.reordered");
+static l7_counter ntcpgaps("tcp.gapsskipped");
+
+static l7_counter nnotadmitted("overload.notadmitted");
+static l7_counter nentropygiveups("patterns.entropygiveups");
+
+// Sequence number comparison that copes with wrapping
+static inline bool seq_before(u_int32_t a, u_int32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static l7_connection *oldest_buffer = NULL, *newest_buffer = NULL;
+
+static u_int64_t now_usec()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (u_int64_t)now.tv_sec*1000000 + now.tv_usec;
+}
+
+static unsigned long memory_used()
+{
+  return nflowbytes.get() + nbufferbytes.get();
+}
+
+// Frees the buffer of the connection that has had one longest (and so is
+// least likely to still match anything).  Connections that are busy are 
+// skipped.  Returns true if a buffer was freed.  Call with mem_mutex held.
+bool evict_oldest_buffer()
+{
+  for(l7_connection *victim = oldest_buffer; victim; victim = victim->newer){
+    if(pthread_mutex_trylock(&victim->buffer_mutex) != 0)
+      continue;
+
+    l7printf(2, "Out of memory, giving up on %s\n", victim->key.c_str());
+    victim->mark = NO_MATCH;
+    print_give_up(victim->key, (unsigned char *)victim->buffer,
+                  victim->lengthsofar);
+    free(victim->buffer);
+    victim->buffer = NULL;
+    victim->free_held();
+    victim->forget_buffer();
+    victim->finished(NO_MATCH, victim->num_packets, false);
+    pthread_mutex_unlock(&victim->buffer_mutex);
+    nevicted.add();
+    return true;
+  }
+  return false;
+}
+
+// Allocates the buffer if the memory limit allows it.  Call with 
+// buffer_mutex held.  Returns false if there's no room.
+bool l7_connection::alloc_buffer()
+{
+  pthread_mutex_lock(&mem_mutex);
+  while(memlimit && memory_used() + bufsize + 1 > memlimit){
+    if(!memevict || !evict_oldest_buffer()){
+      pthread_mutex_unlock(&mem_mutex);
+      nrejected.add();
+      unsigned long n = nrejected.get();
+      if((n^(n-1)) == (2*n-1)) // is it a power of 2?
+        cerr << "Memory limit reached, not examining new connections!\n("
+             << n << " turned away so far.)\n";
+      return false;
+    }
+  }
+
+  buffer = (char *)malloc(bufsize+1);
+  if(!buffer){
+    pthread_mutex_unlock(&mem_mutex);
+    nrejected.add();
+    return false;
+  }
+  buffer[0] = '\0';
+  nbufferbytes.add(bufsize+1);
+  nbuffers.add();
+
+  older = newest_buffer;
+  newer = NULL;
+  if(newest_buffer) newest_buffer->newer = this;
+  else oldest_buffer = this;
+  newest_buffer = this;
+  pthread_mutex_unlock(&mem_mutex);
+  return true;
+}
+
+// Takes the (already freed) buffer out of the accounting.  Call with
+// mem_mutex held.
+void l7_connection::forget_buffer()
+{
+  nbufferbytes.sub(bufsize+1);
+  nbuffers.sub();
+  if(older) older->newer = newer;
+  else oldest_buffer = newer;
+  if(newer) newer->older = older;
+  else newest_buffer = older;
+  older = newer = NULL;
+}
+
+// Call with buffer_mutex held
+void l7_connection::free_buffer()
+{
+  free_held();
+  if(!buffer) return;
+
+  free(buffer);
+  buffer = NULL; // marks it not to be free'd again
+
+  pthread_mutex_lock(&mem_mutex);
+  forget_buffer();
+  pthread_mutex_unlock(&mem_mutex);
+}
+
+l7_connection::l7_connection(string key, const l7_tuple & tuple) 
 {
   pthread_mutex_init(&num_packets_mutex, NULL);
   pthread_mutex_init(&buffer_mutex, NULL);
-  buffer = (char *)malloc(buflen+1);
+  this->key = key;
+  this->tuple = tuple;
+  // No pattern looks further than this, so there's no point keeping more.
+  // The buffer itself isn't allocated until there is data to put in it.
+  bufsize = l7_classifier->get_window_bytes();
+  buffer = NULL;
+  older = newer = NULL;
   lengthsofar = 0;
+  inflight = 0;
+  guessed = false;
+  guess = 0;
+  lastseen = 0;
+  fins = 0;
+  memset(streams, 0, sizeof(streams));
+  nduplicates = 0;
+  randombytes = 0;
+  degraded = false;
   num_packets = 0;
   mark = 0;
+  refcount = 1;
+  started = event_log ? now_usec() : 0;
+  nflowbytes.add(sizeof(l7_connection) + key.size());
 }
 
 l7_connection::~l7_connection() 
 {
   //clean up stuff
+  // Lock, since the buffer can still be taken away to save memory.
+  pthread_mutex_lock(&buffer_mutex);
   if(buffer){
     print_give_up(key, (unsigned char *)buffer, lengthsofar);
-    free(buffer);
+    free_buffer();
   }
+  pthread_mutex_unlock(&buffer_mutex);
+  nflowbytes.sub(sizeof(l7_connection) + key.size());
   pthread_mutex_destroy(&num_packets_mutex);
   pthread_mutex_destroy(&buffer_mutex);
 }
@@ -78,32 +260,272 @@ int l7_connection::get_num_packets()
 }
 
 // Returns old mark if the connection is classified already.  
-// Otherwise, attempts to classify it.
-u_int32_t l7_connection::classify() 
+// Otherwise, attempts to classify it.  oldlength is how much data there was
+// before packet number packetnum was added.
+u_int32_t l7_connection::classify(unsigned int oldlength, 
+                                  unsigned int packetnum) 
 {
   pthread_mutex_lock (&buffer_mutex);
-  if(mark == NO_MATCH_YET || mark == UNTOUCHED)
-    mark = l7_classifier->classify(buffer);
-  else
-    cerr << "NOT REACHED. should have taken care of this case already.\n";
+  // The mark can have been set since the caller looked at it if the buffer 
+  // was taken away to save memory.
+  if((mark == NO_MATCH_YET || mark == UNTOUCHED) && buffer){
+    if(verbosity >= 3)
+      l7printf(3, "Packet #%d, data is: %s\n", packetnum,
+               friendly_print((unsigned char *)buffer, lengthsofar).c_str());
+    mark = l7_classifier->classify(buffer, oldlength, lengthsofar, packetnum);
+    if(mark == NO_MATCH_YET && entropy_giveup &&
+       too_random(oldlength, packetnum))
+      mark = NO_MATCH;
+  }
 
   pthread_mutex_unlock (&buffer_mutex);
   return mark;
 }
 
+// Whether to give up on the connection because its data has looked
+// encrypted or compressed for long enough (--entropy-giveup).  Nothing is
+// going to match it unless a pattern says it can.  Call with buffer_mutex
+// held, after adding the data from oldlength on.
+bool l7_connection::too_random(unsigned int oldlength, unsigned int packetnum)
+{
+  if(!l7_looks_random(buffer + oldlength, lengthsofar - oldlength))
+    return false;
+  randombytes += lengthsofar - oldlength;
+  if(randombytes < entropy_giveup ||
+     l7_classifier->wants_random(oldlength, packetnum))
+    return false;
+
+  nentropygiveups.add();
+  l7printf(2, "Giving up on %s, whose data looks encrypted or compressed\n",
+           key.c_str());
+  return true;
+}
+
 u_int32_t l7_connection::get_mark() 
 {
+  /* Like num_packets, the mark may be set by the classification thread 
+     while we look at it.  An out of date answer just means the packet goes 
+     out as NO_MATCH_YET. */
   return mark;
 }
 
-void l7_connection::append_to_buffer(char *app_data, unsigned int appdatalen) 
+void l7_connection::hold() 
+{
+  __sync_fetch_and_add(&refcount, 1);
+}
+
+// Drops a reference and deletes the connection if it was the last one.
+// Don't touch the connection after calling this.
+void l7_connection::release() 
+{
+  if(__sync_sub_and_fetch(&refcount, 1) == 0)
+    delete this;
+}
+
+// Does the heavy lifting for one packet of application data: buffers it 
+// and tries to classify the connection, or gives up if it is past what any
+// pattern wants to look at.  packetnum is the number of this packet in the
+// connection, and segment says where its data goes if it is TCP.  Returns
+// the mark that the packet should get.
+u_int32_t l7_connection::inspect(char *app_data, unsigned int appdatalen, 
+                                 unsigned int packetnum, 
+                                 const l7_segment & segment) 
+{
+  if(mark != NO_MATCH_YET && mark != UNTOUCHED){
+    // It is classified already.  Reapply existing mark.
+    return mark;
+  }
+
+  // Giving up after looking at less than usual says nothing about it
+  if(l7_load_level > L7_LOAD_NORMAL) degraded = true;
+
+  // Too busy to start on anything new (see l7-overload.h)
+  if(mark == UNTOUCHED && l7_load_level >= L7_LOAD_NONEW){
+    nnotadmitted.add();
+    if(give_up()) finished(NO_MATCH, packetnum, false);
+    return NO_MATCH;
+  }
+
+  // Retransmissions don't use up the patterns' windows
+  packetnum -= nduplicates;
+
+  if(packetnum <= l7_classifier->get_window_packets()){
+    unsigned int oldlength = lengthsofar;
+    unsigned long start = l7_timing ? l7_now_ns() : 0;
+    int appended = append_to_buffer(app_data, appdatalen, segment);
+    L7_PROBE3(append_done, key.c_str(), packetnum, lengthsofar);
+    if(l7_timing) start = l7_stage(happend, start);
+    switch(appended){
+      case L7_APPEND_NOMEM:
+        // No memory to spare for this connection
+        if(give_up()) finished(NO_MATCH, packetnum, false);
+        return NO_MATCH;
+      case L7_APPEND_DUPLICATE:
+        nduplicates++;
+        return NO_MATCH_YET;
+      case L7_APPEND_HELD:
+        // Nothing new to look at until the gap before it is filled
+        return NO_MATCH_YET;
+    }
+
+    u_int32_t newmark = classify(oldlength, packetnum);
+    L7_PROBE3(classify_done, key.c_str(), packetnum, newmark);
+    if(l7_timing) l7_stage(hclassify, start);
+    if(newmark != NO_MATCH_YET){ // Got a match (or gave up), no need to keep data
+      pthread_mutex_lock(&buffer_mutex);
+      free_buffer();
+      pthread_mutex_unlock(&buffer_mutex);
+      finished(newmark, packetnum, true);
+      return newmark;
+    }
+
+    // If every pattern has seen all the data it wants, more won't help
+    if(lengthsofar < l7_classifier->get_window_bytes())
+      return NO_MATCH_YET;
+  }
+
+  if(give_up()) finished(NO_MATCH, packetnum, !degraded);
+  return NO_MATCH;
+}
+
+// Tells whoever is interested what we decided about the connection.  learn
+// says whether the decision says anything about the server, as opposed to
+// our having run out of memory or the like.  Giving up while overloaded
+// isn't shared either, so that whoever shares our table can still try.
+void l7_connection::finished(u_int32_t finalmark, unsigned int packetnum,
+                             bool learn) 
+{
+  if(shared_flows && !(finalmark == NO_MATCH && degraded))
+    shared_flows->publish(tuple, finalmark);
+  if(predictor && learn) predictor->learn(tuple, finalmark, guess);
+
+  if(report_results){
+    char saddr[INET_ADDRSTRLEN], daddr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &tuple.saddr, saddr, sizeof(saddr));
+    inet_ntop(AF_INET, &tuple.daddr, daddr, sizeof(daddr));
+    l7printf(0, "%s %s:%u -> %s:%u\t%s\tpackets=%u bytes=%u\n",
+             tuple.proto == IPPROTO_TCP ? "tcp" : "udp", saddr,
+             ntohs(tuple.sport), daddr, ntohs(tuple.dport),
+             finalmark == NO_MATCH ? "unknown" :
+               l7_classifier->get_name(finalmark).c_str(),
+             packetnum, lengthsofar);
+  }
+
+  if(event_log){
+    l7_event_record event;
+    memset(&event, 0, sizeof(event));
+    event.time = now_usec();
+    event.saddr = tuple.saddr;
+    event.daddr = tuple.daddr;
+    event.sport = tuple.sport;
+    event.dport = tuple.dport;
+    event.proto = tuple.proto;
+    event.mark = finalmark;
+    event.packets = packetnum;
+    event.bytes = lengthsofar;
+    event.usec = event.time > started ? event.time - started : 0;
+    if(finalmark != NO_MATCH)
+      strncpy(event.protocol, l7_classifier->get_name(finalmark).c_str(),
+              sizeof(event.protocol)-1);
+    event_log->record(event);
+  }
+}
+
+// Stops trying to classify the connection and frees its data.  Returns 
+// false if it had already been classified (or given up on) some other way.
+bool l7_connection::give_up() 
 {
   pthread_mutex_lock(&buffer_mutex);
+  bool unclassified = mark == NO_MATCH_YET || mark == UNTOUCHED;
+  mark = NO_MATCH;
+  if(buffer){
+    print_give_up(key, (unsigned char *)buffer, lengthsofar);
+    free_buffer();
+  }
+  pthread_mutex_unlock(&buffer_mutex);
+  return unclassified;
+}
 
+// Takes a mark that was found some other way (i.e. by another process) if
+// we haven't classified the connection ourselves.
+void l7_connection::adopt_mark(u_int32_t newmark) 
+{
+  pthread_mutex_lock(&buffer_mutex);
+  if(mark == NO_MATCH_YET || mark == UNTOUCHED){
+    l7printf(2, "Using mark %d for %s from the shared table\n", newmark, 
+             key.c_str());
+    mark = newmark;
+    free_buffer();
+  }
+  pthread_mutex_unlock(&buffer_mutex);
+}
+
+// Gives the connection the mark that connections to the same server have
+// had, if the prediction cache is sure enough of it.  Returns true if it
+// did.  Once in a while, it says to check, in which case we remember the
+// guess and classify the connection as usual.
+bool l7_connection::try_prediction(unsigned int packetnum) 
+{
+  u_int32_t newmark;
+  bool check = false;
+
+  guessed = true;
+  if(!predictor->predict(tuple, newmark, check))
+    return false;
+  if(check){
+    guess = newmark;
+    return false;
+  }
+
+  pthread_mutex_lock(&buffer_mutex);
+  bool unclassified = mark == NO_MATCH_YET || mark == UNTOUCHED;
+  if(unclassified){
+    l7printf(2, "Guessing mark %d for %s from the server's history\n",
+             newmark, key.c_str());
+    mark = newmark;
+    free_buffer();
+  }
+  pthread_mutex_unlock(&buffer_mutex);
+
+  if(unclassified) finished(newmark, packetnum, false);
+  return unclassified;
+}
+
+// Adds a packet's data to the buffer.  TCP data is added in stream order,
+// leaving out what we have already seen.  Returns L7_APPEND_NOMEM if there
+// is no buffer and no memory to make one, L7_APPEND_HELD if the data is
+// being kept until what comes before it arrives, L7_APPEND_DUPLICATE if
+// there was nothing new in it, and L7_APPEND_NEW otherwise.
+int l7_connection::append_to_buffer(char *app_data, unsigned int appdatalen,
+                                    const l7_segment & segment) 
+{
+  pthread_mutex_lock(&buffer_mutex);
+
+  // The first data, or the buffer was taken away to save memory
+  if(!buffer && 
+     ((mark != NO_MATCH_YET && mark != UNTOUCHED) || !alloc_buffer())){
+    pthread_mutex_unlock(&buffer_mutex);
+    return L7_APPEND_NOMEM;
+  }
+
+  int result = L7_APPEND_NEW;
+  if(segment.direction == L7_NOT_TCP)
+    copy_in(app_data, appdatalen);
+  else
+    result = take_segment(streams[segment.direction], segment.seq, app_data,
+                          appdatalen);
+
+  pthread_mutex_unlock (&buffer_mutex);
+  return result;
+}
+
+// Puts data at the end of the buffer.  Call with buffer_mutex held.
+void l7_connection::copy_in(const char *app_data, unsigned int appdatalen) 
+{
   unsigned int length = 0, oldlength = lengthsofar;
 
   /* Strip nulls.  Add it to the end of the current data. */
-  for(unsigned int i = 0; i < buflen-lengthsofar && i < appdatalen; i++) {
+  for(unsigned int i = 0; i < bufsize-lengthsofar && i < appdatalen; i++) {
     if(app_data[i] != '\0') {
       buffer[length+oldlength] = app_data[i];
       length++;
@@ -113,8 +535,149 @@ void l7_connection::append_to_buffer(char *app_data, unsigned int appdatalen)
   buffer[length+oldlength] = '\0';
   lengthsofar += length;
   l7printf(3, "Appended data. Length so far = %d\n", lengthsofar);
+}
 
-  pthread_mutex_unlock (&buffer_mutex);
+// Notes where a direction of a TCP connection starts, from its SYN.  
+// Without this, we start from the first data we see.
+void l7_connection::start_stream(int direction, u_int32_t isn) 
+{
+  pthread_mutex_lock(&buffer_mutex);
+  if(!streams[direction].started){
+    streams[direction].started = true;
+    streams[direction].next = isn;
+  }
+  pthread_mutex_unlock(&buffer_mutex);
+}
+
+// Adds what is new in a TCP segment to the buffer, along with anything 
+// that was waiting for it.  Call with buffer_mutex held.
+int l7_connection::take_segment(l7_stream & stream, u_int32_t seq,
+                                char *app_data, unsigned int appdatalen) 
+{
+  if(!stream.started){
+    stream.started = true;
+    stream.next = seq;
+  }
+
+  if(seq_before(stream.next, seq)){
+    // There is a gap before it.  If we can't wait any longer for what is
+    // missing, do without it.
+    while(stream.nheld == L7_REORDER_SEGMENTS && 
+          seq_before(stream.next, seq)){
+      u_int32_t earliest = stream.held[0].seq;
+      for(int i = 1; i < stream.nheld; i++)
+        if(seq_before(stream.held[i].seq, earliest))
+          earliest = stream.held[i].seq;
+      l7printf(2, "Giving up on %u missing bytes of %s\n", 
+               earliest - stream.next, key.c_str());
+      ntcpgaps.add();
+      stream.next = earliest;
+      deliver_held(stream);
+    }
+    if(seq_before(stream.next, seq)){
+      for(int i = 0; i < stream.nheld; i++){
+        if(stream.held[i].seq == seq && stream.held[i].len >= appdatalen){
+          ntcpduplicates.add();
+          ntcpduplicatebytes.add(appdatalen);
+          return L7_APPEND_DUPLICATE;
+        }
+      }
+      hold_segment(stream, seq, app_data, appdatalen);
+      return L7_APPEND_HELD;
+    }
+  }
+
+  u_int32_t seen = stream.next - seq;
+  if(seen >= appdatalen){
+    l7printf(3, "Ignoring retransmitted data\n");
+    ntcpduplicates.add();
+    ntcpduplicatebytes.add(appdatalen);
+    return L7_APPEND_DUPLICATE;
+  }
+  ntcpduplicatebytes.add(seen);
+
+  copy_in(app_data + seen, appdatalen - seen);
+  stream.next = seq + appdatalen;
+  deliver_held(stream);
+  return L7_APPEND_NEW;
+}
+
+// Keeps data that came ahead of a gap.  Call with buffer_mutex held and 
+// room in stream.held.  Held data counts against the memory limit like
+// buffers do.  If there is no room for it, it is dropped, as if the packet
+// had never come, and the gap is given up on later.
+void l7_connection::hold_segment(l7_stream & stream, u_int32_t seq,
+                                 char *app_data, unsigned int appdatalen) 
+{
+  // There's no point keeping more than will fit in the buffer
+  if(appdatalen > bufsize - lengthsofar)
+    appdatalen = bufsize - lengthsofar;
+
+  pthread_mutex_lock(&mem_mutex);
+  // Our own buffer is never taken, since we hold its lock
+  while(memlimit && memory_used() + appdatalen > memlimit){
+    if(!memevict || !evict_oldest_buffer()){
+      pthread_mutex_unlock(&mem_mutex);
+      nsegmentsdropped.add();
+      l7printf(2, "No memory to hold %u bytes of %s that came early\n",
+               appdatalen, key.c_str());
+      return;
+    }
+  }
+  char *data = (char *)malloc(appdatalen ? appdatalen : 1);
+  if(!data){
+    pthread_mutex_unlock(&mem_mutex);
+    nsegmentsdropped.add();
+    return;
+  }
+  nbufferbytes.add(appdatalen);
+  pthread_mutex_unlock(&mem_mutex);
+
+  l7_held_segment & held = stream.held[stream.nheld++];
+  held.seq = seq;
+  held.len = appdatalen;
+  held.data = data;
+  memcpy(held.data, app_data, appdatalen);
+  ntcpreordered.add();
+  l7printf(3, "Holding %u bytes that came early\n", appdatalen);
+}
+
+// Adds held data that no longer has a gap before it.  Call with 
+// buffer_mutex held.
+void l7_connection::deliver_held(l7_stream & stream) 
+{
+  bool progress = true;
+  while(progress){
+    progress = false;
+    for(int i = 0; i < stream.nheld; i++){
+      l7_held_segment held = stream.held[i];
+      if(seq_before(stream.next, held.seq))
+        continue;
+
+      u_int32_t seen = stream.next - held.seq;
+      if(seen < held.len){
+        copy_in(held.data + seen, held.len - seen);
+        stream.next = held.seq + held.len;
+      }
+      free(held.data);
+      nbufferbytes.sub(held.len);
+      stream.held[i] = stream.held[--stream.nheld];
+      progress = true;
+      break;
+    }
+  }
+}
+
+// Frees all held data.  Call with buffer_mutex held.
+void l7_connection::free_held() 
+{
+  for(int d = 0; d < 2; d++){
+    for(int i = 0; i < streams[d].nheld; i++){
+      free(streams[d].held[i].data);
+      nbufferbytes.sub(streams[d].held[i].len);
+    }
+    streams[d].nheld = 0;
+  }
 }
 
 char *l7_connection::get_buffer() 
@@ -139,6 +702,23 @@ static string make_key4(u_int32_t a, u_int32_t b, u_int16_t s,
   return key;
 }
 
+string l7_tuple_key(const l7_tuple & tuple)
+{
+  return make_key4(tuple.saddr, tuple.daddr, tuple.sport, tuple.dport,
+                   tuple.proto);
+}
+
+static l7_tuple make_tuple_from_ct(const nf_conntrack* ct)
+{
+	l7_tuple tuple;
+	tuple.saddr = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC);
+	tuple.daddr = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST);
+	tuple.sport = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC);
+	tuple.dport = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST);
+	tuple.proto = nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
+	return tuple;
+}
+
 static string make_key_from_ct(const nf_conntrack* ct)
 {
 	u_int32_t src4 = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC);
@@ -164,31 +744,23 @@ static int l7_handle_conntrack_event(const struct nlmsghdr *nlh,
   if (l4proto != IPPROTO_TCP && l4proto != IPPROTO_UDP)
      return 0;
 
+  unsigned long start = l7_timing ? l7_now_ns() : 0;
   std::string key;
   switch (type) {
   // On the first packet, create the connection buffer, etc.
-  case NFCT_T_NEW: {
+  case NFCT_T_NEW:
 	l7printf(3, "Got event: NFCT_T_NEW\n");
-
 	key = make_key_from_ct(ct);
-	if (l7_conntrack_handler->get_l7_connection(key)){
-	// this happens sometimes
-		cerr << "Received NFCT_MSG_NEW but already have a connection. Packets = " 
-			<< l7_conntrack_handler->get_l7_connection(key)->get_num_packets() 
-		        << endl;
-		l7_conntrack_handler->remove_l7_connection(key);
-	}
-	l7_connection *thisconnection = new l7_connection();
-	l7_conntrack_handler->add_l7_connection(thisconnection, key);
-	thisconnection->key = key;
-  }
-  break;
+	l7_conntrack_handler->connection_new(key, make_tuple_from_ct(ct));
+	break;
   case NFCT_T_DESTROY:
 	l7printf(3, "Got event: NFCT_T_DESTROY\n");
 	// clean up the connection buffer, etc.
-	key = make_key_from_ct(ct);
-	if (l7_conntrack_handler->get_l7_connection(key))
-		l7_conntrack_handler->remove_l7_connection(key);
+	l7_conntrack_handler->connection_destroy(make_tuple_from_ct(ct));
+	// Every process sharing the table gets this event, so whichever 
+	// gets it first cleans up.
+	if (shared_flows)
+		shared_flows->remove(make_tuple_from_ct(ct));
 	break;
   case NFCT_T_UPDATE:
 	l7printf(3, "Got event: NFCT_T_UPDATE\n");
@@ -201,6 +773,8 @@ static int l7_handle_conntrack_event(const struct nlmsghdr *nlh,
 	l7printf(1, "Got event type: 0x%x\n", type);
 	break;
   }
+ L7_PROBE1(ct_event, type);
+ if (l7_timing) l7_stage(hctevent, start);
  return 0;
 }
 
@@ -229,18 +803,53 @@ string l7_conntrack::make_key(const unsigned char *packetdata, bool reverse) con
 	return key;
 }
 
+// turn raw packet into a tuple, in the same form as make_tuple_from_ct()
+l7_tuple l7_conntrack::make_tuple(const unsigned char *packetdata, 
+                                  bool reverse) const
+{
+	struct iphdr iph;
+	l7_tuple tuple;
+	u_int16_t sport, dport;
+
+	memcpy(&iph, packetdata, sizeof(iph));
+	memcpy(&sport, packetdata + (iph.ihl << 2), sizeof(sport));
+	memcpy(&dport, packetdata + (iph.ihl << 2) + 2, sizeof(dport));
+
+	tuple.saddr = reverse ? iph.daddr : iph.saddr;
+	tuple.daddr = reverse ? iph.saddr : iph.daddr;
+	tuple.sport = reverse ? dport : sport;
+	tuple.dport = reverse ? sport : dport;
+	tuple.proto = iph.protocol;
+	return tuple;
+}
+
 l7_conntrack::~l7_conntrack() 
 {
-  nfct_close(cth);
-  pthread_mutex_destroy(&map_mutex);
+  if(cth) nfct_close(cth);
+  close(notifyfd);
 }
 
-l7_conntrack::l7_conntrack(void* l7_classifier_in) 
+l7_conntrack::l7_conntrack(void* l7_classifier_in) :
+  events(ctringsize), nevents("ct.events"), nfull("ct.ringfull"),
+  ndroppednew("ct.droppednew"), nmaxdepth("ct.maxdepth"),
+  nenobufs("ct.enobufs"), nconnections("ct.connections")
 {
-  pthread_mutex_init(&map_mutex, NULL);
   l7_classifier = (l7_classify *)l7_classifier_in;
-  
-  // Now open a handler that is subscribed to all possible events
+  waiting = false;
+
+  notifyfd = eventfd(0, EFD_NONBLOCK);
+  if(notifyfd < 0){
+    perror("eventfd");
+    exit(1);
+  }
+  cth = NULL;
+}
+
+// Opens a handler that is subscribed to all possible events.  Programs that
+// only want the table of connections (such as l7-bench) don't call this,
+// and so don't need to be root.
+void l7_conntrack::open()
+{
   cth = nfct_open(CONNTRACK, NFCT_ALL_CT_GROUPS);
   if (!cth) {
     cerr<<"Can't open Netfilter connection tracking handler.  Are you root?\n";
@@ -248,29 +857,188 @@ l7_conntrack::l7_conntrack(void* l7_classifier_in)
   } 
 }
 
-l7_connection *l7_conntrack::get_l7_connection(const string key) 
+// Called from the conntrack thread.  Wakes up the queue thread.
+void l7_conntrack::notify()
+{
+  u_int64_t one = 1;
+  if(write(notifyfd, &one, sizeof(one)) != sizeof(one))
+    perror("eventfd write");
+}
+
+// Called from the conntrack thread.  Hands the event to the queue thread.
+// The queue thread looks at the ring before every packet, so it only needs
+// waking up if the ring is filling while no packets are coming in.
+void l7_conntrack::send_event(l7_ct_event & event)
+{
+  while(!events.push(event)){
+    if(!waiting){
+      nfull.add();
+      notify();
+      waiting = true;
+    }
+    if(event.type == L7_CT_NEW && ctdropnew){
+      ndroppednew.add();
+      unsigned long n = ndroppednew.get();
+      if((n^(n-1)) == (2*n-1)) // is it a power of 2?
+        cerr << "Conntrack events are arriving faster than we can handle "
+                "them, ignoring new\nconnections! (" << n 
+             << " ignored so far.)\n";
+      event.connection->release();
+      return;
+    }
+    sched_yield();
+  }
+  waiting = false;
+  nevents.add();
+
+  unsigned int depth = events.count();
+  nmaxdepth.max(depth);
+  if(depth == events.capacity()/2)
+    notify();
+}
+
+void l7_conntrack::connection_new(const string key, const l7_tuple & tuple)
 {
-  l7_connection *conn;
-  pthread_mutex_lock(&map_mutex);
-  conn = l7_connections[key];
-  pthread_mutex_unlock(&map_mutex);
-  return conn;
+  l7_ct_event event;
+  event.type = L7_CT_NEW;
+  event.connection = new l7_connection(key, tuple);
+  event.tuple = tuple;
+  send_event(event);
 }
 
-void l7_conntrack::add_l7_connection(l7_connection* connection, 
-					const string key) 
+void l7_conntrack::connection_destroy(const l7_tuple & tuple)
 {
-  pthread_mutex_lock(&map_mutex);
-  l7_connections[key] = connection;
-  pthread_mutex_unlock(&map_mutex);
+  l7_ct_event event;
+  event.type = L7_CT_DESTROY;
+  event.connection = NULL;
+  event.tuple = tuple;
+  send_event(event);
 }
 
-void l7_conntrack::remove_l7_connection(const string key) 
+// Called from the queue thread when the notify fd is readable
+void l7_conntrack::handle_notify()
 {
-  pthread_mutex_lock(&map_mutex);
-  delete l7_connections[key];
-  l7_connections.erase(l7_connections.find(key));
-  pthread_mutex_unlock(&map_mutex);
+  u_int64_t junk;
+  if(read(notifyfd, &junk, sizeof(junk)) < 0 && errno != EAGAIN)
+    perror("eventfd read");
+  handle_events();
+}
+
+// Called from the queue thread.  Applies the events the conntrack thread
+// has sent.  Cheap if there aren't any, so it can be done for every packet.
+void l7_conntrack::handle_events()
+{
+  l7_ct_event event;
+
+  while(events.pop(event)){
+    if(event.type == L7_CT_NEW){
+      l7_connection *oldconnection = get_l7_connection(event.tuple);
+      if(oldconnection){
+        // this happens sometimes
+        cerr << "Received NFCT_MSG_NEW but already have a connection. "
+                "Packets = " << oldconnection->get_num_packets() << endl;
+        oldconnection->release();
+      }
+      add_l7_connection(event.connection);
+    }
+    else
+      remove_l7_connection(event.tuple);
+  }
+}
+
+// Returns the connection with a reference held (see l7_connection::hold()),
+// or NULL.  Call release() on it when done.
+l7_connection *l7_conntrack::get_l7_connection(const l7_tuple & tuple)
+{
+  return get_l7_connection(tuple, l7_tuple_hash(tuple));
+}
+
+// The same, for when the hash is already known (see l7_flow_table)
+l7_connection *l7_conntrack::get_l7_connection(const l7_tuple & tuple,
+                                               u_int32_t hash)
+{
+  l7_connection *connection = l7_connections.find(tuple, hash);
+  if(connection) connection->hold();
+  return connection;
+}
+
+// Takes over the caller's reference.  Replaces any connection already there.
+void l7_conntrack::add_l7_connection(l7_connection* connection)
+{
+  l7_connection *old = l7_connections.insert(connection->tuple, connection);
+  if(old) old->release();
+  else nconnections.add();
+}
+
+void l7_conntrack::remove_l7_connection(const l7_tuple & tuple)
+{
+  l7_connection *old = l7_connections.remove(tuple);
+  if(!old) return;
+  // Anyone still working on it (i.e. the classification thread) keeps it
+  // alive until they are done.
+  old->release();
+  nconnections.sub();
+}
+
+// Forgets connections that have had no packets for idle seconds or more.
+// Only for when we follow connections ourselves (see l7-capture.cpp), since
+// otherwise conntrack tells us when they end.
+void l7_conntrack::expire_connections(u_int32_t now, u_int32_t idle)
+{
+  vector<l7_tuple> expired;
+  for(u_int32_t i = 0; i < l7_connections.get_nslots(); i++){
+    l7_connection *connection = l7_connections.get_slot(i);
+    if(connection && now - connection->lastseen >= idle)
+      expired.push_back(connection->tuple);
+  }
+  for(unsigned int i = 0; i < expired.size(); i++)
+    remove_l7_connection(expired[i]);
+}
+
+// What reconcile() needs in its callback
+struct l7_reconciliation {
+  l7_conntrack *tracker;
+  l7_flow_table *restored;
+};
+
+static int reconcile_one(enum nf_conntrack_msg_type type,
+                         struct nf_conntrack *ct, void *data)
+{
+  l7_reconciliation *r = (l7_reconciliation *)data;
+  l7_connection *connection = r->restored->remove(make_tuple_from_ct(ct));
+  if(connection) r->tracker->add_l7_connection(connection);
+  return NFCT_CB_CONTINUE;
+}
+
+// Takes the connections in restored (see l7-snapshot.cpp) that conntrack
+// still has into the table, and drops the rest, which have ended since they
+// were saved.  Call before the queue thread starts.  Returns how many were
+// kept, or -1 if conntrack couldn't be asked.
+long l7_conntrack::reconcile(l7_flow_table & restored)
+{
+  unsigned int before = l7_connections.size();
+  bool dumped = false;
+  l7_connections.reserve(before + restored.size());
+
+  struct nfct_handle *dumper = nfct_open(CONNTRACK, 0);
+  if(dumper){
+    l7_reconciliation r = { this, &restored };
+    u_int32_t family = AF_INET;
+    nfct_callback_register(dumper, NFCT_T_ALL, reconcile_one, &r);
+    dumped = nfct_query(dumper, NFCT_Q_DUMP, &family) == 0;
+    nfct_close(dumper);
+  }
+  if(!dumped)
+    cerr << "Couldn't get the list of connections from conntrack, so "
+            "dropping the saved\nconnections it didn't mention.\n";
+
+  vector<l7_tuple> ended;
+  for(u_int32_t i = 0; i < restored.get_nslots(); i++)
+    if(restored.get_slot(i)) ended.push_back(restored.get_slot(i)->tuple);
+  for(unsigned int i = 0; i < ended.size(); i++)
+    restored.remove(ended[i])->release();
+
+  return dumped ? (long)(l7_connections.size() - before) : -1;
 }
 
 void l7_conntrack::start() 
@@ -280,6 +1048,16 @@ void l7_conntrack::start()
   nfct_callback_register2(cth, NFCT_T_ALL, l7_handle_conntrack_event, (void *)this);
   do {
 	  ret = nfct_catch(cth);
+	  // The kernel had more events than would fit in the socket buffer.
+	  // We'll have missed some, but that's no reason to stop.
+	  if (ret < 0 && errno == ENOBUFS) {
+		nenobufs.add();
+		unsigned long n = nenobufs.get();
+		if ((n^(n-1)) == (2*n-1)) // is it a power of 2?
+			cerr << "Missed conntrack events because we fell behind! ("
+			     << n << " times so far.)\n";
+		ret = 0;
+	  }
   }  while (ret == 0);
 
   std::cerr <<  "nfct_catch returned " << ret << ", exiting" << std::endl;
@@ -19,48 +19,167 @@
 #define L7_CONNTRACK_H
 
 #include "l7-classify.h"
-#include <map>
+#include "l7-ring.h"
+#include "l7-stats.h"
+#include "l7-flows.h"
+
+// Where a packet's data goes in its TCP stream, so that it can be put in
+// order and retransmissions left out.
+#define L7_NOT_TCP -1 // direction for packets that aren't TCP
+struct l7_segment {
+  int direction;   // 0 for the original direction, 1 for the reply
+  u_int32_t seq;   // the sequence number of the first byte of data
+};
+
+#define L7_REORDER_SEGMENTS 4 // per direction
+
+// Data that arrived ahead of a gap in the stream
+struct l7_held_segment {
+  u_int32_t seq;
+  unsigned int len;
+  char *data;
+};
+
+// How far we have got in one direction of a TCP connection
+struct l7_stream {
+  bool started;
+  u_int32_t next;  // the sequence number of the next byte we want
+  int nheld;
+  l7_held_segment held[L7_REORDER_SEGMENTS];
+};
+
+// What append_to_buffer did with a packet's data
+enum { L7_APPEND_NOMEM, L7_APPEND_NEW, L7_APPEND_HELD, L7_APPEND_DUPLICATE };
 
 class l7_connection {
  private:
   unsigned int num_packets;
   unsigned int mark; // this is just our part of the mark, 
                      // e.g. 0x3 of 0x12345678 if markmask is 0x00f00000
+  int refcount; // the map holds one reference, each user of the pointer one
 
   pthread_mutex_t num_packets_mutex;
   pthread_mutex_t buffer_mutex;
 
+  // Connections that hold a buffer, oldest first, for evicting when memory
+  // runs short.  Protected by the memory accounting lock.
+  l7_connection *older, *newer;
+  bool alloc_buffer();
+  void free_buffer();
+  void forget_buffer();
+  friend bool evict_oldest_buffer();
+  friend bool l7_snapshot_write(const l7_flow_table & flows, string filename);
+  friend long l7_snapshot_read(string filename, l7_flow_table & flows);
+
+  u_int64_t started; // when we first heard of it, usec since the epoch
+
+  // TCP reassembly, protected by buffer_mutex
+  l7_stream streams[2];
+  void copy_in(const char *app_data, unsigned int appdatalen);
+  int take_segment(l7_stream & stream, u_int32_t seq, char *app_data,
+                   unsigned int appdatalen);
+  void hold_segment(l7_stream & stream, u_int32_t seq, char *app_data,
+                    unsigned int appdatalen);
+  void deliver_held(l7_stream & stream);
+  void free_held();
+  unsigned int nduplicates; // packets that brought nothing new.  Only used
+                            // by whoever is inspecting the connection.
+  unsigned int randombytes; // data that has looked encrypted or compressed
+  bool degraded; // whether we looked at less of it than usual because we
+                 // were overloaded (see l7-overload.h).  Only used by
+                 // whoever is inspecting the connection.
+  bool too_random(unsigned int oldlength, unsigned int packetnum);
+  void finished(u_int32_t finalmark, unsigned int packetnum, bool learn);
+
  public:
   char * buffer;
+  unsigned int bufsize;    // how much data buffer can hold
   unsigned int lengthsofar;//len of data in buffer, not counting terminating \0
+  unsigned int inflight; // packets waiting on a worker for their verdict. 
+                         // Only used by the queue thread.
+  bool guessed;          // whether we've asked the prediction cache yet.
+                         // Also only used by the queue thread.
+  u_int32_t guess; // what the prediction cache said, if we're checking it
+  // Only used when we follow connections ourselves instead of conntrack
+  // (see l7-capture.cpp), by the thread that does.
+  u_int32_t lastseen; // when its last packet came, seconds since the epoch
+  unsigned char fins; // directions that have sent a FIN, a bit each
   string key;
-  l7_connection();
+  l7_tuple tuple;
+  l7_connection(string key, const l7_tuple & tuple);
   ~l7_connection();
   void increment_num_packets();
   int get_num_packets();
+  void hold();
+  void release();
   
-  void append_to_buffer(char *inbuf, unsigned int appdatalen);
+  int append_to_buffer(char *inbuf, unsigned int appdatalen,
+                       const l7_segment & segment);
+  void start_stream(int direction, u_int32_t isn);
   char *get_buffer();
-  u_int32_t classify();
+  u_int32_t classify(unsigned int oldlength, unsigned int packetnum);
+  u_int32_t inspect(char *app_data, unsigned int appdatalen, 
+                    unsigned int packetnum, const l7_segment & segment);
+  bool give_up();
+  void adopt_mark(u_int32_t newmark);
+  bool try_prediction(unsigned int packetnum);
   u_int32_t get_mark();
 };
 
-typedef map <string, l7_connection *> l7_map;
+// The key (for messages) of the connection with the given tuple
+string l7_tuple_key(const l7_tuple & tuple);
+
+// A conntrack event, passed from the conntrack thread to the queue thread,
+// which is the only one that touches the map of connections.
+#define L7_CT_NEW 1
+#define L7_CT_DESTROY 2
+struct l7_ct_event {
+  int type;
+  l7_connection *connection; // for L7_CT_NEW, with a reference for the table
+  l7_tuple tuple;
+};
 
 class l7_conntrack {
  private:
-  l7_map l7_connections;
+  l7_flow_table l7_connections; // only used by the queue thread
   struct nfct_handle *cth; // the callback
-  pthread_mutex_t map_mutex;
+  l7_ring<l7_ct_event> events;
+  int notifyfd;              // eventfd that tells the queue thread to look
+  bool waiting;              // only used by the conntrack thread
+
+  void send_event(l7_ct_event & event);
+  void notify();
 
  public:
+  l7_counter nevents;
+  l7_counter nfull;
+  l7_counter ndroppednew;
+  l7_counter nmaxdepth;
+  l7_counter nenobufs;
+  l7_counter nconnections;
+
   l7_conntrack(void * foo);
   ~l7_conntrack();
+  void open();
   void start();
   string make_key(const unsigned char *packetdata, bool reverse) const;
-  l7_connection* get_l7_connection(const string key);
-  void add_l7_connection(l7_connection *connection, const string key);
-  void remove_l7_connection(const string key);
+  l7_tuple make_tuple(const unsigned char *packetdata, bool reverse) const;
+  int get_notify_fd() const { return notifyfd; }
+
+  // The rest are for the queue thread only
+  void handle_events();
+  void handle_notify();
+  l7_connection* get_l7_connection(const l7_tuple & tuple);
+  l7_connection* get_l7_connection(const l7_tuple & tuple, u_int32_t hash);
+  void add_l7_connection(l7_connection *connection);
+  void remove_l7_connection(const l7_tuple & tuple);
+  void expire_connections(u_int32_t now, u_int32_t idle);
+  long reconcile(l7_flow_table & restored);
+  const l7_flow_table & get_flows() const { return l7_connections; }
+
+  // Called from the conntrack event callback
+  void connection_new(const string key, const l7_tuple & tuple);
+  void connection_destroy(const l7_tuple & tuple);
 };
 
 #endif           
@@ -0,0 +1,211 @@
+/*
+  Reads the classification event log that l7-filter writes when given
+  --event-log, and prints the events or copies them to a file.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cstring>
+
+#include "l7-events.h"
+
+static volatile int stop = 0;
+
+static void handle_signal(int signal)
+{
+  stop = 1;
+}
+
+static void print_event(const l7_event_record & event)
+{
+  char saddr[INET_ADDRSTRLEN], daddr[INET_ADDRSTRLEN], when[32];
+  time_t seconds = event.time / 1000000;
+  struct tm tm;
+
+  inet_ntop(AF_INET, &event.saddr, saddr, sizeof(saddr));
+  inet_ntop(AF_INET, &event.daddr, daddr, sizeof(daddr));
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds,&tm));
+
+  printf("%s.%06u %s %s:%u > %s:%u %s mark %u packets %u bytes %u "
+         "usec %u\n", when, (unsigned int)(event.time % 1000000),
+         event.proto == IPPROTO_TCP ? "tcp" :
+           event.proto == IPPROTO_UDP ? "udp" : "other",
+         saddr, ntohs(event.sport), daddr, ntohs(event.dport),
+         event.protocol[0] ? event.protocol : "unknown", event.mark,
+         event.packets, event.bytes, event.usec);
+}
+
+// Maps the log, waiting for l7-filter to create it if need be.  Returns
+// NULL if it isn't there or isn't a log.
+static void *map_log(const char *filename, size_t & mapsize, ino_t & inode)
+{
+  int fd = open(filename, O_RDWR);
+  if(fd < 0) return NULL;
+
+  struct stat st;
+  l7_events_header header;
+  if(fstat(fd, &st) != 0 ||
+     pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+     header.magic != L7_EVENTS_MAGIC){
+    close(fd);
+    return NULL;
+  }
+  if(header.version != L7_EVENTS_VERSION ||
+     header.recordsize != sizeof(l7_event_record)){
+    cerr << filename << " was written by an incompatible l7-filter.\n";
+    exit(1);
+  }
+
+  mapsize = l7_events_size(header.nrings, header.nrecords);
+  if((size_t)st.st_size < mapsize){
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  inode = st.st_ino;
+  return map;
+}
+
+// Has l7-filter been restarted and made a new log?
+static bool replaced(const char *filename, ino_t inode)
+{
+  struct stat st;
+  return stat(filename, &st) != 0 || st.st_ino != inode;
+}
+
+int main(int argc, char **argv)
+{
+  const char *filename = NULL;
+  FILE *out = NULL;
+  bool once = false;
+  int c;
+
+  while((c = getopt(argc, argv, "f:w:1h")) != -1){
+    switch(c){
+      case 'f':
+        filename = optarg;
+        break;
+      case 'w':
+        out = fopen(optarg, "ab");
+        if(!out){
+          perror(optarg);
+          exit(1);
+        }
+        break;
+      case '1':
+        once = true;
+        break;
+      default:
+        cerr << "Syntax: l7-eventread -f event_log [options]\n"
+                "\n"
+                "Options are:\n"
+                "-w file\tAppend the raw records to file instead of printing\n"
+                "-1\tRead what is there now and exit\n";
+        exit(1);
+    }
+  }
+
+  if(!filename){
+    cerr << "You must give the event log with -f.  Try 'l7-eventread -h'\n";
+    exit(1);
+  }
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  size_t mapsize = 0;
+  ino_t inode = 0;
+  void *map = map_log(filename, mapsize, inode);
+  if(!map && once){
+    cerr << "Couldn't read an event log from " << filename << endl;
+    exit(1);
+  }
+
+  unsigned long nread = 0, lastoverflows = 0;
+  while(!stop){
+    if(!map){
+      sleep(1);
+      map = map_log(filename, mapsize, inode);
+      lastoverflows = 0;
+      continue;
+    }
+
+    l7_events_header *header = (l7_events_header *)map;
+    u_int32_t mask = header->nrecords - 1;
+    unsigned long found = 0, overflows = 0;
+
+    for(u_int32_t i = 0; i < header->nrings; i++){
+      l7_events_ring *ring = l7_events_ring_at(map, header->nrecords, i);
+      l7_event_record *records = l7_events_records(ring);
+      u_int64_t tail = ring->tail;
+      u_int64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+      for(; tail != head; tail++){
+        const l7_event_record & event = records[tail & mask];
+        if(out){
+          if(fwrite(&event, sizeof(event), 1, out) != 1){
+            perror("fwrite");
+            exit(1);
+          }
+        }
+        else
+          print_event(event);
+        found++;
+      }
+      // Only now may l7-filter write over what we just read
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+      overflows += ring->overflows;
+    }
+    nread += found;
+
+    if(overflows > lastoverflows){
+      cerr << "l7-filter dropped " << overflows - lastoverflows
+           << " events because we weren't keeping up.\n";
+      lastoverflows = overflows;
+    }
+
+    if(found){
+      fflush(out ? out : stdout);
+      continue;
+    }
+    if(once) break;
+
+    usleep(100000);
+    if(replaced(filename, inode)){
+      munmap(map, mapsize);
+      map = NULL;
+    }
+  }
+
+  if(out) fclose(out);
+  cerr << nread << " events read\n";
+  return 0;
+}
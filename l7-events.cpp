@@ -0,0 +1,103 @@
+/*
+  A log of classification results in shared memory, for other programs
+  (such as l7-eventread) to read without having to parse our output.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <cstring>
+
+#include "l7-events.h"
+#include "util.h"
+
+// Which ring the calling thread writes to, once it has one
+static __thread int myring = -1;
+
+l7_event_log::l7_event_log(string filename, unsigned int nrings,
+                           unsigned int nrecords) :
+  nevents("events.written"), noverflows("events.overflows")
+{
+  u_int32_t n = 1;
+  while(n < nrecords) n <<= 1;
+
+  // Make a new file rather than truncating the old one, so that a reader
+  // still looking at the old one isn't pulled out from under.
+  unlink(filename.c_str());
+  int fd = open(filename.c_str(), O_RDWR|O_CREAT|O_EXCL, 0644);
+  if(fd < 0){
+    perror(filename.c_str());
+    cerr << "Couldn't create event log.\n";
+    exit(1);
+  }
+
+  mapsize = l7_events_size(nrings, n);
+  if(ftruncate(fd, mapsize) != 0){
+    perror(filename.c_str());
+    exit(1);
+  }
+
+  map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    perror("mmap");
+    cerr << "Couldn't map event log " << filename << endl;
+    exit(1);
+  }
+
+  this->nrings = nrings;
+  mask = n - 1;
+  nextring = 0;
+
+  // The file starts out zeroed, so the rings are already empty
+  l7_events_header *header = (l7_events_header *)map;
+  header->version = L7_EVENTS_VERSION;
+  header->nrings = nrings;
+  header->nrecords = n;
+  header->recordsize = sizeof(l7_event_record);
+  __atomic_store_n(&header->magic, L7_EVENTS_MAGIC, __ATOMIC_RELEASE);
+}
+
+l7_event_log::~l7_event_log()
+{
+  munmap(map, mapsize);
+}
+
+// Never blocks.  Each thread that calls this gets a ring of its own the
+// first time; there is one for each thread that can classify.
+void l7_event_log::record(const l7_event_record & event)
+{
+  if(myring < 0)
+    myring = __sync_fetch_and_add(&nextring, 1);
+  if((u_int32_t)myring >= nrings){
+    // Shouldn't happen, but if it does, sharing a ring would break it
+    noverflows.add();
+    return;
+  }
+
+  l7_events_ring *ring = l7_events_ring_at(map, mask+1, myring);
+  u_int64_t head = ring->head;
+  if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > mask){
+    ring->overflows++;
+    noverflows.add();
+    return;
+  }
+
+  l7_events_records(ring)[head & mask] = event;
+  __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+  nevents.add();
+}
@@ -0,0 +1,104 @@
+/*
+  A log of classification results in shared memory, for other programs
+  (such as l7-eventread) to read without having to parse our output.
+
+  The log is a memory-mapped file holding one ring of fixed size records
+  for each thread that classifies.  Each ring has exactly one writer and one
+  reader, so neither needs a lock: the writer only moves the head and the
+  reader only moves the tail.  The writer never waits.  If the reader falls
+  behind and the ring fills up, new records are thrown away and counted.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_EVENTS_H
+#define L7_EVENTS_H
+
+#include <sys/types.h>
+#include <string>
+#include "l7-stats.h"
+
+#define L7_EVENTS_MAGIC 0x6c376576 // "l7ev"
+#define L7_EVENTS_VERSION 1
+
+// One classification.  Addresses and ports are in network byte order, as
+// conntrack sees them in the original direction.
+struct l7_event_record {
+  u_int64_t time;          // when it was classified, usec since the epoch
+  u_int32_t saddr;
+  u_int32_t daddr;
+  u_int16_t sport;
+  u_int16_t dport;
+  u_int8_t proto;
+  u_int8_t pad[3];
+  u_int32_t mark;          // our part of the mark, as in the config file
+  u_int32_t packets;       // packets of the connection we had seen
+  u_int32_t bytes;         // bytes of application data we looked at
+  u_int32_t usec;          // from the start of the connection until now
+  char protocol[24];       // the pattern's name, empty if none matched
+};
+
+struct l7_events_header {
+  volatile u_int32_t magic; // written last, once the rest is set up
+  u_int32_t version;
+  u_int32_t nrings;
+  u_int32_t nrecords;       // in each ring, a power of two
+  u_int32_t recordsize;     // sizeof(l7_event_record), as a sanity check
+  u_int32_t pad[11];
+};
+
+// Each index gets its own cache line, so that the writer and the reader
+// don't keep taking it from each other.
+struct l7_events_ring {
+  volatile u_int64_t head;       // next record to write, only the writer
+  volatile u_int64_t overflows;  // records thrown away because we were full
+  u_int64_t pad1[6];
+  volatile u_int64_t tail;       // next record to read, only the reader
+  u_int64_t pad2[7];
+  // followed by nrecords records
+};
+
+// Where ring number i starts in a mapped log
+inline l7_events_ring *l7_events_ring_at(void *map, u_int32_t nrecords,
+                                         u_int32_t i)
+{
+  return (l7_events_ring *)((char *)map + sizeof(l7_events_header) +
+    (size_t)i*(sizeof(l7_events_ring) + nrecords*sizeof(l7_event_record)));
+}
+
+inline l7_event_record *l7_events_records(l7_events_ring *ring)
+{
+  return (l7_event_record *)(ring + 1);
+}
+
+inline size_t l7_events_size(u_int32_t nrings, u_int32_t nrecords)
+{
+  return sizeof(l7_events_header) +
+    (size_t)nrings*(sizeof(l7_events_ring) + nrecords*sizeof(l7_event_record));
+}
+
+class l7_event_log {
+ private:
+  void *map;
+  size_t mapsize;
+  u_int32_t nrings;
+  u_int32_t mask;
+  int nextring; // the next ring to give to a thread that asks
+
+ public:
+  l7_counter nevents;
+  l7_counter noverflows;
+
+  l7_event_log(string filename, unsigned int nrings,
+               unsigned int nrecords);
+  ~l7_event_log();
+  void record(const l7_event_record & event);
+};
+
+#endif
@@ -35,6 +35,15 @@ using namespace std;
 #include "l7-conntrack.h"
 #include "l7-queue.h"
 #include "l7-classify.h"
+#include "l7-pipeline.h"
+#include "l7-stats.h"
+#include "l7-shared.h"
+#include "l7-events.h"
+#include "l7-predict.h"
+#include "l7-capture.h"
+#include "l7-snapshot.h"
+#include "l7-overload.h"
+#include "l7-record.h"
 #include "util.h"
 #include "config.h"
 
@@ -50,6 +59,26 @@ static l7_conntrack* l7_connection_tracker;
 static l7_queue* l7_queue_tracker;
 
 static bool isdaemon = false;
+static bool asyncverdicts = false;
+static int nworkers = 0;
+static int workerdepth = 1024;
+static string statsfilename = "";
+static int statsinterval = 10;
+static string sharedfilename = "";
+static int sharedsize = 262144;
+static string eventfilename = "";
+static int eventsize = 4096;
+static int predictsize = 0;
+static int predictafter = 3;
+static int predictsample = 100;
+static string captureinterface = "";
+static int capturethreads = 1;
+static string pcapfilename = "";
+static int overloadmaxlevel = -1; // -1 for no overload control
+static string recordprefix = "";
+static unsigned long recordsize = 64; // megabytes in each file
+static int recordfiles = 8;
+static int recordpackets = 0; // of each connection, 0 for all
 
 // Configurable parameters
 extern int verbosity;
@@ -60,6 +89,26 @@ extern unsigned int markmask;
 extern unsigned int maskfirstbit;
 extern unsigned int masknbits;
 extern int clobbermark;
+extern unsigned int pattern_budget;
+extern unsigned int quarantine_after;
+extern int overrun_giveup;
+extern int queuebackend;
+extern unsigned int entropy_giveup;
+extern unsigned int classify_cache;
+extern int pattern_engine;
+extern unsigned long memlimit;
+extern int memevict;
+extern l7_shared_table* shared_flows;
+extern l7_event_log* event_log;
+extern l7_predictor* predictor;
+extern l7_recorder* recorder;
+extern int headersqueuenum;
+extern unsigned int ctringsize;
+extern int ctdropnew;
+extern int report_results;
+extern unsigned int capture_timeout;
+extern string snapshotfilename;
+extern int snapshotbuffers;
 
 
 #if 0
@@ -110,8 +159,41 @@ static void handle_sigint(int s)
 
 static void handle_sigterm(int s)
 {
-   unlink_pidfile();
-   exit(2);
+  // If we're keeping connections across restarts, the queue thread saves
+  // them and then exits.  A second SIGTERM doesn't wait for it.
+  static volatile sig_atomic_t terminating = 0;
+  if(snapshotfilename != "" && l7_connection_tracker && !terminating){
+    terminating = 1;
+    l7_snapshot_request(l7_connection_tracker->get_notify_fd(), true);
+    return;
+  }
+  unlink_pidfile();
+  exit(2);
+}
+
+static void handle_sigusr1(int s)
+{
+  l7_stats_request_dump();
+}
+
+static void handle_sigusr2(int s)
+{
+  if(l7_connection_tracker)
+    l7_snapshot_request(l7_connection_tracker->get_notify_fd(), false);
+}
+
+// Picks up the connections we knew about before we were restarted, less
+// the ones that have ended since.
+static void restore_snapshot()
+{
+  l7_flow_table restored;
+  unsigned long start = l7_now_ns();
+  long nsaved = l7_snapshot_read(snapshotfilename, restored);
+  if(nsaved < 0) return;
+  long nkept = l7_connection_tracker->reconcile(restored);
+  if(nkept >= 0)
+    l7printf(0, "Restored %ld of %ld saved connections in %lu ms, the rest "
+             "have ended.\n", nkept, nsaved, (l7_now_ns() - start)/1000000);
 }
 
 static void daemonize(void)
@@ -147,6 +229,46 @@ static void * start_queue_thread(void * qnum)
   pthread_exit(NULL);
 }
 
+static void * start_capture_thread(void *capture) 
+{
+  ((l7_capture *)capture)->run_interface();
+  pthread_exit(NULL);
+}
+
+// Passive mode: classifies copies of packets, from an interface or a file,
+// and reports what it finds instead of marking anything.
+static void run_passive(l7_classify *l7_classifier)
+{
+  report_results = 1;
+
+  if(pcapfilename != ""){
+    l7_capture *capture = new l7_capture(l7_classifier);
+    capture->run_pcap(pcapfilename);
+    capture->finish();
+    if(statsfilename != ""){
+      ofstream out(statsfilename.c_str());
+      l7_stats_write(out);
+    }
+    exit(0);
+  }
+
+  // One socket per thread, all in a fanout group of our own
+  int group = capturethreads > 1 ? getpid() & 0xffff : -1;
+  pthread_t *threads = new pthread_t[capturethreads];
+  for(int i = 0; i < capturethreads; i++){
+    l7_capture *capture = new l7_capture(l7_classifier);
+    capture->open_interface(captureinterface, group);
+    int rc = pthread_create(&threads[i], NULL, start_capture_thread, capture);
+    if(rc){
+      cerr << "Error creating capture thread. pthread_create returned " << rc
+           << endl;
+      exit(1);
+    }
+  }
+  for(int i = 0; i < capturethreads; i++)
+    pthread_join(threads[i], NULL);
+}
+
 // Checks whether the given mask has all its 1's in a row
 // and that it has enough room to work in
 static int checkandparsemask(const unsigned int mask)
@@ -186,8 +308,61 @@ static void handle_cmdline(int & qnum, string & conffilename,
   conffilename = ""; 
   const char *opts = "f:q:vh?sb:dn:p:m:cz";
 
+  // Options that have no short form
+  enum { OPT_ASYNC = 256, OPT_WORKERS, OPT_WORKER_DEPTH, OPT_STATS_FILE,
+         OPT_STATS_INTERVAL, OPT_PATTERN_BUDGET, OPT_QUARANTINE_AFTER,
+         OPT_OVERRUN_GIVEUP, OPT_MEM_LIMIT, OPT_MEM_POLICY, OPT_SHARED_TABLE,
+         OPT_SHARED_TABLE_SIZE, OPT_EVENT_LOG, OPT_EVENT_LOG_SIZE,
+         OPT_PREDICT, OPT_PREDICT_AFTER, OPT_PREDICT_SAMPLE, 
+         OPT_HEADERS_QUEUE, OPT_CT_RING_SIZE, OPT_CT_RING_POLICY,
+         OPT_LATENCY_HISTOGRAMS, OPT_ENGINE, OPT_CAPTURE, OPT_CAPTURE_THREADS,
+         OPT_CAPTURE_TIMEOUT, OPT_PCAP, OPT_SNAPSHOT, OPT_SNAPSHOT_BUFFERS,
+         OPT_OVERLOAD_CONTROL, OPT_OVERLOAD_MAX_LEVEL, OPT_ENTROPY_GIVEUP,
+         OPT_QUEUE_BACKEND, OPT_RECORD, OPT_RECORD_SIZE, OPT_RECORD_FILES,
+         OPT_RECORD_PACKETS, OPT_CLASSIFY_CACHE };
+  static struct option longopts[] = {
+    { "async",          no_argument,       NULL, OPT_ASYNC },
+    { "workers",        required_argument, NULL, OPT_WORKERS },
+    { "worker-depth",   required_argument, NULL, OPT_WORKER_DEPTH },
+    { "stats-file",     required_argument, NULL, OPT_STATS_FILE },
+    { "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+    { "pattern-budget", required_argument, NULL, OPT_PATTERN_BUDGET },
+    { "quarantine-after", required_argument, NULL, OPT_QUARANTINE_AFTER },
+    { "overrun-giveup", no_argument,       NULL, OPT_OVERRUN_GIVEUP },
+    { "mem-limit",      required_argument, NULL, OPT_MEM_LIMIT },
+    { "mem-policy",     required_argument, NULL, OPT_MEM_POLICY },
+    { "shared-table",   required_argument, NULL, OPT_SHARED_TABLE },
+    { "shared-table-size", required_argument, NULL, OPT_SHARED_TABLE_SIZE },
+    { "event-log",      required_argument, NULL, OPT_EVENT_LOG },
+    { "event-log-size", required_argument, NULL, OPT_EVENT_LOG_SIZE },
+    { "predict",        required_argument, NULL, OPT_PREDICT },
+    { "predict-after",  required_argument, NULL, OPT_PREDICT_AFTER },
+    { "predict-sample", required_argument, NULL, OPT_PREDICT_SAMPLE },
+    { "headers-queue",  required_argument, NULL, OPT_HEADERS_QUEUE },
+    { "ct-ring-size",   required_argument, NULL, OPT_CT_RING_SIZE },
+    { "ct-ring-policy", required_argument, NULL, OPT_CT_RING_POLICY },
+    { "latency-histograms", no_argument,   NULL, OPT_LATENCY_HISTOGRAMS },
+    { "engine",         required_argument, NULL, OPT_ENGINE },
+    { "capture",        required_argument, NULL, OPT_CAPTURE },
+    { "capture-threads", required_argument, NULL, OPT_CAPTURE_THREADS },
+    { "capture-timeout", required_argument, NULL, OPT_CAPTURE_TIMEOUT },
+    { "pcap",           required_argument, NULL, OPT_PCAP },
+    { "snapshot",       required_argument, NULL, OPT_SNAPSHOT },
+    { "snapshot-buffers", no_argument,     NULL, OPT_SNAPSHOT_BUFFERS },
+    { "overload-control", no_argument,     NULL, OPT_OVERLOAD_CONTROL },
+    { "overload-max-level", required_argument, NULL, OPT_OVERLOAD_MAX_LEVEL },
+    { "entropy-giveup", required_argument, NULL, OPT_ENTROPY_GIVEUP },
+    { "queue-backend",  required_argument, NULL, OPT_QUEUE_BACKEND },
+    { "record",         required_argument, NULL, OPT_RECORD },
+    { "record-size",    required_argument, NULL, OPT_RECORD_SIZE },
+    { "record-files",   required_argument, NULL, OPT_RECORD_FILES },
+    { "record-packets", required_argument, NULL, OPT_RECORD_PACKETS },
+    { "classify-cache", required_argument, NULL, OPT_CLASSIFY_CACHE },
+    { NULL, 0, NULL, 0 }
+  };
+
   int c;
-  while ((c = getopt (argc, argv, opts)) != -1)
+  while ((c = getopt_long (argc, argv, opts, longopts, NULL)) != -1)
   {
     switch(c)
     {
@@ -255,6 +430,241 @@ static void handle_cmdline(int & qnum, string & conffilename,
       case 'z':
         isdaemon = true;
         break;
+      case OPT_ASYNC:
+        asyncverdicts = true;
+        break;
+      case OPT_WORKERS:
+        nworkers = strtol(optarg, 0, 10);
+        if(nworkers < 0 || (nworkers > 64 && !dumb)){
+          cerr << "The number of workers is out of range. Valid numbers are\n"
+                  "0-64, or more if you give -d before this option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_WORKER_DEPTH:
+        workerdepth = strtol(optarg, 0, 10);
+        if(workerdepth < 1 || (workerdepth > 1048576 && !dumb)){
+          cerr << "The worker depth is out of range. Valid depths are\n"
+                  "1-1048576, or more if you give -d before this option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_STATS_FILE:
+        statsfilename = optarg;
+        break;
+      case OPT_STATS_INTERVAL:
+        statsinterval = strtol(optarg, 0, 10);
+        if(statsinterval < 1){
+          cerr << "The statistics interval must be a positive number of "
+                  "seconds.\n";
+          exit(1);
+        }
+        break;
+      case OPT_PATTERN_BUDGET:
+        if(strtol(optarg, 0, 10) < 0){
+          cerr << "The pattern budget must be a number of microseconds.\n";
+          exit(1);
+        }
+        pattern_budget = strtol(optarg, 0, 10);
+        break;
+      case OPT_QUARANTINE_AFTER:
+        if(strtol(optarg, 0, 10) < 0){
+          cerr << "--quarantine-after needs a number of overruns.\n";
+          exit(1);
+        }
+        quarantine_after = strtol(optarg, 0, 10);
+        break;
+      case OPT_OVERRUN_GIVEUP:
+        overrun_giveup = 1;
+        break;
+      case OPT_MEM_LIMIT:
+        if(strtoll(optarg, 0, 10) < 0){
+          cerr << "The memory limit must be a number of bytes.\n";
+          exit(1);
+        }
+        memlimit = strtoll(optarg, 0, 10);
+        break;
+      case OPT_MEM_POLICY:
+        if(string(optarg) == "nomatch")    memevict = 0;
+        else if(string(optarg) == "evict") memevict = 1;
+        else{
+          cerr << "The memory policy must be 'nomatch' or 'evict'.\n";
+          exit(1);
+        }
+        break;
+      case OPT_SHARED_TABLE:
+        sharedfilename = optarg;
+        break;
+      case OPT_SHARED_TABLE_SIZE:
+        sharedsize = strtol(optarg, 0, 10);
+        if(sharedsize < 1 || (sharedsize > 16777216 && !dumb)){
+          cerr << "The shared table size is out of range. Valid sizes are\n"
+                  "1-16777216, or more if you give -d before this option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_EVENT_LOG:
+        eventfilename = optarg;
+        break;
+      case OPT_EVENT_LOG_SIZE:
+        eventsize = strtol(optarg, 0, 10);
+        if(eventsize < 1 || (eventsize > 1048576 && !dumb)){
+          cerr << "The event log size is out of range. Valid sizes are\n"
+                  "1-1048576, or more if you give -d before this option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_PREDICT:
+        predictsize = strtol(optarg, 0, 10);
+        if(predictsize < 1 || (predictsize > 16777216 && !dumb)){
+          cerr << "The prediction cache size is out of range. Valid sizes\n"
+                  "are 1-16777216, or more if you give -d before this "
+                  "option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_PREDICT_AFTER:
+        predictafter = strtol(optarg, 0, 10);
+        if(predictafter < 1 || (predictafter < 2 && !dumb)){
+          cerr << "Trusting a server after one connection is a bad idea. "
+                  "Give -d before\nthis option if you really want to.\n";
+          exit(1);
+        }
+        break;
+      case OPT_PREDICT_SAMPLE:
+        predictsample = strtol(optarg, 0, 10);
+        if(predictsample < 0){
+          cerr << "--predict-sample must be 0 (never check) or more.\n";
+          exit(1);
+        }
+        break;
+      case OPT_HEADERS_QUEUE:
+        headersqueuenum = strtol(optarg, 0, 10);
+        if(headersqueuenum < 0 || headersqueuenum > 65535){
+          cerr << "The headers only queue number must be 0-65535.\n";
+          exit(1);
+        }
+        break;
+      case OPT_CT_RING_SIZE:
+        ctringsize = strtol(optarg, 0, 10);
+        if(ctringsize < 16 || (ctringsize > 1048576 && !dumb)){
+          cerr << "The conntrack ring size is out of range. Valid sizes are\n"
+                  "16-1048576, or more if you give -d before this option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_CT_RING_POLICY:
+        if(string(optarg) == "wait") ctdropnew = 0;
+        else if(string(optarg) == "dropnew") ctdropnew = 1;
+        else{
+          cerr << "--ct-ring-policy must be 'wait' or 'dropnew'.\n";
+          exit(1);
+        }
+        break;
+      case OPT_LATENCY_HISTOGRAMS:
+        l7_timing = true;
+        break;
+      case OPT_ENGINE:
+        if(string(optarg) == "auto") pattern_engine = L7_ENGINE_AUTO;
+        else if(string(optarg) == "regex") pattern_engine = L7_ENGINE_REGEX;
+        else if(string(optarg) == "nfa") pattern_engine = L7_ENGINE_NFA;
+        else{
+          cerr << "--engine must be 'auto', 'regex' or 'nfa'.\n";
+          exit(1);
+        }
+        break;
+      case OPT_CAPTURE:
+        captureinterface = optarg;
+        break;
+      case OPT_CAPTURE_THREADS:
+        capturethreads = strtol(optarg, 0, 10);
+        if(capturethreads < 1 || (capturethreads > 64 && !dumb)){
+          cerr << "The number of capture threads is out of range. Valid\n"
+                  "numbers are 1-64, or more if you give -d before this "
+                  "option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_CAPTURE_TIMEOUT:
+        if(strtol(optarg, 0, 10) < 1){
+          cerr << "--capture-timeout needs a number of seconds.\n";
+          exit(1);
+        }
+        capture_timeout = strtol(optarg, 0, 10);
+        break;
+      case OPT_PCAP:
+        pcapfilename = optarg;
+        break;
+      case OPT_SNAPSHOT:
+        snapshotfilename = optarg;
+        break;
+      case OPT_SNAPSHOT_BUFFERS:
+        snapshotbuffers = 1;
+        break;
+      case OPT_OVERLOAD_CONTROL:
+        if(overloadmaxlevel < 0) overloadmaxlevel = L7_LOAD_NONEW;
+        break;
+      case OPT_OVERLOAD_MAX_LEVEL:
+        overloadmaxlevel = -1;
+        for(int level = L7_LOAD_SHALLOW; level <= L7_LOAD_NONEW; level++)
+          if(string(optarg) == l7_load_name(level)) overloadmaxlevel = level;
+        if(overloadmaxlevel < 0){
+          cerr << "--overload-max-level must be 'shallow', 'essential' or "
+                  "'nonew'.\n";
+          exit(1);
+        }
+        break;
+      case OPT_ENTROPY_GIVEUP:
+        if(strtol(optarg, 0, 10) < 1){
+          cerr << "--entropy-giveup needs a number of bytes.\n";
+          exit(1);
+        }
+        entropy_giveup = strtol(optarg, 0, 10);
+        break;
+      case OPT_QUEUE_BACKEND:
+        if(string(optarg) == "direct") queuebackend = L7_QUEUE_DIRECT;
+        else if(string(optarg) == "library") queuebackend = L7_QUEUE_LIBRARY;
+        else{
+          cerr << "--queue-backend must be 'direct' or 'library'.\n";
+          exit(1);
+        }
+        break;
+      case OPT_RECORD:
+        recordprefix = optarg;
+        break;
+      case OPT_RECORD_SIZE:
+        recordsize = strtol(optarg, 0, 10);
+        if(recordsize < 1 || (recordsize > 4096 && !dumb)){
+          cerr << "The recording file size is out of range. Valid sizes are\n"
+                  "1-4096 megabytes, or more if you give -d before this "
+                  "option.\n";
+          exit(1);
+        }
+        break;
+      case OPT_RECORD_FILES:
+        recordfiles = strtol(optarg, 0, 10);
+        if(recordfiles < 1){
+          cerr << "--record-files needs a number of files to keep.\n";
+          exit(1);
+        }
+        break;
+      case OPT_RECORD_PACKETS:
+        recordpackets = strtol(optarg, 0, 10);
+        if(recordpackets < 1){
+          cerr << "--record-packets needs a number of packets.\n";
+          exit(1);
+        }
+        break;
+      case OPT_CLASSIFY_CACHE:
+        if(strtol(optarg, 0, 10) < 1 ||
+           (strtol(optarg, 0, 10) > 16777216 && !dumb)){
+          cerr << "The classification cache size is out of range. Valid "
+                  "sizes are\n1-16777216 entries, or more if you give -d "
+                  "before this option.\n";
+          exit(1);
+        }
+        classify_cache = strtol(optarg, 0, 10);
+        break;
       case 'h':
       case '?':
       default:
@@ -277,6 +687,49 @@ static void handle_cmdline(int & qnum, string & conffilename,
           "-c\t\tClobber existing marks instead of passing them unmodified\n"
           "-d\t\tAllow configurations that are probably ill-advised\n"
           "-z\t\tRun as daemon\n"
+          "--async\t\tGive verdicts without waiting for classification\n"
+          "--workers n\tClassify in n threads besides the queue thread\n"
+          "--worker-depth n\tLet up to n packets wait for each worker\n"
+          "--stats-file file\tPeriodically write statistics to file\n"
+          "--stats-interval s\tWrite statistics every s seconds\n"
+          "--pattern-budget us\tAllow each match to take us microseconds\n"
+          "--quarantine-after n\tStop using patterns that overrun n times\n"
+          "--overrun-giveup\tGive up on connections that cause overruns\n"
+          "--mem-limit bytes\tUse at most this much memory for connections\n"
+          "--mem-policy p\tAt the limit, 'nomatch' new or 'evict' old ones\n"
+          "--shared-table file\tShare results with other l7-filters via file\n"
+          "--shared-table-size n\tRoom for n connections in the shared table\n"
+          "--event-log file\tWrite each classification to file for others\n"
+          "--event-log-size n\tLet n events wait per thread for a reader\n"
+          "--predict n\tGuess from the history of up to n servers\n"
+          "--predict-after n\tTrust a server after n connections agree\n"
+          "--predict-sample n\tCheck one in n guesses by classifying\n"
+          "--headers-queue q\tAlso mark classified packets from queue q\n"
+          "--ct-ring-size n\tLet n conntrack events wait to be handled\n"
+          "--ct-ring-policy p\tWhen full, 'wait' or 'dropnew' connections\n"
+          "--latency-histograms\tTime each stage of handling a packet\n"
+          "--engine e\tMatch patterns with 'auto', 'regex' or 'nfa'\n"
+          "--capture if\tClassify copies of packets seen on interface if\n"
+          "--capture-threads n\tCapture and classify in n threads\n"
+          "--capture-timeout s\tForget captured connections idle for s "
+          "seconds\n"
+          "--pcap file\tClassify the packets in a pcap file, then exit\n"
+          "--snapshot file\tKeep connections in file across restarts\n"
+          "--snapshot-buffers\tKeep unclassified connections' data too\n"
+          "--overload-control\tInspect less when packets come too fast\n"
+          "--overload-max-level l\tGo no further than 'shallow', "
+          "'essential' or 'nonew'\n"
+          "--entropy-giveup bytes\tGive up on connections once this much "
+          "looks encrypted\n"
+          "--queue-backend b\tRead the queue 'direct' or through the "
+          "'library'\n"
+          "--record prefix\tWrite the packets we mark to pcapng files\n"
+          "--record-size mb\tStart a new file after this many megabytes\n"
+          "--record-files n\tKeep only the newest n files\n"
+          "--record-packets n\tOnly record the first n packets of each "
+          "connection\n"
+          "--classify-cache n\tRemember up to n classifications of "
+          "identical data\n"
           "\n"
           "See also 'man l7-filter'\n";
         exit(1);
@@ -284,6 +737,54 @@ static void handle_cmdline(int & qnum, string & conffilename,
     }
   }
 
+  if(headersqueuenum == qnum){
+    cerr << "--headers-queue must be a different queue from -q.\n";
+    exit(1);
+  }
+
+  if((quarantine_after || overrun_giveup) && !pattern_budget){
+    cerr << "--quarantine-after and --overrun-giveup need --pattern-budget.\n";
+    exit(1);
+  }
+
+  if(captureinterface != "" && pcapfilename != ""){
+    cerr << "Give --capture or --pcap, not both.\n";
+    exit(1);
+  }
+
+  if((captureinterface != "" || pcapfilename != "") &&
+     (asyncverdicts || nworkers || headersqueuenum >= 0)){
+    cerr << "--async, --workers and --headers-queue are for NFQUEUE.  In "
+            "passive mode,\nuse --capture-threads to classify in more "
+            "threads.\n";
+    exit(1);
+  }
+
+  if((captureinterface != "" || pcapfilename != "") &&
+     snapshotfilename != ""){
+    cerr << "--snapshot is for NFQUEUE.  In passive mode there's nothing to "
+            "keep marking.\n";
+    exit(1);
+  }
+
+  if((captureinterface != "" || pcapfilename != "") && recordprefix != ""){
+    cerr << "--record is for NFQUEUE.  In passive mode, a capture of the "
+            "interface\nalready has everything we see.\n";
+    exit(1);
+  }
+
+  if((captureinterface != "" || pcapfilename != "") &&
+     overloadmaxlevel >= 0){
+    cerr << "--overload-control is for NFQUEUE.  In passive mode nothing "
+            "waits on us.\n";
+    exit(1);
+  }
+
+  if(snapshotbuffers && snapshotfilename == ""){
+    cerr << "--snapshot-buffers needs --snapshot.\n";
+    exit(1);
+  }
+
   if(conffilename == ""){
     cerr << "You must specify a configuration file.  Try 'l7-filter -h'\n";
     exit(1);
@@ -356,17 +857,58 @@ int main(int argc, char **argv)
 
   handle_cmdline(qnum, conffilename, argc, argv);
 
-  check_requirements();
+  bool passive = captureinterface != "" || pcapfilename != "";
+  if(!passive) check_requirements();
 
   signal(SIGINT, handle_sigint);
   signal(SIGTERM, handle_sigterm);
+  signal(SIGUSR1, handle_sigusr1);
+  signal(SIGUSR2, handle_sigusr2);
 
   l7_classify * l7_classifier = new l7_classify(conffilename);
 
   if(isdaemon) daemonize(); // do this after reading and checking config file
 
+  if(predictsize)
+    predictor = new l7_predictor(predictsize, predictafter, predictsample);
+
+  if(sharedfilename != "")
+    shared_flows = new l7_shared_table(sharedfilename, sharedsize);
+
+  if(passive){
+    l7_stats_start(statsfilename, statsinterval);
+    // Each capture thread classifies, and so gets its own ring
+    if(eventfilename != "")
+      event_log = new l7_event_log(eventfilename, capturethreads, eventsize);
+    run_passive(l7_classifier);
+    return 0;
+  }
+
   l7_connection_tracker = new l7_conntrack(l7_classifier);
-  l7_queue_tracker = new l7_queue(l7_connection_tracker);
+  l7_connection_tracker->open();
+  if(snapshotfilename != "") restore_snapshot();
+
+  l7_stats_start(statsfilename, statsinterval);
+
+  // Asynchronous verdicts need somewhere to do the classification
+  if(asyncverdicts && nworkers == 0) nworkers = 1;
+
+  // Every thread that classifies gets its own ring: the workers and the
+  // queue thread.
+  if(eventfilename != "")
+    event_log = new l7_event_log(eventfilename, nworkers + 1, eventsize);
+
+  l7_pipeline * pipeline = NULL;
+  if(nworkers > 0){
+    pipeline = new l7_pipeline(nworkers, workerdepth, asyncverdicts);
+    pipeline->start();
+  }
+  if(overloadmaxlevel >= 0)
+    overload_control = new l7_overload(overloadmaxlevel);
+  if(recordprefix != "")
+    recorder = new l7_recorder(recordprefix, recordsize << 20, recordfiles,
+                               recordpackets);
+  l7_queue_tracker = new l7_queue(l7_connection_tracker, pipeline);
 
   //start up the connection tracking thread
   rc = pthread_create(&connection_tracking_thread, NULL,
@@ -0,0 +1,107 @@
+/*
+  The table of connections that the queue thread looks packets up in.
+  See l7-flows.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <stdlib.h>
+
+#include "l7-flows.h"
+
+// Start small, and keep at least half of the slots empty, so that runs of
+// full slots stay short.
+#define L7_FLOWS_INITIAL 1024
+
+l7_flow_table::l7_flow_table()
+{
+  slots = NULL;
+  mask = 0;
+  count = 0;
+  resize(L7_FLOWS_INITIAL);
+}
+
+l7_flow_table::~l7_flow_table()
+{
+  free(slots);
+}
+
+void l7_flow_table::resize(u_int32_t nslots)
+{
+  l7_flow_slot *old = slots;
+  u_int32_t oldnslots = old ? mask + 1 : 0;
+
+  slots = (l7_flow_slot *)calloc(nslots, sizeof(l7_flow_slot));
+  if(!slots){
+    cerr << "Out of memory for the table of connections\n";
+    exit(1);
+  }
+  mask = nslots - 1;
+
+  for(u_int32_t i = 0; i < oldnslots; i++){
+    if(!old[i].connection) continue;
+    u_int32_t j = l7_tuple_hash(old[i].tuple) & mask;
+    while(slots[j].connection) j = (j + 1) & mask;
+    slots[j] = old[i];
+  }
+  free(old);
+}
+
+l7_connection *l7_flow_table::insert(const l7_tuple & tuple,
+                                     l7_connection *connection)
+{
+  if(2*(count + 1) > mask + 1) resize(2*(mask + 1));
+
+  u_int32_t i = l7_tuple_hash(tuple) & mask;
+  for(; slots[i].connection; i = (i + 1) & mask){
+    if(slots[i].tuple == tuple){
+      l7_connection *old = slots[i].connection;
+      slots[i].connection = connection;
+      return old;
+    }
+  }
+  slots[i].tuple = tuple;
+  slots[i].connection = connection;
+  count++;
+  return NULL;
+}
+
+void l7_flow_table::reserve(unsigned int n)
+{
+  u_int32_t nslots = mask + 1;
+  while(2*n > nslots) nslots *= 2;
+  if(nslots != mask + 1) resize(nslots);
+}
+
+l7_connection *l7_flow_table::remove(const l7_tuple & tuple)
+{
+  u_int32_t i = l7_tuple_hash(tuple) & mask;
+  for(; slots[i].connection; i = (i + 1) & mask)
+    if(slots[i].tuple == tuple) break;
+  l7_connection *old = slots[i].connection;
+  if(!old) return NULL;
+
+  // Move back whatever after it in the run would no longer be found
+  // because of the hole.
+  u_int32_t hole = i;
+  for(u_int32_t j = (i + 1) & mask; slots[j].connection; j = (j + 1) & mask){
+    u_int32_t home = l7_tuple_hash(slots[j].tuple) & mask;
+    // Can it stay where it is, being between its home and the hole?
+    if(((j - home) & mask) < ((j - hole) & mask)) continue;
+    slots[hole] = slots[j];
+    hole = j;
+  }
+  slots[hole].connection = NULL;
+  count--;
+  return old;
+}
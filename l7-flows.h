@@ -0,0 +1,109 @@
+/*
+  The table of connections that the queue thread looks packets up in.
+
+  It is open addressing with linear probing, and each slot holds the
+  connection's tuple next to the pointer to it, so a lookup reads one or
+  two neighbouring slots and then only the connection it was after.  Both
+  of those are usually cache misses once there are more connections than
+  fit in the cache, so a lookup can be done in steps for a batch of
+  packets at a time: prefetch_slot() for all of them, then
+  prefetch_connection() for all of them, then find().  By the time find()
+  looks, the memory is on its way or there.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_FLOWS_H
+#define L7_FLOWS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+class l7_connection;
+
+// A connection's addresses, ports and protocol as conntrack sees them in the
+// original direction.  Addresses and ports are in network byte order.
+struct l7_tuple {
+  u_int32_t saddr;
+  u_int32_t daddr;
+  u_int16_t sport;
+  u_int16_t dport;
+  u_int8_t proto;
+};
+
+inline bool operator==(const l7_tuple & a, const l7_tuple & b)
+{
+  return a.saddr == b.saddr && a.daddr == b.daddr && a.sport == b.sport &&
+         a.dport == b.dport && a.proto == b.proto;
+}
+
+inline u_int32_t l7_tuple_hash(const l7_tuple & t)
+{
+  u_int32_t h = t.saddr * 0x9e3779b1u;
+  h = (h ^ t.daddr) * 0x85ebca6bu;
+  h = (h ^ ((u_int32_t)t.sport << 16 | t.dport)) * 0xc2b2ae35u;
+  h = (h ^ t.proto) * 0x9e3779b1u;
+  return h ^ (h >> 16);
+}
+
+struct l7_flow_slot {
+  l7_tuple tuple;
+  l7_connection *connection; // NULL if the slot is empty
+};
+
+class l7_flow_table {
+ private:
+  l7_flow_slot *slots;
+  u_int32_t mask;    // the number of slots, less one
+  unsigned int count;
+
+  void resize(u_int32_t nslots);
+
+ public:
+  l7_flow_table();
+  ~l7_flow_table();
+
+  // hash is l7_tuple_hash() of the tuple being looked for
+  void prefetch_slot(u_int32_t hash) const
+  {
+    __builtin_prefetch(&slots[hash & mask]);
+  }
+  void prefetch_connection(const l7_tuple & tuple, u_int32_t hash) const
+  {
+    for(u_int32_t i = hash & mask; slots[i].connection; i = (i + 1) & mask){
+      if(slots[i].tuple == tuple){
+        // The reference count and mark are written first, then the rest
+        __builtin_prefetch(slots[i].connection, 1);
+        __builtin_prefetch((char *)slots[i].connection + 64, 1);
+        return;
+      }
+    }
+  }
+  l7_connection *find(const l7_tuple & tuple, u_int32_t hash) const
+  {
+    for(u_int32_t i = hash & mask; slots[i].connection; i = (i + 1) & mask)
+      if(slots[i].tuple == tuple) return slots[i].connection;
+    return NULL;
+  }
+
+  // Both return the connection that was there, if any
+  l7_connection *insert(const l7_tuple & tuple, l7_connection *connection);
+  l7_connection *remove(const l7_tuple & tuple);
+  // Makes room for n connections in all, so that adding that many at once
+  // doesn't grow the table one doubling at a time
+  void reserve(unsigned int n);
+
+  unsigned int size() const { return count; }
+  // For going through all of them: slots that are empty give NULL
+  u_int32_t get_nslots() const { return mask + 1; }
+  l7_connection *get_slot(u_int32_t i) const { return slots[i].connection; }
+  size_t get_bytes() const { return (mask + 1)*sizeof(l7_flow_slot); }
+};
+
+#endif
@@ -0,0 +1,116 @@
+/*
+  Turns pattern files into C++ that matches them, for compiling into
+  l7-filter (see l7-compiled.h).  The build runs it as
+
+    l7-matchergen file.pat ... > l7-matchers.cpp
+
+  with the files in COMPILED_PATTERNS.  Patterns the NFA can't take are
+  left out, with a warning, and are matched at run time as usual.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <regex.h>
+
+#include "l7-classify.h"
+#include "l7-parse-patterns.h"
+#include "l7-nfa.h"
+#include "util.h"
+
+// l7-classify.cpp wants these, which l7-filter gets from its command line
+extern int verbosity;
+unsigned int buflen = 8*1500;
+int maxpackets = 10;
+
+// As a C string literal.  Only printable ASCII is left as it is, and '?'
+// is escaped too, so that nothing can turn into a trigraph.
+static string quote(const string & s)
+{
+  string q = "\"";
+  for(unsigned int i = 0; i < s.size(); i++){
+    unsigned char c = s[i];
+    if(c == '"' || c == '\\' || c == '?' || c < ' ' || c > '~'){
+      char octal[8];
+      snprintf(octal, sizeof(octal), "\\%03o", c);
+      q += octal;
+    }
+    else q += c;
+  }
+  return q + "\"";
+}
+
+// Protocol names may have characters that identifiers can't
+static string symbol_for(const string & name, int n)
+{
+  stringstream s;
+  s << "l7m" << n << "_";
+  for(unsigned int i = 0; i < name.size(); i++)
+    s << (isalnum(name[i]) ? name[i] : '_');
+  return s.str();
+}
+
+int main(int argc, char **argv)
+{
+  verbosity = -1;
+  if(argc > 1 && argv[1][0] == '-'){
+    cerr << "Syntax: l7-matchergen file.pat ... > l7-matchers.cpp\n";
+    exit(1);
+  }
+
+  cout << "// Made by l7-matchergen from";
+  if(argc == 1) cout << " no pattern files";
+  for(int i = 1; i < argc; i++) cout << " " << argv[i];
+  cout << ".\n// Don't edit, change COMPILED_PATTERNS and rebuild instead.\n\n"
+       << "#include \"l7-compiled.h\"\n";
+
+  int ncompiled = 0;
+  for(int i = 1; i < argc; i++){
+    int cflags, eflags;
+    string pattern;
+    if(!parse_pattern_file(cflags, eflags, pattern, argv[i])){
+      cerr << "l7-matchergen: can't read a pattern from " << argv[i] << endl;
+      exit(1);
+    }
+
+    string name = basename(string(argv[i]));
+    l7_pattern *p = new l7_pattern(name, pattern, eflags, cflags, 3);
+    const l7_nfa *nfa = p->get_nfa();
+    if(!nfa){
+      cerr << "l7-matchergen: leaving out " << name << " ("
+           << p->get_engine_note() << "), it will be matched at run time.\n";
+      continue;
+    }
+
+    string symbol = symbol_for(name, ncompiled++);
+    cout << "\n// " << name << ", from " << argv[i] << "\n";
+    nfa->write_source(cout, symbol);
+    cout << "\nstatic const l7_compiled_matcher " << symbol << "_matcher = {\n"
+         << "  " << quote(name) << ",\n"
+         << "  " << quote(p->get_regex()) << ",\n"
+         << "  " << cflags << ", " << eflags << ", " << nfa->get_positions()
+         << ", " << symbol << "_matches\n};\n"
+         << "static l7_compiled_registration " << symbol << "_registration(&"
+         << symbol << "_matcher);\n";
+  }
+
+  if(!cout.good()){
+    cerr << "l7-matchergen: couldn't write the matchers out\n";
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,612 @@
+/*
+  A bit-parallel NFA for matching patterns without regexec().  See l7-nfa.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <map>
+#include <string>
+#include <stdlib.h>
+#include <limits.h>
+#include <regex.h>
+#include <cstring>
+#include <stdio.h>
+
+#include "l7-nfa.h"
+
+static const l7_nfa_set nothing = { 0, 0, 0, 0 };
+
+static inline void add_state(l7_nfa_set & set, unsigned int i)
+{
+  set[i/64] |= 1ULL << (i%64);
+}
+
+static inline bool no_states(const l7_nfa_set & set)
+{
+  return !(set[0] | set[1] | set[2] | set[3]);
+}
+
+// The pieces of a pattern are put together from these, bottom up.  A
+// fragment's states link to each other through the builder's follow sets.
+struct l7_nfa_fragment {
+  bool nullable;
+  l7_nfa_set first;
+  l7_nfa_set last;
+};
+
+enum { L7_NFA_CHAR, L7_NFA_BOS, L7_NFA_EOS };
+
+// A set of bytes, for the byte_class() cache
+struct l7_nfa_bytes {
+  u_int64_t bits[4];
+};
+
+class l7_nfa_builder {
+ private:
+  const char *re;
+  unsigned int at;     // how far into re we've read
+  int depth;           // of parentheses
+  int cflags;
+  map<string, l7_nfa_bytes> classes;
+
+  l7_nfa_fragment empty();
+  l7_nfa_fragment state(int kind, const l7_nfa_bytes & bytes);
+  l7_nfa_fragment cat(const l7_nfa_fragment & a, const l7_nfa_fragment & b);
+  l7_nfa_fragment alt(const l7_nfa_fragment & a, const l7_nfa_fragment & b);
+  l7_nfa_fragment loop(const l7_nfa_fragment & a, bool nullable);
+  l7_nfa_fragment opt(const l7_nfa_fragment & a);
+
+  l7_nfa_fragment branch();
+  l7_nfa_fragment piece(unsigned int start, unsigned int end);
+  l7_nfa_fragment atom(bool & anchor);
+  l7_nfa_fragment quantify(const l7_nfa_fragment & a, unsigned int start,
+                           unsigned int mark);
+  l7_nfa_fragment repeat(const l7_nfa_fragment & a, unsigned int start,
+                         unsigned int end, unsigned int mark, int min,
+                         int max);
+  bool byte_class(const string & text, l7_nfa_bytes & bytes);
+  bool number(int & n);
+
+ public:
+  string why;          // set if we gave up
+  unsigned int npositions;
+  int kinds[L7_NFA_MAX_POSITIONS];
+  l7_nfa_bytes bytes[L7_NFA_MAX_POSITIONS];
+  l7_nfa_set follow[L7_NFA_MAX_POSITIONS];
+
+  l7_nfa_builder(const char *re, int cflags);
+  l7_nfa_fragment regex();
+  bool done() { return re[at] == '\0'; }
+};
+
+l7_nfa_builder::l7_nfa_builder(const char *re, int cflags)
+{
+  this->re = re;
+  this->cflags = cflags;
+  at = 0;
+  depth = 0;
+  npositions = 0;
+}
+
+l7_nfa_fragment l7_nfa_builder::empty()
+{
+  l7_nfa_fragment f;
+  f.nullable = true;
+  f.first = f.last = nothing;
+  return f;
+}
+
+l7_nfa_fragment l7_nfa_builder::state(int kind, const l7_nfa_bytes & bytes)
+{
+  l7_nfa_fragment f = empty();
+  if(npositions >= L7_NFA_MAX_POSITIONS){
+    if(why == "") why = "too big";
+    return f;
+  }
+
+  unsigned int p = npositions++;
+  kinds[p] = kind;
+  this->bytes[p] = bytes;
+  follow[p] = nothing;
+
+  f.nullable = false;
+  add_state(f.first, p);
+  add_state(f.last, p);
+  return f;
+}
+
+// Makes every state in from able to go to every state in to
+static void link(l7_nfa_set *follow, const l7_nfa_set & from,
+                 const l7_nfa_set & to)
+{
+  for(int i = 0; i < 4; i++){
+    u_int64_t w = from[i];
+    while(w){
+      follow[i*64 + __builtin_ctzll(w)] |= to;
+      w &= w - 1;
+    }
+  }
+}
+
+l7_nfa_fragment l7_nfa_builder::cat(const l7_nfa_fragment & a,
+                                    const l7_nfa_fragment & b)
+{
+  l7_nfa_fragment f;
+  link(follow, a.last, b.first);
+  f.nullable = a.nullable && b.nullable;
+  f.first = a.nullable ? a.first | b.first : a.first;
+  f.last = b.nullable ? a.last | b.last : b.last;
+  return f;
+}
+
+l7_nfa_fragment l7_nfa_builder::alt(const l7_nfa_fragment & a,
+                                    const l7_nfa_fragment & b)
+{
+  l7_nfa_fragment f;
+  f.nullable = a.nullable || b.nullable;
+  f.first = a.first | b.first;
+  f.last = a.last | b.last;
+  return f;
+}
+
+// a* if nullable, a+ if not
+l7_nfa_fragment l7_nfa_builder::loop(const l7_nfa_fragment & a, bool nullable)
+{
+  l7_nfa_fragment f = a;
+  link(follow, a.last, a.first);
+  f.nullable = a.nullable || nullable;
+  return f;
+}
+
+l7_nfa_fragment l7_nfa_builder::opt(const l7_nfa_fragment & a)
+{
+  l7_nfa_fragment f = a;
+  f.nullable = true;
+  return f;
+}
+
+// regex := branch ('|' branch)*
+l7_nfa_fragment l7_nfa_builder::regex()
+{
+  l7_nfa_fragment f = branch();
+  while(why == "" && re[at] == '|'){
+    at++;
+    f = alt(f, branch());
+  }
+  return f;
+}
+
+// branch := piece*
+l7_nfa_fragment l7_nfa_builder::branch()
+{
+  l7_nfa_fragment f = empty();
+  while(why == "" && re[at] != '\0' && re[at] != '|'){
+    if(re[at] == ')'){
+      if(depth > 0) break;
+      // regcomp() takes an unmatched ')' as an ordinary character
+      why = "unmatched )";
+      break;
+    }
+    f = cat(f, piece(at, UINT_MAX));
+  }
+  return f;
+}
+
+static bool is_quantifier(char c)
+{
+  return c == '*' || c == '+' || c == '?' || c == '{';
+}
+
+// piece := atom quantifier*, reading no further than end
+l7_nfa_fragment l7_nfa_builder::piece(unsigned int start, unsigned int end)
+{
+  bool anchor = false;
+  unsigned int mark = npositions;
+  at = start;
+  l7_nfa_fragment f = atom(anchor);
+  while(why == "" && at < end && is_quantifier(re[at])){
+    if(anchor){
+      why = "repeated anchor";
+      break;
+    }
+    f = quantify(f, start, mark);
+  }
+  return f;
+}
+
+// Applies the quantifier at re[at] to a, which was read from re[start] and
+// whose states are those from mark on.
+l7_nfa_fragment l7_nfa_builder::quantify(const l7_nfa_fragment & a,
+                                         unsigned int start, unsigned int mark)
+{
+  switch(re[at++]){
+    case '*': return loop(a, true);
+    case '+': return loop(a, false);
+    case '?': return opt(a);
+  }
+
+  // {n}, {n,}, {,m} or {n,m}
+  unsigned int end = at - 1;
+  int min = 0, max;
+  if(re[at] != ',' && !number(min)) return a;
+  if(re[at] == ','){
+    at++;
+    if(re[at] == '}') max = -1;
+    else if(!number(max)) return a;
+  }
+  else max = min;
+  if(re[at] != '}' || (max >= 0 && max < min)){
+    why = "bad interval";
+    return a;
+  }
+  at++;
+
+  unsigned int after = at;
+  l7_nfa_fragment f = repeat(a, start, end, mark, min, max);
+  at = after;
+  return f;
+}
+
+bool l7_nfa_builder::number(int & n)
+{
+  if(re[at] < '0' || re[at] > '9'){
+    why = "bad interval";
+    return false;
+  }
+  n = 0;
+  while(re[at] >= '0' && re[at] <= '9' && n <= RE_DUP_MAX)
+    n = n*10 + re[at++] - '0';
+  return true;
+}
+
+// Writes out a{min,max} (max -1 for no limit), where re[start] up to
+// re[end] is a, which has been read once already.  Each further copy is
+// read again so that it gets states of its own.
+l7_nfa_fragment l7_nfa_builder::repeat(const l7_nfa_fragment & a,
+                                       unsigned int start, unsigned int end,
+                                       unsigned int mark, int min, int max)
+{
+  if(max == 0){
+    // a{0} matches only the empty string.  a's states were the last ones
+    // made and nothing links to them yet, so they can be thrown away.
+    npositions = mark;
+    return empty();
+  }
+
+  l7_nfa_fragment f = empty();
+  int copies = max < 0 ? (min > 1 ? min : 1) : max;
+  for(int i = 0; i < copies && why == ""; i++){
+    l7_nfa_fragment copy = i == 0 ? a : piece(start, end);
+    if(i == copies - 1 && max < 0) copy = loop(copy, min == 0);
+    else if(i >= min) copy = opt(copy);
+    f = cat(f, copy);
+  }
+  return f;
+}
+
+l7_nfa_fragment l7_nfa_builder::atom(bool & anchor)
+{
+  l7_nfa_bytes none = { { 0, 0, 0, 0 } }, set;
+  unsigned int start = at;
+
+  switch(re[at]){
+    case '(': {
+      at++;
+      depth++;
+      l7_nfa_fragment f = regex();
+      depth--;
+      if(re[at] == ')') at++;
+      else if(why == "") why = "unmatched (";
+      return f;
+    }
+    case '^':
+      at++;
+      anchor = true;
+      return state(L7_NFA_BOS, none);
+    case '$':
+      at++;
+      anchor = true;
+      return state(L7_NFA_EOS, none);
+    case '[':
+      at++;
+      if(re[at] == '^') at++;
+      if(re[at] == ']') at++;
+      while(re[at] != ']'){
+        if(re[at] == '\0'){
+          why = "unmatched [";
+          return empty();
+        }
+        if(re[at] == '[' && (re[at+1] == '.' || re[at+1] == '=')){
+          why = "collating element";
+          return empty();
+        }
+        if(re[at] == '[' && re[at+1] == ':'){
+          const char *close = strstr(re + at + 2, ":]");
+          if(!close){
+            why = "bad character class";
+            return empty();
+          }
+          at = close - re + 1;
+        }
+        at++;
+      }
+      at++;
+      break;
+    case '\\':
+      at++;
+      if(re[at] == '\0' || strchr("0123456789bB<>`'", re[at])){
+        why = "back-reference or word boundary";
+        return empty();
+      }
+      at++;
+      break;
+    case '*': case '+': case '?': case '{':
+      why = "quantifier with nothing to repeat";
+      return empty();
+    default:
+      at++;
+  }
+
+  if(!byte_class(string(re + start, at - start), set)) return empty();
+  return state(L7_NFA_CHAR, set);
+}
+
+// Finds which bytes text, which should match exactly one, matches.  This
+// asks regcomp() itself, so that case, bracket expressions, classes and
+// escapes mean exactly what they would to regexec().
+bool l7_nfa_builder::byte_class(const string & text, l7_nfa_bytes & bytes)
+{
+  map<string, l7_nfa_bytes>::iterator cached = classes.find(text);
+  if(cached != classes.end()){
+    bytes = cached->second;
+    return true;
+  }
+
+  regex_t preg;
+  if(regcomp(&preg, text.c_str(), cflags | REG_NOSUB) != 0){
+    why = "can't compile " + text + " alone";
+    return false;
+  }
+
+  memset(&bytes, 0, sizeof(bytes));
+  // Our buffers never have nulls in them
+  for(int c = 1; c < 256; c++){
+    char s[2] = { (char)c, '\0' };
+    if(regexec(&preg, s, 0, NULL, 0) == 0)
+      bytes.bits[c/64] |= 1ULL << (c%64);
+  }
+  regfree(&preg);
+
+  classes[text] = bytes;
+  return true;
+}
+
+l7_nfa::l7_nfa()
+{
+  chars = follow = NULL;
+}
+
+l7_nfa::~l7_nfa()
+{
+  delete [] chars;
+  delete [] follow;
+}
+
+l7_nfa *l7_nfa::compile(const char *regex, int cflags, int eflags,
+                        string & why)
+{
+  if(!(cflags & REG_EXTENDED)){
+    why = "not an extended regular expression";
+    return NULL;
+  }
+  if(cflags & REG_NEWLINE){
+    why = "REG_NEWLINE";
+    return NULL;
+  }
+
+  l7_nfa_builder *b = new l7_nfa_builder(regex, cflags);
+  l7_nfa_fragment f = b->regex();
+  if(b->why == "" && !b->done()) b->why = "unmatched )";
+  if(b->why != ""){
+    why = b->why;
+    delete b;
+    return NULL;
+  }
+
+  l7_nfa *nfa = new l7_nfa();
+  nfa->npositions = b->npositions;
+  nfa->nullable = f.nullable;
+  nfa->first = f.first;
+  nfa->last = f.last;
+  nfa->bos = nfa->eos = nothing;
+  nfa->notbol = eflags & REG_NOTBOL;
+  nfa->noteol = eflags & REG_NOTEOL;
+
+  nfa->chars = new l7_nfa_set[256];
+  for(int c = 0; c < 256; c++) nfa->chars[c] = nothing;
+  for(unsigned int p = 0; p < b->npositions; p++){
+    if(b->kinds[p] == L7_NFA_BOS) add_state(nfa->bos, p);
+    else if(b->kinds[p] == L7_NFA_EOS) add_state(nfa->eos, p);
+    else{
+      for(int c = 0; c < 256; c++)
+        if(b->bytes[p].bits[c/64] & (1ULL << (c%64)))
+          add_state(nfa->chars[c], p);
+    }
+  }
+
+  // Only take '^' where nothing can come before it and '$' where nothing
+  // can come after.  Elsewhere (inside loops, say) regexec() has its own
+  // ideas about what they mean, and we'd rather agree with it.
+  for(unsigned int p = 0; p < b->npositions; p++){
+    if(!no_states(b->follow[p] & nfa->bos) ||
+       (b->kinds[p] == L7_NFA_EOS && !no_states(b->follow[p]))){
+      why = "anchor in the middle";
+      delete b;
+      delete nfa;
+      return NULL;
+    }
+  }
+
+  // follow[chunk*16 + nibble] is everything that can come after any of the
+  // states chunk*4 to chunk*4+3 whose bits are set in nibble
+  nfa->nchunks = (b->npositions + 3)/4;
+  nfa->follow = new l7_nfa_set[nfa->nchunks*16];
+  for(unsigned int chunk = 0; chunk < nfa->nchunks; chunk++){
+    for(int nibble = 0; nibble < 16; nibble++){
+      l7_nfa_set s = nothing;
+      for(int i = 0; i < 4; i++)
+        if(nibble & (1 << i) && chunk*4 + i < b->npositions)
+          s |= b->follow[chunk*4 + i];
+      nfa->follow[chunk*16 + nibble] = s;
+    }
+  }
+
+  nfa->anchored = true;
+  for(int c = 0; c < 256; c++){
+    nfa->starts[c] = !no_states(nfa->first & nfa->chars[c]);
+    if(nfa->starts[c]) nfa->anchored = false;
+  }
+
+  delete b;
+  return nfa;
+}
+
+// Puts in next every state that can come after one in now
+inline void l7_nfa::follow_of(const l7_nfa_set & now, l7_nfa_set & next) const
+{
+  next = nothing;
+  for(unsigned int i = 0; i*64 < npositions; i++){
+    u_int64_t w = now[i];
+    while(w){
+      unsigned int bit = __builtin_ctzll(w) & ~3;
+      next |= follow[(i*64 + bit)/4*16 + ((w >> bit) & 15)];
+      w &= ~(15ULL << bit);
+    }
+  }
+}
+
+// Does the pattern match anywhere in the first len bytes of buffer?
+bool l7_nfa::matches(const char *buffer, unsigned int len) const
+{
+  if(nullable) return true;
+
+  const unsigned char *p = (const unsigned char *)buffer, *end = p + len;
+  l7_nfa_set now = nothing, next;
+
+  if(!notbol){
+    now = first & bos;
+    if(!no_states(now & last)) return true;
+  }
+
+  while(p < end){
+    if(no_states(now)){
+      // Nothing started yet, so skip ahead to something that can start it
+      if(anchored) break;
+      while(p < end && !starts[*p]) p++;
+      if(p == end) break;
+      now = first & chars[*p++];
+    }
+    else{
+      follow_of(now, next);
+      now = (next | first) & chars[*p++];
+    }
+    if(!no_states(now & last)) return true;
+  }
+
+  if(!noteol){
+    follow_of(now, next);
+    now = (next | first) & eos;
+    if(!no_states(now & last)) return true;
+  }
+  return false;
+}
+
+unsigned int l7_nfa::get_positions() const
+{
+  return npositions;
+}
+
+bool l7_nfa::is_anchored() const
+{
+  return anchored;
+}
+
+// How much memory the tables take
+size_t l7_nfa::get_size() const
+{
+  return sizeof(*this) + (256 + nchunks*16)*sizeof(l7_nfa_set);
+}
+
+static void write_words(ostream & out, const l7_nfa_set & set, unsigned int n)
+{
+  char word[32];
+  out << "{ ";
+  for(unsigned int i = 0; i < n; i++){
+    snprintf(word, sizeof(word), "%s0x%llxULL", i ? ", " : "",
+             (unsigned long long)set[i]);
+    out << word;
+  }
+  out << " }";
+}
+
+static void write_sets(ostream & out, const l7_nfa_set *sets,
+                       unsigned int nsets, unsigned int n)
+{
+  out << "  {\n";
+  for(unsigned int i = 0; i < nsets; i++){
+    out << "    ";
+    write_words(out, sets[i], n);
+    out << (i + 1 < nsets ? ",\n" : "\n");
+  }
+  out << "  }";
+}
+
+void l7_nfa::write_source(ostream & out, const string & symbol) const
+{
+  // Only as many words as there are states, and never an empty array
+  unsigned int words = npositions ? (npositions + 63)/64 : 1;
+  unsigned int chunks = nchunks ? nchunks : 1;
+  l7_nfa_set *nofollow = NULL;
+  const l7_nfa_set *f = follow;
+  if(!nchunks){
+    nofollow = new l7_nfa_set[16];
+    for(int i = 0; i < 16; i++) nofollow[i] = nothing;
+    f = nofollow;
+  }
+
+  out << "// " << npositions << " states\n"
+      << "static const l7_compiled_tables<" << words << ", " << chunks << "> "
+      << symbol << " = {\n  ";
+  write_words(out, first, words);
+  out << ",\n  ";
+  write_words(out, last, words);
+  out << ",\n  ";
+  write_words(out, bos, words);
+  out << ",\n  ";
+  write_words(out, eos, words);
+  out << ",\n  {";
+  for(int c = 0; c < 256; c++)
+    out << (c % 32 ? "" : "\n    ") << (starts[c] ? "1," : "0,");
+  out << "\n  },\n";
+  write_sets(out, chars, 256, words);
+  out << ",\n";
+  write_sets(out, f, chunks*16, words);
+  out << "\n};\n\n";
+  delete [] nofollow;
+
+  out << "static bool " << symbol << "_matches(const char *buffer, "
+      << "unsigned int len)\n{\n"
+      << "  return l7_compiled_match<" << (nullable ? "true" : "false") << ", "
+      << (anchored ? "true" : "false") << ", "
+      << (notbol ? "true" : "false") << ", "
+      << (noteol ? "true" : "false") << ">(" << symbol
+      << ", buffer, len);\n}\n";
+}
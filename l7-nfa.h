@@ -0,0 +1,80 @@
+/*
+  A bit-parallel NFA for matching patterns without regexec().
+
+  regexec() backtracks, which some patterns (long bounded repetitions,
+  big alternations) make slow, and turning those patterns into a DFA can
+  take more states than there is memory for.  Instead, a pattern of up to
+  L7_NFA_MAX_POSITIONS characters is turned into a Glushkov automaton: one
+  state for each character (or bracket expression, or '.') in the pattern,
+  after bounded repetitions are written out.  The set of states the
+  automaton is in is a single 256-bit vector, so each byte of data is one
+  step of a few vector operations, however many states are active.
+
+  A step is: next = (follow(now) | first) & chars[byte].  follow(now), the
+  union of the states that may come after each active one, is looked up
+  four states at a time from tables made when the pattern is compiled.
+  '^' and '$' are states of their own, matched by pretend characters fed
+  in before and after the data.
+
+  Patterns that use anything we don't handle here (back-references, word
+  boundaries, REG_NEWLINE, ...) are left to regexec().
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_NFA_H
+#define L7_NFA_H
+
+#include <sys/types.h>
+#include <string>
+#include <ostream>
+
+using namespace std;
+
+#define L7_NFA_MAX_POSITIONS 256
+
+// A set of states, one bit each.  It is only aligned like a u_int64_t so
+// that new and the STL can be trusted with it; unaligned vector loads cost
+// next to nothing on anything recent.
+typedef u_int64_t l7_nfa_set __attribute__((vector_size(32), aligned(8)));
+
+class l7_nfa {
+ private:
+  unsigned int npositions;
+  bool nullable;         // matches the empty string, so matches anything
+  l7_nfa_set first;      // states that can start a match
+  l7_nfa_set last;       // states that can end one
+  l7_nfa_set bos;        // the '^' states
+  l7_nfa_set eos;        // the '$' states
+  l7_nfa_set *chars;     // [256], the states each byte can be matched by
+  l7_nfa_set *follow;    // [nchunks*16], see follow_of()
+  unsigned int nchunks;
+  bool starts[256];      // bytes that something in first matches
+  bool anchored;         // no byte does, so only '^' can start a match
+  bool notbol;           // from REG_NOTBOL and REG_NOTEOL
+  bool noteol;
+
+  l7_nfa();
+  void follow_of(const l7_nfa_set & now, l7_nfa_set & next) const;
+
+ public:
+  ~l7_nfa();
+  // Returns NULL, and the reason in why, if the pattern can't be done
+  static l7_nfa *compile(const char *regex, int cflags, int eflags,
+                         string & why);
+  bool matches(const char *buffer, unsigned int len) const;
+  unsigned int get_positions() const;
+  bool is_anchored() const;
+  size_t get_size() const;
+  // Writes the automaton out as C++ for l7-matchergen (see l7-compiled.h),
+  // as tables called symbol and a function called symbol_matches
+  void write_source(ostream & out, const string & symbol) const;
+};
+
+#endif
@@ -0,0 +1,184 @@
+/*
+  Reading packets from nfnetlink_queue and giving their verdicts without
+  libnetfilter_queue.  See l7-nfqueue.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cstring>
+
+extern "C" {
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+}
+
+#include "l7-nfqueue.h"
+
+// A whole verdict message as the kernel wants it.  Every part is a
+// multiple of four bytes long, so there is no padding to fill in.
+struct l7_nfq_verdict_msg {
+  struct nlmsghdr nlh;
+  struct nfgenmsg nfg;
+  struct nlattr verdictattr;
+  struct nfqnl_msg_verdict_hdr verdict;
+  struct nlattr markattr;
+  u_int32_t mark;
+};
+
+int l7_nfq_parse(unsigned char *buf, int len, l7_nfq_packet *packets,
+                 int max, int & used, int & nerrors)
+{
+  int n = 0;
+  used = 0;
+  nerrors = 0;
+
+  while(len - used >= (int)sizeof(struct nlmsghdr) && n < max){
+    struct nlmsghdr *nlh = (struct nlmsghdr *)(buf + used);
+    if(nlh->nlmsg_len < sizeof(*nlh) ||
+       nlh->nlmsg_len > (u_int32_t)(len - used))
+      return -1;
+    unsigned char *end = buf + used + nlh->nlmsg_len;
+    used += NLMSG_ALIGN(nlh->nlmsg_len);
+    if(used > len) used = len;
+
+    if(nlh->nlmsg_type == NLMSG_ERROR){
+      // Also how the kernel acknowledges, with an error of 0
+      struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nlh);
+      if(nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*err)) && err->error)
+        nerrors++;
+      continue;
+    }
+    if(nlh->nlmsg_type != ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET) ||
+       nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg)))
+      continue;
+
+    l7_nfq_packet & packet = packets[n];
+    struct nfgenmsg *nfg = (struct nfgenmsg *)NLMSG_DATA(nlh);
+    packet.queuenum = ntohs(nfg->res_id);
+    packet.mark = 0;
+    packet.payload = NULL;
+    packet.len = 0;
+    bool gotid = false;
+
+    unsigned char *a = (unsigned char *)nfg + NLMSG_ALIGN(sizeof(*nfg));
+    while(end - a >= NLA_HDRLEN){
+      struct nlattr *attr = (struct nlattr *)a;
+      if(attr->nla_len < NLA_HDRLEN || attr->nla_len > end - a) return -1;
+      unsigned char *value = a + NLA_HDRLEN;
+      int valuelen = attr->nla_len - NLA_HDRLEN;
+      switch(attr->nla_type & NLA_TYPE_MASK){
+        case NFQA_PACKET_HDR:
+          if(valuelen >= (int)sizeof(struct nfqnl_msg_packet_hdr)){
+            struct nfqnl_msg_packet_hdr *ph;
+            ph = (struct nfqnl_msg_packet_hdr *)value;
+            packet.id = ntohl(ph->packet_id);
+            gotid = true;
+          }
+          break;
+        case NFQA_MARK:
+          if(valuelen >= 4){
+            u_int32_t mark;
+            memcpy(&mark, value, sizeof(mark));
+            packet.mark = ntohl(mark);
+          }
+          break;
+        case NFQA_PAYLOAD:
+          packet.payload = value;
+          packet.len = valuelen;
+          break;
+      }
+      a += NLA_ALIGN(attr->nla_len);
+    }
+
+    // Without an id there's no giving it a verdict, so it isn't a packet
+    // we can do anything with
+    if(gotid) n++;
+  }
+  return n;
+}
+
+l7_nfq_verdicts::l7_nfq_verdicts(int fd, int max)
+{
+  this->fd = fd;
+  this->max = max;
+  n = 0;
+  buf = (char *)calloc(max, sizeof(l7_nfq_verdict_msg));
+  if(!buf){
+    cerr << "Out of memory for verdicts\n";
+    exit(1);
+  }
+
+  for(int i = 0; i < max; i++){
+    l7_nfq_verdict_msg *msg = (l7_nfq_verdict_msg *)buf + i;
+    msg->nlh.nlmsg_len = sizeof(*msg);
+    msg->nlh.nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_VERDICT;
+    msg->nlh.nlmsg_flags = NLM_F_REQUEST;
+    msg->nfg.nfgen_family = AF_UNSPEC;
+    msg->nfg.version = NFNETLINK_V0;
+    msg->verdictattr.nla_len = NLA_HDRLEN + sizeof(msg->verdict);
+    msg->verdictattr.nla_type = NFQA_VERDICT_HDR;
+    msg->verdict.verdict = htonl(NF_ACCEPT);
+    msg->markattr.nla_len = NLA_HDRLEN + sizeof(msg->mark);
+    msg->markattr.nla_type = NFQA_MARK;
+  }
+}
+
+l7_nfq_verdicts::~l7_nfq_verdicts()
+{
+  free(buf);
+}
+
+bool l7_nfq_verdicts::add(u_int16_t queuenum, u_int32_t id,
+                          u_int32_t wholemark)
+{
+  bool sent = n < max || flush();
+  l7_nfq_verdict_msg *msg = (l7_nfq_verdict_msg *)buf + n++;
+  msg->nfg.res_id = htons(queuenum);
+  msg->verdict.id = htonl(id);
+  msg->mark = htonl(wholemark);
+  return sent;
+}
+
+// The kernel goes through every message in what it is sent, so a batch of
+// verdicts is one system call.
+bool l7_nfq_verdicts::flush()
+{
+  if(n == 0) return true;
+
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+
+  int len = get_length();
+  n = 0;
+  ssize_t rc;
+  do rc = sendto(fd, buf, len, 0, (struct sockaddr *)&kernel, sizeof(kernel));
+  while(rc < 0 && errno == EINTR);
+  return rc == len;
+}
+
+const char *l7_nfq_verdicts::get_buffer() const
+{
+  return buf;
+}
+
+int l7_nfq_verdicts::get_length() const
+{
+  return n*sizeof(l7_nfq_verdict_msg);
+}
@@ -0,0 +1,71 @@
+/*
+  Reading packets from nfnetlink_queue and giving their verdicts without
+  going through libnetfilter_queue for each one.  The library still sets
+  the queues up, but then every packet costs a callback, a parse of each
+  attribute asked for, and a verdict message built and sent on its own.
+  Here, what we read is only walked through once, picking out the packet
+  id, the mark and the payload where they lie, and verdicts are copied into
+  messages laid out in advance and sent a batch at a time.
+
+  l7_nfq_parse() only looks at the bytes it is given, so it works the same
+  on messages saved from a socket as on ones just read.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_NFQUEUE_H
+#define L7_NFQUEUE_H
+
+#include <sys/types.h>
+
+using namespace std;
+
+// A packet from an NFQNL_MSG_PACKET message.  payload points into the
+// buffer the message is in.
+struct l7_nfq_packet {
+  u_int16_t queuenum;
+  u_int32_t id;
+  u_int32_t mark;          // the whole mark, in host order
+  unsigned char *payload;  // from the IP header on, or NULL if none came
+  int len;
+};
+
+// Finds the packets in len bytes read from an nfnetlink_queue socket and
+// puts up to max of them in packets.  used is set to how many bytes were
+// gone through, which is less than len if there were more packets than
+// room for them, and nerrors to the number of error messages (for
+// verdicts that the kernel didn't take) among them.  Returns the number of
+// packets, or -1 if the messages aren't well formed.
+int l7_nfq_parse(unsigned char *buf, int len, l7_nfq_packet *packets,
+                 int max, int & used, int & nerrors);
+
+// Verdicts waiting to be sent to the kernel together
+class l7_nfq_verdicts {
+ private:
+  int fd;
+  char *buf;    // room for max verdict messages, already filled in but for
+                // the queue, id and mark
+  int max;
+  int n;
+
+ public:
+  l7_nfq_verdicts(int fd, int max);
+  ~l7_nfq_verdicts();
+  // Lets packet id on queue queuenum go with the given whole mark.  If
+  // there's no more room, sends the ones before it first, and returns
+  // false if the kernel couldn't take those.
+  bool add(u_int16_t queuenum, u_int32_t id, u_int32_t wholemark);
+  // Sends the ones added so far.  Returns false if the kernel couldn't
+  // take them.
+  bool flush();
+  const char *get_buffer() const;
+  int get_length() const;
+};
+
+#endif
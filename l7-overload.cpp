@@ -0,0 +1,176 @@
+/*
+  Overload control.  See l7-overload.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <stdio.h>
+
+#include "l7-overload.h"
+#include "l7-probes.h"
+#include "util.h"
+
+volatile int l7_load_level = L7_LOAD_NORMAL;
+l7_overload *overload_control = NULL;
+
+// Too busy: the queue thread spent this much of the interval working, or
+// more than this many percent of batches left packets waiting and it was
+// at least half busy.
+#define L7_OVERLOAD_BUSY 90
+#define L7_OVERLOAD_FULL 50
+
+// Or this many packets are waiting in the kernel's queue, which by default
+// holds 1024
+#define L7_OVERLOAD_BACKLOG 512
+
+// Calm: less busy than this and hardly any packets left waiting
+#define L7_OVERLOAD_CALM_BUSY 50
+#define L7_OVERLOAD_CALM_FULL 10
+#define L7_OVERLOAD_CALM_BACKLOG 64
+
+// How many intervals in a row it takes to go a level down or back up.
+// Falling behind (dropping packets) goes down at once.  Coming back is slow,
+// so that we don't flap.
+#define L7_OVERLOAD_HOT 3
+#define L7_OVERLOAD_CALM 50
+
+static const char *level_names[] = { "normal", "shallow", "essential",
+                                     "nonew" };
+
+const char *l7_load_name(int level)
+{
+  return level_names[level];
+}
+
+l7_overload::l7_overload(int maxlevel) :
+  nlevel("overload.level"), ntransitions("overload.transitions"),
+  nbusy("overload.busypercent"), nfullbatches("overload.fullbatchpercent"),
+  npacketns("overload.packetns")
+{
+  this->maxlevel = maxlevel;
+  intervalstart = l7_now_ns();
+  busyns = 0;
+  npackets = nbatches = nfull = 0;
+  lasttrouble = 0;
+  backlog = NULL;
+  refresh = NULL;
+  refreshdata = NULL;
+  hot = calm = 0;
+}
+
+// Adds a counter that goes up when we fall behind, such as packets that
+// the kernel dropped.
+void l7_overload::watch(const l7_counter & counter)
+{
+  trouble.push_back(&counter);
+  lasttrouble = trouble_now();
+}
+
+// Adds the number of packets waiting to be read, which counts against us
+// when it is high rather than when it goes up
+void l7_overload::watch_backlog(const l7_counter & counter)
+{
+  backlog = &counter;
+}
+
+// Sets something to call before each look at the load, for counters that
+// are otherwise only brought up to date for the statistics
+void l7_overload::set_refresh(l7_stats_hook hook, void *data)
+{
+  refresh = hook;
+  refreshdata = data;
+  if(refresh) refresh(refreshdata);
+  lasttrouble = trouble_now();
+}
+
+unsigned long l7_overload::trouble_now()
+{
+  unsigned long sum = 0;
+  for(unsigned int i = 0; i < trouble.size(); i++)
+    sum += trouble[i]->get();
+  return sum;
+}
+
+// Called by the queue thread after each batch it reads.  full says whether
+// it stopped because the batch was full, rather than because there was
+// nothing more to read.
+void l7_overload::batch_done(unsigned long startns, unsigned long endns,
+                             unsigned int npackets, bool full)
+{
+  busyns += endns - startns;
+  this->npackets += npackets;
+  nbatches++;
+  if(full) nfull++;
+}
+
+// Called by the queue thread at least every L7_OVERLOAD_INTERVAL ms
+void l7_overload::tick()
+{
+  unsigned long now = l7_now_ns();
+  if(now - intervalstart >= L7_OVERLOAD_INTERVAL*1000000UL){
+    if(refresh) refresh(refreshdata);
+    evaluate(now);
+  }
+}
+
+void l7_overload::evaluate(unsigned long now)
+{
+  unsigned int busy = busyns*100/(now - intervalstart);
+  unsigned int fullpercent = nbatches ? nfull*100/nbatches : 0;
+  unsigned long troublenow = trouble_now();
+  bool behind = troublenow != lasttrouble;
+  unsigned long waiting = backlog ? backlog->get() : 0;
+
+  nbusy.set(busy);
+  nfullbatches.set(fullpercent);
+  if(npackets) npacketns.set(busyns/npackets);
+
+  char why[128];
+  snprintf(why, sizeof(why), "busy %u%%, %u%% of batches full, %lu "
+           "waiting%s", busy, fullpercent, waiting,
+           behind ? ", packets lost" : "");
+
+  if(behind || busy >= L7_OVERLOAD_BUSY || waiting >= L7_OVERLOAD_BACKLOG ||
+     (fullpercent >= L7_OVERLOAD_FULL && busy >= L7_OVERLOAD_CALM_BUSY)){
+    calm = 0;
+    if((behind || ++hot >= L7_OVERLOAD_HOT) && l7_load_level < maxlevel){
+      set_level(l7_load_level + 1, why);
+      hot = 0;
+    }
+  }
+  else if(busy < L7_OVERLOAD_CALM_BUSY &&
+          fullpercent < L7_OVERLOAD_CALM_FULL &&
+          waiting < L7_OVERLOAD_CALM_BACKLOG){
+    hot = 0;
+    if(++calm >= L7_OVERLOAD_CALM && l7_load_level > L7_LOAD_NORMAL){
+      set_level(l7_load_level - 1, why);
+      calm = 0;
+    }
+  }
+  else
+    hot = calm = 0;
+
+  intervalstart = now;
+  busyns = 0;
+  npackets = nbatches = nfull = 0;
+  lasttrouble = troublenow;
+}
+
+void l7_overload::set_level(int level, const char *why)
+{
+  L7_PROBE2(overload, l7_load_level, level);
+  l7printf(0, "%s: load level %s (was %s, %s)\n",
+           level > l7_load_level ? "Overloaded" : "Load easing",
+           l7_load_name(level), l7_load_name(l7_load_level), why);
+  l7_load_level = level;
+  nlevel.set(level);
+  ntransitions.add();
+}
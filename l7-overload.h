@@ -0,0 +1,85 @@
+/*
+  Overload control.  When packets come faster than the queue thread can
+  inspect them, the queue backs up and the kernel starts letting them
+  through unmarked (or dropping them, if it can't fail open), and doing the
+  usual amount of work on each packet only makes that worse.  So we watch how
+  busy the queue thread is, how often there are more packets waiting when
+  it finishes a batch, how many the kernel has queued for us, and whether
+  anything has been dropped, and step down to doing less:
+
+    L7_LOAD_SHALLOW    look at fewer packets of each connection
+    L7_LOAD_ESSENTIAL  and also skip patterns marked "userspace priority=low"
+    L7_LOAD_NONEW      and also stop inspecting connections we haven't
+                       started on, which are given up on (NO_MATCH)
+
+  one level at a time, and back up again once things have been calm for a
+  while.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_OVERLOAD_H
+#define L7_OVERLOAD_H
+
+#include <vector>
+#include "l7-stats.h"
+
+using namespace std;
+
+enum { L7_LOAD_NORMAL, L7_LOAD_SHALLOW, L7_LOAD_ESSENTIAL, L7_LOAD_NONEW };
+
+// How often the load is looked at, in milliseconds
+#define L7_OVERLOAD_INTERVAL 100
+
+// What the packet path goes by.  Only the queue thread changes it, and
+// anyone may read it without locking: acting on the old level for a packet
+// or two doesn't matter.
+extern volatile int l7_load_level;
+
+class l7_overload {
+ private:
+  int maxlevel;
+  unsigned long intervalstart;  // ns
+  unsigned long busyns;         // spent on batches since then
+  unsigned int npackets;
+  unsigned int nbatches;
+  unsigned int nfull;           // batches after which more were waiting
+  vector<const l7_counter *> trouble; // counts of ways we fall behind
+  unsigned long lasttrouble;    // their sum at the start of the interval
+  const l7_counter *backlog;    // packets waiting for us, or NULL
+  l7_stats_hook refresh;        // brings the counters up to date
+  void *refreshdata;
+  int hot;                      // intervals in a row that were too busy
+  int calm;                     // and that weren't busy at all
+
+  unsigned long trouble_now();
+  void evaluate(unsigned long now);
+  void set_level(int level, const char *why);
+
+ public:
+  l7_counter nlevel;
+  l7_counter ntransitions;
+  l7_counter nbusy;
+  l7_counter nfullbatches;
+  l7_counter npacketns;
+
+  l7_overload(int maxlevel);
+  void watch(const l7_counter & counter);
+  void watch_backlog(const l7_counter & counter);
+  void set_refresh(l7_stats_hook hook, void *data);
+  void batch_done(unsigned long startns, unsigned long endns,
+                  unsigned int npackets, bool full);
+  void tick();
+};
+
+extern l7_overload *overload_control; // NULL unless --overload-control
+
+const char *l7_load_name(int level);
+
+#endif
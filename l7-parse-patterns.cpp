@@ -21,6 +21,7 @@ using namespace std;
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <stdlib.h>
 #include "l7-parse-patterns.h"
 
 // Returns true if the line (from a pattern file) is a comment
@@ -103,10 +104,33 @@ static int parseflags(int & cflags, int & eflags, string line)
   return 1;
 }
 
+// Parses a positive number for the attribute in line.
+// Returns 1 on sucess, 0 if it isn't one.
+static int parsenumber(int & number, string line)
+{
+  char *end;
+  string v = value(line);
+  number = strtol(v.c_str(), &end, 10);
+  if(v.size() == 0 || *end != '\0' || number < 1){
+    cerr << "Error: \"" << attribute(line) << "\" needs a positive number, "
+         << "not \"" << v << "\"\n";
+    return 0;
+  }
+  return 1;
+}
+
 // Returns 1 on sucess, 0 on failure.
 // Takes a filename and "returns" the pattern and flags
 int parse_pattern_file(int & cflags, int & eflags, string & pattern,
         string filename)
+{
+  pattern_attributes attributes;
+  return parse_pattern_file(cflags, eflags, pattern, attributes, filename);
+}
+
+// As above, but also "returns" the optional attributes
+int parse_pattern_file(int & cflags, int & eflags, string & pattern,
+        pattern_attributes & attributes, string filename)
 {
   ifstream the_file(filename.c_str());
 
@@ -116,13 +140,17 @@ int parse_pattern_file(int & cflags, int & eflags, string & pattern,
   }
 
   // What we're looking for. It's either the protocol name, the kernel pattern,
-  // which we'll use if no other is present, or any of various (ok, two)
-  // userspace config lines.
+  // which we'll use if no other is present, or any of various userspace 
+  // config lines.
   enum { protocol, kpattern, userspace } state = protocol;
 
   string name = "", line;
   cflags = REG_EXTENDED | REG_ICASE | REG_NOSUB;
   eflags = 0;
+  attributes.maxpackets = 0;
+  attributes.maxbytes = 0;
+  attributes.lowpriority = false;
+  attributes.highentropy = false;
 
   while (!the_file.eof()){
     getline(the_file, line);
@@ -162,6 +190,32 @@ int parse_pattern_file(int & cflags, int & eflags, string & pattern,
         if(!parseflags(cflags, eflags, value(line)))
           return 0;
       }
+      else if(attribute(line) == "userspace maxpackets"){
+        if(!parsenumber(attributes.maxpackets, line))
+          return 0;
+      }
+      else if(attribute(line) == "userspace maxbytes"){
+        if(!parsenumber(attributes.maxbytes, line))
+          return 0;
+      }
+      else if(attribute(line) == "userspace priority"){
+        if(value(line) == "low") attributes.lowpriority = true;
+        else if(value(line) == "normal") attributes.lowpriority = false;
+        else{
+          cerr << "Error: \"userspace priority\" must be \"low\" or "
+               << "\"normal\", not \"" << value(line) << "\"\n";
+          return 0;
+        }
+      }
+      else if(attribute(line) == "userspace entropy"){
+        if(value(line) == "high") attributes.highentropy = true;
+        else if(value(line) == "normal") attributes.highentropy = false;
+        else{
+          cerr << "Error: \"userspace entropy\" must be \"high\" or "
+               << "\"normal\", not \"" << value(line) << "\"\n";
+          return 0;
+        }
+      }
       else
         cerr << "Warning: ignored unknown pattern file attribute \""
           << attribute(line) << "\"\n";
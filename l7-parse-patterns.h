@@ -20,8 +20,20 @@
 using namespace std;
 #include <regex.h>
 
+// Optional "userspace ..." settings from a pattern file.  Zero means the 
+// file didn't give the setting.
+struct pattern_attributes {
+  int maxpackets; // only look at connections this many packets in
+  int maxbytes;   // only look at this much of each connection's data
+  bool lowpriority; // skip it first when overloaded (see l7-overload.h)
+  bool highentropy; // matches data that looks encrypted or compressed, so
+                    // --entropy-giveup mustn't give up on it
+};
+
 int parse_pattern_file(int & cflags, int & eflags, string & pattern,
         string filename);
+int parse_pattern_file(int & cflags, int & eflags, string & pattern,
+        pattern_attributes & attributes, string filename);
 string basename(string filename);
 
 #endif          
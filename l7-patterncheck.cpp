@@ -0,0 +1,524 @@
+/*
+  Looks at the patterns a configuration file would load and says how
+  expensive each is likely to be, so that slow ones can be fixed before
+  l7-filter runs into them on real traffic.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <regex.h>
+#include <cstring>
+
+#include "l7-classify.h"
+#include "l7-nfa.h"
+#include "util.h"
+
+// l7-classify.cpp wants these, which l7-filter gets from its command line
+extern int verbosity;
+extern string l7dir;
+extern int pattern_engine;
+unsigned int buflen = 8*1500;
+int maxpackets = 10;
+
+// What can be told about a pattern from reading it
+struct l7_analysis {
+  vector<string> literals;  // the longest literal each branch must contain
+  bool anchored;            // every branch starts with '^'
+  unsigned int states;      // about how many the NFA would need
+  bool nested;              // an unbounded repeat of something unbounded
+  int wildcards;            // most unbounded repeats of . or [^...] in a branch
+  int biggest_repeat;       // largest bound in a {n,m}
+  bool backrefs;
+};
+
+// One level of parentheses while reading a pattern
+struct l7_group {
+  unsigned int states;
+  bool unbounded;           // has an unbounded repeat inside
+};
+
+static void end_literal(string & run, string & best)
+{
+  if(run.size() > best.size()) best = run;
+  run = "";
+}
+
+// Reads a pattern (with \x escapes already turned into bytes) much as
+// regcomp() would, but only to find out the things in l7_analysis.
+static l7_analysis analyze(const string & re, bool icase)
+{
+  l7_analysis a;
+  a.anchored = true;
+  a.states = 0;
+  a.nested = false;
+  a.wildcards = 0;
+  a.biggest_repeat = 0;
+  a.backrefs = false;
+
+  vector<l7_group> groups;
+  l7_group top = { 0, false };
+  groups.push_back(top);
+
+  string run, best;
+  int wildcards = 0;
+  bool branchstart = true;
+  unsigned int i = 0;
+
+  while(i <= re.size()){
+    if(i == re.size() || (re[i] == '|' && groups.size() == 1)){
+      // The end of a top level branch
+      end_literal(run, best);
+      a.literals.push_back(best);
+      best = "";
+      if(wildcards > a.wildcards) a.wildcards = wildcards;
+      wildcards = 0;
+      if(branchstart) a.anchored = false; // an empty branch matches anywhere
+      i++;
+      branchstart = true;
+      continue;
+    }
+
+    if(branchstart && re[i] != '^') a.anchored = false;
+    branchstart = false;
+
+    // Read one atom
+    unsigned int states = 1;
+    bool literal = false, wide = false, unbounded = false, group = false;
+    char c = re[i];
+    switch(c){
+      case '|':
+        i++;
+        continue;
+      case '(': {
+        l7_group g = { 0, false };
+        groups.push_back(g);
+        end_literal(run, best);
+        i++;
+        continue;
+      }
+      case ')':
+        if(groups.size() == 1){
+          literal = true; // regcomp() takes it as a character
+          i++;
+          break;
+        }
+        states = groups.back().states;
+        unbounded = groups.back().unbounded;
+        groups.pop_back();
+        group = true;
+        i++;
+        break;
+      case '^':
+      case '$':
+        states = 0;
+        i++;
+        break;
+      case '.':
+        wide = true;
+        i++;
+        break;
+      case '[':
+        i++;
+        if(re[i] == '^'){
+          wide = true;
+          i++;
+        }
+        if(re[i] == ']') i++;
+        while(i < re.size() && re[i] != ']'){
+          if(re[i] == '[' && i+1 < re.size() && strchr(":.=", re[i+1])){
+            size_t close = re.find(string(1, re[i+1]) + "]", i+2);
+            if(close != string::npos) i = close + 1;
+          }
+          i++;
+        }
+        i++;
+        break;
+      case '\\':
+        i++;
+        c = i < re.size() ? re[i] : '\\';
+        if(isdigit(c)) a.backrefs = true;
+        else if(strchr("wWsSbB<>`'", c)){
+          if(c == 'W' || c == 'S') wide = true;
+          if(strchr("bB<>`'", c)) states = 0;
+        }
+        else literal = true;
+        i++;
+        break;
+      default:
+        literal = true;
+        i++;
+    }
+
+    // And what repeats it
+    unsigned int least = 1, most = 1;
+    bool repeated = false;
+    while(i < re.size() && strchr("*+?{", re[i])){
+      repeated = true;
+      if(re[i] == '{'){
+        size_t close = re.find('}', i);
+        if(close == string::npos) break;
+        string bounds = re.substr(i+1, close-i-1);
+        size_t comma = bounds.find(',');
+        unsigned int n = atoi(bounds.c_str());
+        unsigned int m = comma == string::npos ? n :
+          (comma+1 == bounds.size() ? 0 : atoi(bounds.c_str() + comma + 1));
+        if((int)n > a.biggest_repeat) a.biggest_repeat = n;
+        if((int)m > a.biggest_repeat) a.biggest_repeat = m;
+        least *= n;
+        if(comma != string::npos && comma+1 == bounds.size()){
+          if(unbounded && group) a.nested = true;
+          most = n ? n : 1;
+          unbounded = true;
+          if(wide) wildcards++;
+        }
+        else most *= m;
+        i = close + 1;
+      }
+      else{
+        if(re[i] != '+') least = 0;
+        if(re[i] != '?'){
+          if(unbounded && group) a.nested = true;
+          unbounded = true;
+          if(wide) wildcards++;
+        }
+        i++;
+      }
+    }
+    groups.back().states += states * most;
+    if(unbounded) groups.back().unbounded = true;
+
+    // Literals only count at the top, and only if they are always there
+    if(groups.size() == 1 && literal && (!repeated || least > 0)){
+      run += icase ? tolower(c) : c;
+      if(repeated) end_literal(run, best);
+    }
+    else if(!(states == 0 && !group))
+      end_literal(run, best);
+  }
+
+  a.states = groups[0].states;
+  return a;
+}
+
+static string printable(const string & s)
+{
+  string out;
+  char hex[8];
+  for(unsigned int i = 0; i < s.size(); i++){
+    unsigned char c = s[i];
+    if(isprint(c) && c < 128 && c != '\\' && c != '"') out += c;
+    else{
+      snprintf(hex, sizeof(hex), "\\x%02x", c);
+      out += hex;
+    }
+  }
+  return "\"" + out + "\"";
+}
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+// Returns how fast the pattern gets through the data, in MB/s, trying for
+// about the given number of milliseconds, or 0 if it matches all of it.
+// Only the buffers it doesn't match are timed, since a match stops
+// somewhere we can't see and we'd be counting bytes it never looked at.
+// Those are also the ones that l7-filter keeps trying it on.  nmatched is
+// set to the number left out.
+static double measure(l7_pattern *p, const vector<string> & data,
+                      unsigned int ms, unsigned int & nmatched)
+{
+  vector<const string *> misses;
+  for(unsigned int i = 0; i < data.size(); i++)
+    if(!p->matches((char *)data[i].c_str(), data[i].size()))
+      misses.push_back(&data[i]);
+  nmatched = data.size() - misses.size();
+  if(misses.empty()) return 0;
+
+  double start = now(), elapsed = 0;
+  unsigned long bytes = 0;
+  do{
+    for(unsigned int i = 0; i < misses.size(); i++){
+      unsigned int len = misses[i]->size();
+      p->matches((char *)misses[i]->c_str(), len);
+      bytes += len < p->get_window_bytes() ? len : p->get_window_bytes();
+    }
+    elapsed = now() - start;
+  } while(elapsed*1000 < ms);
+
+  return bytes/elapsed/1e6;
+}
+
+// Makes n buffers of len bytes, each drawn from the given bytes.  Like
+// what l7-filter looks at, they have no nulls in them.
+static vector<string> make_data(const string & from, unsigned int n,
+                                unsigned int len)
+{
+  vector<string> data;
+  for(unsigned int i = 0; i < n; i++){
+    string s(len, ' ');
+    for(unsigned int j = 0; j < len; j++)
+      s[j] = from[random() % from.size()];
+    data.push_back(s);
+  }
+  return data;
+}
+
+// The bytes that appear in a pattern, in both cases if it ignores case.
+// Data made of these keeps a pattern busy with partial matches.
+static string pattern_bytes(const string & re, bool icase)
+{
+  string bytes;
+  bool seen[256] = { false };
+  for(unsigned int i = 0; i < re.size(); i++){
+    unsigned char c = re[i];
+    if(c == '\0' || strchr("()|*+?{}[]^$\\.", c)) continue;
+    seen[c] = true;
+    if(icase) seen[toupper(c)] = seen[tolower(c)] = true;
+  }
+  for(int c = 1; c < 256; c++)
+    if(seen[c]) bytes += (char)c;
+  return bytes.empty() ? "a" : bytes;
+}
+
+static string read_corpus_file(const char *filename)
+{
+  ifstream in(filename, ios::in | ios::binary);
+  if(!in.is_open()){
+    cerr << "Couldn't read " << filename << endl;
+    exit(1);
+  }
+  stringstream ss;
+  ss << in.rdbuf();
+  string raw = ss.str(), data;
+
+  // l7-filter throws away nulls and keeps at most -b bytes
+  for(unsigned int i = 0; i < raw.size() && data.size() < buflen; i++)
+    if(raw[i] != '\0') data += raw[i];
+  return data;
+}
+
+static void usage()
+{
+  cerr << "Syntax: l7-patterncheck -f configuration_file [options] "
+          "[corpus files]\n"
+          "\n"
+          "Options are:\n"
+          "-p path\tLook for patterns in path instead of /etc/l7-protocols\n"
+          "-b bytes\tAssume l7-filter -b bytes\n"
+          "-e engine\tAssume l7-filter --engine engine\n"
+          "-t ms\tTime each pattern on each kind of data for ms milliseconds\n"
+          "-m MB/s\tWarn about patterns slower than this\n"
+          "-v\tSay more about what is going on\n";
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  string conffilename;
+  unsigned int ms = 100;
+  double slow = 10;
+  int c;
+
+  verbosity = -1;
+  while((c = getopt(argc, argv, "f:p:b:e:t:m:vh")) != -1){
+    switch(c){
+      case 'f':
+        conffilename = optarg;
+        break;
+      case 'p':
+        l7dir = optarg;
+        break;
+      case 'b':
+        buflen = strtol(optarg, 0, 10);
+        if(buflen < 1){
+          cerr << "-b needs a number of bytes.\n";
+          exit(1);
+        }
+        break;
+      case 'e':
+        if(string(optarg) == "auto") pattern_engine = L7_ENGINE_AUTO;
+        else if(string(optarg) == "regex") pattern_engine = L7_ENGINE_REGEX;
+        else if(string(optarg) == "nfa") pattern_engine = L7_ENGINE_NFA;
+        else{
+          cerr << "-e must be 'auto', 'regex' or 'nfa'.\n";
+          exit(1);
+        }
+        break;
+      case 't':
+        ms = strtol(optarg, 0, 10);
+        break;
+      case 'm':
+        slow = strtod(optarg, 0);
+        break;
+      case 'v':
+        verbosity++;
+        break;
+      default:
+        usage();
+    }
+  }
+  if(conffilename == "") usage();
+
+  vector<string> corpus;
+  for(int i = optind; i < argc; i++)
+    corpus.push_back(read_corpus_file(argv[i]));
+
+  l7_classify classifier(conffilename);
+  const list<l7_pattern *> & patterns = classifier.get_patterns();
+
+  string text;
+  for(int ch = ' '; ch < 127; ch++) text += (char)ch;
+  text += "\r\n";
+  string anybyte;
+  for(int ch = 1; ch < 256; ch++) anybyte += (char)ch;
+
+  int nwarnings = 0;
+  double total_ns = 0;
+  list<l7_pattern *>::const_iterator p = patterns.begin();
+  for(; p != patterns.end(); p++){
+    l7_pattern *pat = *p;
+    bool icase = pat->get_cflags() & REG_ICASE;
+    l7_analysis a = analyze(pat->get_regex(), icase);
+    const l7_nfa *nfa = pat->get_nfa();
+    vector<string> warnings;
+
+    printf("%s (mark %d)\n", pat->getName().c_str(), pat->getMark());
+
+    if(nfa){
+      printf("  engine: nfa, %u states, %lu bytes of tables\n",
+             nfa->get_positions(), (unsigned long)nfa->get_size());
+      a.anchored = nfa->is_anchored();
+    }
+    else
+      printf("  engine: regex (%s), about %u states\n",
+             pat->get_engine_note().c_str(), a.states);
+    printf("  compiled in: %lu usec\n", pat->get_compile_usec());
+    printf("  window: %u packets, %u bytes\n", pat->get_window_packets(),
+           pat->get_window_bytes());
+    if(pat->is_low_priority())
+      printf("  priority: low, skipped when overloaded\n");
+    if(pat->is_high_entropy())
+      printf("  entropy: high, matches encrypted or compressed data\n");
+    printf("  anchored: %s\n", a.anchored ? "yes" : "no");
+
+    printf("  literals:");
+    bool everybranch = true;
+    for(unsigned int i = 0; i < a.literals.size(); i++){
+      if(a.literals[i].size() < 2) everybranch = false;
+      printf(" %s%s", i ? "| " : "", a.literals[i].size() ?
+             printable(a.literals[i]).c_str() : "(none)");
+    }
+    printf("%s\n", everybranch ? "" : "  (not every branch has one)");
+
+    if(nfa)
+      printf("  worst case per byte: %u follow table lookups\n",
+             (nfa->get_positions() + 3)/4);
+    else if(a.backrefs)
+      printf("  worst case per byte: unbounded (back-references)\n");
+    else
+      printf("  worst case per byte: about %u states\n", a.states);
+
+    // Static warning signs.  The NFA doesn't backtrack, so only regexec()
+    // has to worry about these.
+    if(!nfa){
+      if(a.backrefs)
+        warnings.push_back("uses back-references, which can take "
+                           "exponential time");
+      if(a.nested)
+        warnings.push_back("repeats something that itself repeats without "
+                           "limit, which regexec() can take a very long "
+                           "time over");
+      if(a.wildcards >= 2 && !a.anchored)
+        warnings.push_back("has several unlimited wildcards in one "
+                           "unanchored branch, so time can grow with the "
+                           "square of the data");
+      if(a.states > L7_NFA_MAX_POSITIONS)
+        warnings.push_back("is too big for the NFA engine");
+    }
+    if(a.biggest_repeat > 100)
+      warnings.push_back("has a repetition bound over 100");
+
+    // Measured speed
+    unsigned int window = pat->get_window_bytes();
+    const char *names[] = { "random", "text", "pattern bytes", "corpus" };
+    vector<string> data[4];
+    data[0] = make_data(anybyte, 16, window);
+    data[1] = make_data(text, 16, window);
+    data[2] = make_data(pattern_bytes(pat->get_regex(), icase), 16, window);
+    data[3] = corpus;
+
+    double worst = 0;
+    const char *worstname = "";
+    printf("  speed (MB/s, on data it doesn't match):");
+    for(int i = 0; i < 4; i++){
+      if(data[i].empty()) continue;
+      unsigned int nmatched;
+      double speed = measure(pat, data[i], ms, nmatched);
+      if(speed == 0){
+        printf("%s %s - (matches all %u)", i ? "," : "", names[i],
+               (unsigned int)data[i].size());
+        continue;
+      }
+      printf("%s %s %.1f", i ? "," : "", names[i], speed);
+      if(nmatched)
+        printf(" (%u of %u matched, not timed)", nmatched,
+               (unsigned int)data[i].size());
+      if(worst == 0 || speed < worst){
+        worst = speed;
+        worstname = names[i];
+      }
+    }
+    printf("\n");
+    if(worst > 0) total_ns += 1000/worst;
+
+    if(!corpus.empty()){
+      int nmatched = 0;
+      for(unsigned int i = 0; i < corpus.size(); i++)
+        if(pat->matches((char *)corpus[i].c_str(), corpus[i].size()))
+          nmatched++;
+      printf("  matches %d of %u corpus files\n", nmatched,
+             (unsigned int)corpus.size());
+    }
+
+    if(worst > 0 && worst < slow){
+      char why[128];
+      snprintf(why, sizeof(why), "only manages %.1f MB/s on %s data", worst,
+               worstname);
+      warnings.push_back(why);
+    }
+
+    for(unsigned int i = 0; i < warnings.size(); i++)
+      printf("  WARNING: %s %s\n", pat->getName().c_str(),
+             warnings[i].c_str());
+    nwarnings += warnings.size();
+    printf("\n");
+  }
+
+  printf("%u patterns, %d warnings.  Trying every pattern on a byte takes "
+         "up to %.1f ns (%.1f MB/s).\n", (unsigned int)patterns.size(),
+         nwarnings, total_ns, total_ns ? 1000/total_ns : 0);
+  return nwarnings ? 2 : 0;
+}
@@ -0,0 +1,252 @@
+/*
+  The l7-pipeline class runs classification in a pool of worker threads so
+  that the queue thread only has to read packets and send verdicts.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+#include <pthread.h>
+
+#include <iostream>
+#include <sstream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <cstring>
+
+#include "l7-pipeline.h"
+#include "l7-queue.h"
+#include "util.h"
+
+extern unsigned int maskfirstbit;
+
+static string worker_stat_name(int number, const char * what)
+{
+  stringstream name;
+  name << "pipeline.worker" << number << "." << what;
+  return name.str();
+}
+
+l7_worker::l7_worker(l7_pipeline *pipeline, unsigned int depth, int number) :
+  jobs(depth), verdicts(depth),
+  njobs(worker_stat_name(number, "jobs")),
+  maxdepth(worker_stat_name(number, "maxdepth"))
+{
+  this->pipeline = pipeline;
+  sleeping = 0;
+  sem_init(&wakeup, 0, 0);
+}
+
+l7_worker::~l7_worker()
+{
+  sem_destroy(&wakeup);
+}
+
+void * l7_worker::start_thread(void *worker)
+{
+  ((l7_worker *)worker)->run();
+  pthread_exit(NULL);
+}
+
+// Sleeps until the queue thread gives us something to do.
+void l7_worker::wait_for_job(l7_pipeline_job & job)
+{
+  while(!jobs.pop(job)){
+    // Say we're going to sleep, then look again, so that a job pushed
+    // between the pop above and the sem_wait below still wakes us.
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if(jobs.pop(job)){
+      __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+      return;
+    }
+    while(sem_wait(&wakeup) != 0 && errno == EINTR);
+  }
+}
+
+void l7_worker::run()
+{
+  l7_pipeline_job job;
+
+  while(true){
+    wait_for_job(job);
+    njobs.add();
+
+    // A job with no data is a packet that only came to us to keep its
+    // place in line behind the connection's other packets.
+    u_int32_t mark = NO_MATCH_YET;
+    if(job.datalen > 0)
+      mark = job.connection->inspect(job.data, job.datalen, job.packetnum,
+                                     job.segment);
+    free(job.data);
+
+    if(pipeline->async){
+      l7printf(3, "Classified packet #%d in the background, mark %d\n",
+               job.packetnum, mark);
+      free(job.packet);
+      job.connection->release();
+      continue;
+    }
+
+    l7_pipeline_verdict verdict;
+    verdict.connection = job.connection;
+    verdict.id = job.id;
+    verdict.mark = (mark<<maskfirstbit)|job.wholemark;
+    verdict.packet = job.packet;
+    verdict.packetlen = job.packetlen;
+
+    // The queue thread empties this ring whenever it waits on us, so this
+    // can't go on for long.
+    while(!verdicts.push(verdict))
+      sched_yield();
+    pipeline->notify();
+  }
+}
+
+l7_pipeline::l7_pipeline(int nworkers, unsigned int depth, bool async) :
+  ndropped("pipeline.dropped"), nfullwaits("pipeline.fullwaits"),
+  nverdicts("pipeline.verdicts")
+{
+  this->async = async;
+  handler = NULL;
+  handlerdata = NULL;
+  notified = 0;
+  next = 0;
+
+  notifyfd = eventfd(0, EFD_NONBLOCK);
+  if(notifyfd < 0){
+    perror("eventfd");
+    exit(1);
+  }
+
+  for(int i = 0; i < nworkers; i++)
+    workers.push_back(new l7_worker(this, depth, i));
+}
+
+l7_pipeline::~l7_pipeline()
+{
+  for(unsigned int i = 0; i < workers.size(); i++)
+    delete workers[i];
+  close(notifyfd);
+}
+
+void l7_pipeline::start()
+{
+  for(unsigned int i = 0; i < workers.size(); i++){
+    int rc = pthread_create(&workers[i]->thread, NULL,
+                            l7_worker::start_thread, workers[i]);
+    if(rc){
+      cerr << "Error creating classification thread. pthread_create "
+              "returned " << rc << endl;
+      exit(1);
+    }
+  }
+}
+
+void l7_pipeline::set_verdict_handler(l7_verdict_handler handler, void *data)
+{
+  this->handler = handler;
+  handlerdata = data;
+}
+
+// Called by the workers.  Only writes to the eventfd if the queue thread
+// hasn't already been told, so a burst of verdicts costs one system call.
+void l7_pipeline::notify()
+{
+  if(!__atomic_exchange_n(&notified, 1, __ATOMIC_SEQ_CST)){
+    u_int64_t one = 1;
+    if(write(notifyfd, &one, sizeof(one)) != sizeof(one))
+      perror("eventfd write");
+  }
+}
+
+// Called from the queue thread.  Passes every verdict that the workers have
+// finished to the verdict handler.
+void l7_pipeline::handle_verdicts()
+{
+  u_int64_t junk;
+
+  // Clear the notification before looking, so that a verdict that arrives
+  // after we've looked at its worker makes the fd readable again.
+  __atomic_store_n(&notified, 0, __ATOMIC_SEQ_CST);
+  if(read(notifyfd, &junk, sizeof(junk)) < 0 && errno != EAGAIN)
+    perror("eventfd read");
+
+  for(unsigned int i = 0; i < workers.size(); i++){
+    l7_worker *worker = workers[(next + i) % workers.size()];
+    l7_pipeline_verdict verdict;
+    while(worker->verdicts.pop(verdict)){
+      nverdicts.add();
+      handler(verdict, handlerdata);
+    }
+  }
+  next++;
+}
+
+// Called from the queue thread.  Gives the packet to the worker that
+// handles its connection.  In asynchronous mode, if that worker is too far
+// behind, the packet is not examined.  Otherwise we wait for it, sending
+// out any verdicts in the meantime.
+void l7_pipeline::submit(l7_connection *connection, const unsigned char *data,
+                         unsigned int datalen, unsigned int packetnum,
+                         const l7_segment & segment, u_int32_t id, 
+                         u_int32_t wholemark, const unsigned char *packet,
+                         int packetlen)
+{
+  // Both directions of a connection share the same l7_connection, so its
+  // address identifies the flow.
+  uintptr_t hash = ((uintptr_t)connection >> 4) * 2654435761u;
+  l7_worker *worker = workers[(hash >> 8) % workers.size()];
+
+  l7_pipeline_job job;
+  job.connection = connection;
+  job.data = NULL;
+  if(datalen > 0){
+    job.data = (char *)malloc(datalen);
+    memcpy(job.data, data, datalen);
+  }
+  job.datalen = datalen;
+  job.packetnum = packetnum;
+  job.segment = segment;
+  job.id = id;
+  job.wholemark = wholemark;
+  job.packet = NULL;
+  job.packetlen = packetlen;
+  if(packet){
+    job.packet = (unsigned char *)malloc(packetlen);
+    memcpy(job.packet, packet, packetlen);
+  }
+  connection->hold();
+
+  while(!worker->jobs.push(job)){
+    if(async){
+      ndropped.add();
+      unsigned long n = ndropped.get();
+      if((n^(n-1)) == (2*n-1)) // is it a power of 2?
+        cerr << "Classification is falling behind, skipping packets!\n("
+             << n << " skipped so far.)\n";
+      free(job.data);
+      free(job.packet);
+      connection->release();
+      return;
+    }
+    nfullwaits.add();
+    handle_verdicts();
+    sched_yield();
+  }
+  worker->maxdepth.max(worker->jobs.count());
+
+  if(__atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST))
+    sem_post(&worker->wakeup);
+}
@@ -0,0 +1,112 @@
+/*
+  The l7-pipeline class runs classification in a pool of worker threads so
+  that the queue thread only has to read packets and send verdicts.
+
+  Work is handed to the workers by connection, so all the packets of one
+  connection are classified in order by the same worker, while different
+  connections are spread over all of them.  Each worker has a lock-free
+  ring of jobs from the queue thread and a lock-free ring of verdicts
+  going back to it.
+
+  In asynchronous mode the queue thread doesn't wait for the verdicts at
+  all: the workers just update the connection's mark, which is applied to
+  the packets that come after.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_PIPELINE_H
+#define L7_PIPELINE_H
+
+#include <vector>
+#include <pthread.h>
+#include <semaphore.h>
+#include "l7-conntrack.h"
+#include "l7-ring.h"
+#include "l7-stats.h"
+
+struct l7_pipeline_job {
+  l7_connection *connection; // we hold a reference on this
+  char *data;                // our own copy of the application data
+  unsigned int datalen;
+  unsigned int packetnum;    // which packet of the connection this is
+  l7_segment segment;        // where the data goes in the TCP stream
+  u_int32_t id;              // the packet's queue id, for the verdict
+  u_int32_t wholemark;       // the parts of the mark that aren't ours
+  unsigned char *packet;     // a copy of the whole packet if it is to be
+  int packetlen;             // recorded with its mark (see l7-record.h)
+};
+
+struct l7_pipeline_verdict {
+  l7_connection *connection; // the job's reference, passed back
+  u_int32_t id;
+  u_int32_t mark;            // the whole mark to give the packet
+  unsigned char *packet;     // the job's, passed back
+  int packetlen;
+};
+
+typedef void (*l7_verdict_handler)(const l7_pipeline_verdict & verdict,
+                                   void *data);
+
+class l7_worker {
+ private:
+  l7_ring<l7_pipeline_job> jobs;
+  l7_ring<l7_pipeline_verdict> verdicts;
+  sem_t wakeup;
+  int sleeping;
+  pthread_t thread;
+  class l7_pipeline *pipeline;
+  static void *start_thread(void *worker);
+  void run();
+  void wait_for_job(l7_pipeline_job & job);
+
+  friend class l7_pipeline;
+
+ public:
+  l7_counter njobs;
+  l7_counter maxdepth;
+
+  l7_worker(l7_pipeline *pipeline, unsigned int depth, int number);
+  ~l7_worker();
+};
+
+class l7_pipeline {
+ private:
+  vector<l7_worker *> workers;
+  bool async;
+  int notifyfd;    // eventfd that tells the queue thread there are verdicts
+  int notified;
+  l7_verdict_handler handler;
+  void *handlerdata;
+  unsigned int next; // the worker to look at first for verdicts
+
+  friend class l7_worker;
+  void notify();
+
+ public:
+  l7_counter ndropped;
+  l7_counter nfullwaits;
+  l7_counter nverdicts;
+
+  l7_pipeline(int nworkers, unsigned int depth, bool async);
+  ~l7_pipeline();
+  void start();
+  bool is_async() const { return async; }
+
+  void set_verdict_handler(l7_verdict_handler handler, void *data);
+  int get_notify_fd() const { return notifyfd; }
+  void handle_verdicts();
+
+  void submit(l7_connection *connection, const unsigned char *data,
+              unsigned int datalen, unsigned int packetnum,
+              const l7_segment & segment, u_int32_t id, u_int32_t wholemark,
+              const unsigned char *packet, int packetlen);
+};
+
+#endif
@@ -0,0 +1,156 @@
+/*
+  Guesses how a new connection will be classified from how earlier
+  connections to the same server were.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <cstring>
+
+#include "l7-predict.h"
+#include "util.h"
+
+l7_predictor::l7_predictor(unsigned int nentries, unsigned int after,
+                           unsigned int sample) :
+  nhits("predict.hits"), nmisses("predict.misses"),
+  nsamples("predict.samples"), nconfirmed("predict.confirmed"),
+  nfailures("predict.failures"), nevictions("predict.evictions"),
+  nentries("predict.entries")
+{
+  nbuckets = 1;
+  while(nbuckets*L7_PREDICT_WAYS < nentries) nbuckets <<= 1;
+
+  endpoints = (l7_endpoint *)calloc(nbuckets*L7_PREDICT_WAYS,
+                                    sizeof(l7_endpoint));
+  if(!endpoints){
+    cerr << "Out of memory for the prediction cache\n";
+    exit(1);
+  }
+
+  for(int i = 0; i < L7_PREDICT_LOCKS; i++)
+    pthread_mutex_init(&locks[i], NULL);
+
+  this->after = after;
+  this->sample = sample;
+  clock = 0;
+  nguesses = 0;
+}
+
+l7_predictor::~l7_predictor()
+{
+  for(int i = 0; i < L7_PREDICT_LOCKS; i++)
+    pthread_mutex_destroy(&locks[i]);
+  free(endpoints);
+}
+
+// The responder is the destination of the original direction
+u_int32_t l7_predictor::bucket_for(const l7_tuple & tuple) const
+{
+  u_int32_t h = tuple.daddr * 0x9e3779b1u;
+  h = (h ^ ((u_int32_t)tuple.dport << 8 | tuple.proto)) * 0x85ebca6bu;
+  return (h ^ (h >> 16)) & (nbuckets - 1);
+}
+
+static bool same_endpoint(const l7_endpoint & e, const l7_tuple & tuple)
+{
+  return e.used && e.addr == tuple.daddr && e.port == tuple.dport &&
+         e.proto == tuple.proto;
+}
+
+// Returns true if connections to this endpoint have been classified the
+// same way often enough to trust, and puts that mark in mark.  check is set
+// if the caller should classify this one anyway to make sure.
+bool l7_predictor::predict(const l7_tuple & tuple, u_int32_t & mark,
+                           bool & check)
+{
+  u_int32_t bucket = bucket_for(tuple);
+  l7_endpoint *e = &endpoints[bucket*L7_PREDICT_WAYS];
+  bool found = false;
+
+  pthread_mutex_lock(&locks[bucket % L7_PREDICT_LOCKS]);
+  for(int i = 0; i < L7_PREDICT_WAYS; i++){
+    if(same_endpoint(e[i], tuple)){
+      e[i].lastused = __sync_add_and_fetch(&clock, 1);
+      if(e[i].agreed >= after){
+        mark = e[i].mark;
+        found = true;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&locks[bucket % L7_PREDICT_LOCKS]);
+
+  if(!found){
+    nmisses.add();
+    return false;
+  }
+
+  nhits.add();
+  check = sample && __sync_add_and_fetch(&nguesses, 1) % sample == 0;
+  if(check) nsamples.add();
+  return true;
+}
+
+// Records that a connection to this endpoint was classified as mark.  If
+// it was classified to check a guess, guess is what we guessed, otherwise
+// it is 0.
+void l7_predictor::learn(const l7_tuple & tuple, u_int32_t mark,
+                         u_int32_t guess)
+{
+  u_int32_t bucket = bucket_for(tuple);
+  l7_endpoint *e = &endpoints[bucket*L7_PREDICT_WAYS];
+  l7_endpoint *victim = &e[0];
+
+  if(guess){
+    if(guess == mark) nconfirmed.add();
+    else{
+      nfailures.add();
+      l7printf(1, "Guessed mark %d for a connection to port %d, but it was "
+                  "%d\n", guess, ntohs(tuple.dport), mark);
+    }
+  }
+
+  pthread_mutex_lock(&locks[bucket % L7_PREDICT_LOCKS]);
+  for(int i = 0; i < L7_PREDICT_WAYS; i++){
+    if(same_endpoint(e[i], tuple)){
+      if(e[i].mark == mark)
+        e[i].agreed++;
+      else{
+        // Start over.  A failure we didn't set out to find (a connection
+        // that started before the endpoint was trusted) counts as well.
+        if(!guess && e[i].agreed >= after) nfailures.add();
+        e[i].mark = mark;
+        e[i].agreed = 1;
+      }
+      pthread_mutex_unlock(&locks[bucket % L7_PREDICT_LOCKS]);
+      return;
+    }
+    if(!e[i].used ||
+       (victim->used && (int)(e[i].lastused - victim->lastused) < 0))
+      victim = &e[i];
+  }
+
+  if(victim->used) nevictions.add();
+  else nentries.add();
+  victim->addr = tuple.daddr;
+  victim->port = tuple.dport;
+  victim->proto = tuple.proto;
+  victim->used = 1;
+  victim->mark = mark;
+  victim->agreed = 1;
+  victim->lastused = clock;
+  pthread_mutex_unlock(&locks[bucket % L7_PREDICT_LOCKS]);
+}
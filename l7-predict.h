@@ -0,0 +1,72 @@
+/*
+  Guesses how a new connection will be classified from how earlier
+  connections to the same server were.
+
+  Most connections go to a small number of servers, and a given port on a
+  given server nearly always speaks the same protocol (or always speaks
+  something we have no pattern for).  Once enough connections to a server
+  endpoint (address, port and transport protocol) have ended the same way,
+  new ones are given that mark on their first packet without looking at
+  their data.  Every so often one is examined anyway, to check that the
+  guess still holds.
+
+  This trades accuracy for speed, so it is only done when asked for.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_PREDICT_H
+#define L7_PREDICT_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "l7-conntrack.h"
+#include "l7-stats.h"
+
+#define L7_PREDICT_WAYS 4     // entries per bucket
+#define L7_PREDICT_LOCKS 256  // buckets share this many locks
+
+struct l7_endpoint {
+  u_int32_t addr;          // the responder's, in network byte order
+  u_int16_t port;
+  u_int8_t proto;
+  u_int8_t used;
+  u_int32_t mark;          // how connections to it have been classified
+  u_int32_t agreed;        // how many in a row have been classified so
+  u_int32_t lastused;      // for choosing which entry to evict
+};
+
+class l7_predictor {
+ private:
+  l7_endpoint *endpoints;
+  u_int32_t nbuckets;
+  unsigned int after;      // trust an endpoint once this many agree
+  unsigned int sample;     // check every this many guesses, 0 for never
+  unsigned int clock;      // ticks once per lookup, for lastused
+  unsigned int nguesses;
+  pthread_mutex_t locks[L7_PREDICT_LOCKS];
+
+  u_int32_t bucket_for(const l7_tuple & tuple) const;
+
+ public:
+  l7_counter nhits;
+  l7_counter nmisses;
+  l7_counter nsamples;
+  l7_counter nconfirmed;
+  l7_counter nfailures;
+  l7_counter nevictions;
+  l7_counter nentries;
+
+  l7_predictor(unsigned int nentries, unsigned int after, unsigned int sample);
+  ~l7_predictor();
+  bool predict(const l7_tuple & tuple, u_int32_t & mark, bool & check);
+  void learn(const l7_tuple & tuple, u_int32_t mark, u_int32_t guess);
+};
+
+#endif
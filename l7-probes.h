@@ -0,0 +1,41 @@
+/*
+  Static tracepoints (USDT probes) on the packet path, for perf, bpftrace
+  or SystemTap to attach to.  Each one is a single no-op instruction until
+  something attaches to it.  If <sys/sdt.h> wasn't found when l7-filter 
+  was built, they compile to nothing at all.
+
+  For instance, to see how long classification takes:
+
+    bpftrace -e 'usdt:/usr/bin/l7-filter:l7filter:append_done 
+                   { @start[tid] = nsecs; }
+                 usdt:/usr/bin/l7-filter:l7filter:classify_done 
+                   { @ns = hist(nsecs - @start[tid]); }'
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_PROBES_H
+#define L7_PROBES_H
+
+#include "config.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define L7_PROBE(name) DTRACE_PROBE(l7filter, name)
+#define L7_PROBE1(name, a) DTRACE_PROBE1(l7filter, name, a)
+#define L7_PROBE2(name, a, b) DTRACE_PROBE2(l7filter, name, a, b)
+#define L7_PROBE3(name, a, b, c) DTRACE_PROBE3(l7filter, name, a, b, c)
+#else
+#define L7_PROBE(name) do {} while(0)
+#define L7_PROBE1(name, a) do {} while(0)
+#define L7_PROBE2(name, a, b) do {} while(0)
+#define L7_PROBE3(name, a, b, c) do {} while(0)
+#endif
+
+#endif
@@ -32,6 +32,9 @@ using namespace std;
 #include <stdlib.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/time.h>
 #include <map>
 #include <netinet/in.h>
 #include <linux/types.h>
@@ -40,14 +43,46 @@ using namespace std;
 
 #include "l7-conntrack.h"
 #include "l7-queue.h"
+#include "l7-shared.h"
+#include "l7-predict.h"
+#include "l7-probes.h"
+#include "l7-snapshot.h"
+#include "l7-overload.h"
+#include "l7-nfqueue.h"
+#include "l7-record.h"
 #include "util.h"
 
 // Probably shouldn't really be global, but it's SO much easier
 int maxpackets = 10; // by default.
 int clobbermark = 0;
+int headersqueuenum = -1; // queue whose packets we only get the headers of
+int queuebackend = L7_QUEUE_DIRECT; // how packets are read, see l7-nfqueue.h
+l7_recorder *recorder = NULL; // set if recording packets, see l7-record.h
 
+// Where the time goes, if we're asked to keep track (see l7_timing)
+static l7_histogram hreceive("latency.receive");
+static l7_histogram hkey("latency.key");
+static l7_histogram hlookup("latency.lookup");
+static l7_histogram hverdict("latency.verdict");
+static l7_histogram hpacket("latency.packet");
+
+// The most the IP and TCP headers can take up together.  We need this much
+// of every packet even if we don't want any of its data.
+#define MAX_HEADERS 120
+
+// How many verdicts the direct backend sends at once, at most
+#define L7_QUEUE_VERDICTS 64
+
+// How many packets' worth of room to ask for in the socket buffer, so that a
+// burst doesn't overflow it.  The kernel caps this at rmem_max (see above).
+#define RCVBUF_PACKETS 1024
+
+extern int verbosity;
 extern unsigned int markmask;
 extern unsigned int maskfirstbit;
+extern l7_classify* l7_classifier;
+extern l7_shared_table* shared_flows;
+extern l7_predictor* predictor;
 
 
 extern "C" {
@@ -56,37 +91,189 @@ extern "C" {
 }
 
 
-static int l7_queue_cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
-		       struct nfq_data *nfa, void *data) 
+// Takes what handle_packet() needs out of a packet that libnetfilter_queue
+// has read, each only once.
+static int l7_queue_handle(struct nfq_q_handle *qh, struct nfq_data *nfa, 
+                           l7_queue *queue, bool headersonly) 
 {
   struct nfqnl_msg_packet_hdr *ph;
+  unsigned char *data;
 
   u_int32_t id = 0;
   ph = nfq_get_msg_packet_hdr(nfa);
-  if(ph)
+  if(ph){
     id = ntohl(ph->packet_id);
-  
-  u_int32_t wholemark = nfq_get_nfmark(nfa);
+    l7printf(4, "hw_protocol = 0x%04x hook = %u id = %u ", 
+      ntohs(ph->hw_protocol), ph->hook, id);
+  }
 
-  // If it already has a mark (and we don't want to clobber it), 
-  // just pass it back with the same mark
-  if((wholemark<<maskfirstbit)&markmask != UNTOUCHED && !clobbermark){
-    static unsigned int naaltered = 0;
-    naaltered++;
-    if((naaltered^(naaltered-1)) == (2*naaltered-1)) // is it a power of 2?
-      cerr << "My part of the mark has already been altered, ignoring these "
-              "packets!\n(" << naaltered << " ignored so far.) "
-              "Fix your rules or use l7-filter -c.\n";
-    return nfq_set_verdict_mark(qh, id, NF_ACCEPT, htonl(wholemark), 0, NULL);
+  if(verbosity >= 4){
+    u_int32_t ifi = nfq_get_indev(nfa);
+    if(ifi) l7printf(4, "indev = %d ", ifi);
+    ifi = nfq_get_outdev(nfa);
+    if(ifi) l7printf(4, "outdev = %d ", ifi);
+  }
+
+  int len = nfq_get_payload(nfa, &data);
+  if(len >= 0) l7printf(4, "payload_len = %d\n", len);
+  else data = NULL;
+
+  return queue->handle_packet(qh, headersonly ? headersqueuenum :
+                              queue->get_queuenum(), data, len, id,
+                              nfq_get_nfmark(nfa), headersonly);
+}
+
+static int l7_queue_cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
+		       struct nfq_data *nfa, void *data) 
+{
+  return l7_queue_handle(qh, nfa, (l7_queue *)data, false);
+}
+
+// For the queue that only gets packets' headers
+static int l7_queue_headers_cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
+		               struct nfq_data *nfa, void *data) 
+{
+  return l7_queue_handle(qh, nfa, (l7_queue *)data, true);
+}
+
+// Asks the kernel to give us GSO packets whole instead of breaking them up
+// (we only look at the start anyway), and to let packets through rather than
+// drop them if we fall so far behind that the queue fills up.  Older kernels
+// don't know how, in which case we do without.
+static void set_queue_flags(struct nfq_q_handle *qh, int queuenum)
+{
+#ifdef NFQA_CFG_F_GSO
+  if(nfq_set_queue_flags(qh, NFQA_CFG_F_GSO, NFQA_CFG_F_GSO) < 0)
+    l7printf(1, "Kernel can't give us GSO packets on queue %d\n", queuenum);
+#endif
+#ifdef NFQA_CFG_F_FAIL_OPEN
+  if(nfq_set_queue_flags(qh, NFQA_CFG_F_FAIL_OPEN, NFQA_CFG_F_FAIL_OPEN) < 0)
+    cerr << "Warning: kernel can't let packets through when queue " 
+         << queuenum << " is full.\nThey will be dropped instead.\n";
+#endif
+}
+
+// Reads the kernel's counts of packets it couldn't give us
+static void read_kernel_stats(void *data)
+{
+  ((l7_queue *)data)->read_kernel_stats();
+}
+
+// Lets the packet go with the given (whole) mark.  With the direct backend,
+// the verdict waits in verdicts until flush_verdicts(), and qh isn't used.
+void l7_queue::send_verdict(struct nfq_q_handle *qh, u_int16_t queuenum,
+                            u_int32_t id, u_int32_t wholemark)
+{
+  unsigned long start = l7_timing ? l7_now_ns() : 0;
+  l7printf(4, "Set verdict ACCEPT, mark %#08x\n", wholemark);
+  if(verdicts){
+    if(!verdicts->add(queuenum, id, wholemark)){
+      nverdicterrors.add();
+      l7printf(1, "Couldn't send verdicts: %s\n", strerror(errno));
+    }
+  }
+  else
+    nfq_set_verdict_mark(qh, id, NF_ACCEPT, htonl(wholemark), 0, NULL);
+  L7_PROBE2(verdict, id, wholemark);
+  if(l7_timing) l7_stage(hverdict, start);
+}
+
+// Sends the verdicts that the direct backend has been saving up
+void l7_queue::flush_verdicts()
+{
+  if(verdicts && !verdicts->flush()){
+    nverdicterrors.add();
+    l7printf(1, "Couldn't send verdicts: %s\n", strerror(errno));
   }
+}
+
+// When a packet got its mark, for recording it
+static u_int64_t record_usec()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec*1000000ULL + now.tv_usec;
+}
 
-  return ((l7_queue *)data)->handle_packet(nfa, qh);
+// Sends the verdict for a packet that a worker classified, and records it
+// if it was to be
+static void l7_queue_send_verdict(const l7_pipeline_verdict & verdict,
+                                  void *data)
+{
+  l7_queue *queue = (l7_queue *)data;
+
+  verdict.connection->inflight--;
+  verdict.connection->release();
+
+  queue->send_verdict(queue->get_main_handle(), queue->get_queuenum(),
+                      verdict.id, verdict.mark);
+
+  if(verdict.packet){
+    recorder->record(verdict.packet, verdict.packetlen,
+                     (verdict.mark & markmask) >> maskfirstbit, record_usec());
+    free(verdict.packet);
+  }
 }
 
 
-l7_queue::l7_queue(l7_conntrack *connection_tracker) 
+l7_queue::l7_queue(l7_conntrack *connection_tracker, l7_pipeline *pipeline) :
+  nenobufs("queue.enobufs"), nkerneldropped("queue.kerneldropped"),
+  nuserdropped("queue.userdropped"), nbacklog("queue.backlog"),
+  nheadersonly("queue.headersonly"), 
+  nheadersunclassified("queue.headersonlyunclassified"),
+  nbatches("queue.batches"), nverdicterrors("queue.verdicterrors"),
+  nbadmessages("queue.badmessages")
 {
   l7_connection_tracker = connection_tracker;
+  this->pipeline = pipeline;
+  queuenum = -1;
+  mainqh = NULL;
+  verdicts = NULL;
+  nbatched = 0;
+  tracking = false;
+  l7_stats_add_hook(::read_kernel_stats, this);
+}
+
+// Fills in the counters that the kernel keeps for our queues.  Called by
+// the statistics thread, and by the queue thread for overload control.
+void l7_queue::read_kernel_stats()
+{
+  FILE *f = fopen("/proc/net/netfilter/nfnetlink_queue", "r");
+  if(!f) return;
+
+  unsigned int num, portid, total, mode, range, dropped, userdropped, seq, one;
+  unsigned long ndropped = 0, nuser = 0, ntotal = 0;
+  while(fscanf(f, "%u %u %u %u %u %u %u %u %u", &num, &portid, &total, &mode,
+               &range, &dropped, &userdropped, &seq, &one) == 9){
+    if((int)num != queuenum && (int)num != headersqueuenum)
+      continue;
+    ndropped += dropped;
+    nuser += userdropped;
+    ntotal += total;
+  }
+  fclose(f);
+
+  nkerneldropped.set(ndropped);
+  nuserdropped.set(nuser);
+  nbacklog.set(ntotal);
+}
+
+// Counts a failed recv().  ENOBUFS means the kernel had packets for us but
+// the socket buffer was full, so it dropped them.
+void l7_queue::recv_failed(int rv)
+{
+  if(errno == ENOBUFS){
+    nenobufs.add();
+    unsigned long n = nenobufs.get();
+    if((n^(n-1)) == (2*n-1)) // is it a power of 2?
+      cerr << "Packets are arriving faster than we can read them, so the "
+              "kernel is dropping them!\n(" << n << " times so far.)\n";
+    return;
+  }
+  cerr << "Error: recv() returned negative value." << endl;
+  cerr << "rv=" << rv << endl;
+  cerr << "errno=" << errno << endl;
+  cerr << "errstr=" << strerror(errno) << endl << endl;
 }
 
 
@@ -94,15 +281,28 @@ l7_queue::~l7_queue()
 {
 }
 
+struct nfq_q_handle *l7_queue::get_main_handle()
+{
+  return mainqh;
+}
+
+int l7_queue::get_queuenum()
+{
+  return queuenum;
+}
+
 
 void l7_queue::start(int queuenum) 
 {
   struct nfq_handle *h;
-  struct nfq_q_handle *qh;
+  struct nfq_q_handle *qh, *hqh = NULL;
   struct nfnl_handle *nh;
   int fd;
   int rv;
-  char buf[4096];
+  char *bufs[L7_QUEUE_BATCH];
+  unsigned int bufsize, copyrange;
+
+  this->queuenum = queuenum;
 
   l7printf(3, "opening library handle\n");
   h = nfq_open();
@@ -134,27 +334,143 @@ void l7_queue::start(int queuenum)
     exit(1);
   }
 
-  l7printf(3, "setting copy_packet mode\n");
-  if(nfq_set_mode(qh, NFQNL_COPY_PACKET, 0xffff) < 0) {
+  // There's no point in having the kernel copy more of each packet than
+  // any pattern will look at.
+  copyrange = MAX_HEADERS + l7_classifier->get_window_bytes();
+  if(copyrange > 0xffff) copyrange = 0xffff;
+
+  l7printf(3, "setting copy_packet mode, %u bytes\n", copyrange);
+  if(nfq_set_mode(qh, NFQNL_COPY_PACKET, copyrange) < 0) {
     cerr << "can't set packet_copy mode\n";
     exit(1);
   }
+  set_queue_flags(qh, queuenum);
+  if(recorder) recorder->start(copyrange);
+
+  if(headersqueuenum >= 0){
+    l7printf(3, "binding this socket to headers only queue %d\n", 
+             headersqueuenum);
+    hqh = nfq_create_queue(h, headersqueuenum, &l7_queue_headers_cb, this);
+    if(!hqh) {
+      cerr << "error during nfq_create_queue() for the headers only queue\n";
+      exit(1);
+    }
+    if(nfq_set_mode(hqh, NFQNL_COPY_PACKET, MAX_HEADERS) < 0) {
+      cerr << "can't set packet_copy mode for the headers only queue\n";
+      exit(1);
+    }
+    set_queue_flags(hqh, headersqueuenum);
+  }
 
   nh = nfq_nfnlh(h);
   fd = nfnl_fd(nh);
+  mainqh = qh;
+
+  // The library has set the queues up.  Unless asked not to, we take it
+  // from here.
+  if(queuebackend == L7_QUEUE_DIRECT)
+    verdicts = new l7_nfq_verdicts(fd, L7_QUEUE_VERDICTS);
+
+  // Room for the biggest message: the copied part of a packet, plus the 
+  // netlink headers and the other attributes, which are well under a page.
+  // Each packet of a batch needs its own, since they are all worked on
+  // after they have all been read.
+  bufsize = copyrange + 4096;
+  for(int i = 0; i < L7_QUEUE_BATCH; i++){
+    bufs[i] = (char *)malloc(bufsize);
+    if(!bufs[i]){
+      cerr << "Out of memory for receive buffers\n";
+      exit(1);
+    }
+  }
+  nfnl_rcvbufsiz(nh, bufsize*RCVBUF_PACKETS);
+
+  // this is the main loop.  Besides packets, we wait for conntrack events
+  // and, if workers give us verdicts, for those.
+  struct pollfd fds[3];
+  int nfds = 2;
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = l7_connection_tracker->get_notify_fd();
+  fds[1].events = POLLIN;
+  if(pipeline && !pipeline->is_async()){
+    pipeline->set_verdict_handler(l7_queue_send_verdict, this);
+    fds[2].fd = pipeline->get_notify_fd();
+    fds[2].events = POLLIN;
+    nfds = 3;
+  }
+
+  // The overload controller wants to look at the load now and then, even
+  // if no packets come.  Falling behind is any of these going up.
+  int timeout = -1;
+  if(overload_control){
+    timeout = L7_OVERLOAD_INTERVAL;
+    overload_control->watch(nenobufs);
+    overload_control->watch(nkerneldropped);
+    overload_control->watch(nuserdropped);
+    overload_control->watch_backlog(nbacklog);
+    overload_control->set_refresh(::read_kernel_stats, this);
+    if(pipeline){
+      overload_control->watch(pipeline->nfullwaits);
+      overload_control->watch(pipeline->ndropped);
+    }
+  }
 
-  // this is the main loop
   while (true){
-    while ((rv = recv(fd, buf, sizeof(buf), 0)) && rv >= 0)
-      nfq_handle_packet(h, buf, rv);
-    
-    cerr << "Error: recv() returned negative value." << endl;
-    cerr << "rv=" << rv << endl;
-    cerr << "errno=" << errno << endl;
-    cerr << "errstr=" << strerror(errno) << endl << endl;
+    if(overload_control) overload_control->tick();
+
+    if(poll(fds, nfds, timeout) < 0){
+      if(errno == EINTR) continue;
+      cerr << "Error: poll() failed: " << strerror(errno) << endl;
+      continue;
+    }
+
+    if(fds[1].revents & POLLIN)
+      l7_connection_tracker->handle_notify();
+
+    // Between batches, the table holds still long enough to be saved
+    if(l7_snapshot_requested())
+      l7_snapshot_take(l7_connection_tracker->get_flows());
+
+    if(nfds > 2 && fds[2].revents & POLLIN)
+      pipeline->handle_verdicts();
+
+    if(fds[0].revents & POLLIN){
+      // Take a few packets at a time, but not so many that verdicts from
+      // the workers wait long.  The callbacks only put them in the batch;
+      // flush_batch() does the work.
+      unsigned long batchstart = overload_control ? l7_now_ns() : 0;
+      int n;
+      for(n = 0; n < L7_QUEUE_BATCH; n++){
+        unsigned long start = l7_timing ? l7_now_ns() : 0;
+        rv = recv(fd, bufs[n], bufsize, MSG_DONTWAIT);
+        if(rv >= 0){
+          L7_PROBE1(received, rv);
+          if(l7_timing) l7_stage(hreceive, start);
+          if(verdicts) take_messages((unsigned char *)bufs[n], rv);
+          else nfq_handle_packet(h, bufs[n], rv);
+          continue;
+        }
+        if(errno != EAGAIN && errno != EINTR)
+          recv_failed(rv);
+        break;
+      }
+      flush_batch();
+      // A full batch means there were more waiting
+      if(overload_control)
+        overload_control->batch_done(batchstart, l7_now_ns(), n,
+                                     n == L7_QUEUE_BATCH);
+    }
+
+    // Everything decided on this time around goes to the kernel at once
+    flush_verdicts();
   }
   l7printf(3, "unbinding from queue 0\n");
   nfq_destroy_queue(qh);
+  if(hqh) nfq_destroy_queue(hqh);
+  for(int i = 0; i < L7_QUEUE_BATCH; i++)
+    free(bufs[i]);
+  delete verdicts;
 
   l7printf(3, "closing library handle\n");
   nfq_close(h);
@@ -162,124 +478,384 @@ void l7_queue::start(int queuenum)
   exit(0);
 }
 
-u_int32_t l7_queue::handle_packet(nfq_data * tb, struct nfq_q_handle *qh) 
+// Does the checks common to both queues and both backends and puts the
+// packet in the batch.  qh is the library's handle for the queue it came
+// from, or NULL for the direct backend, which goes by queuenum.  data is
+// the packet, of which len bytes are there (or NULL if none are).
+// headersonly is true for packets that came to us without their data, 
+// because the rules say they belong to connections that are classified.
+u_int32_t l7_queue::handle_packet(struct nfq_q_handle *qh, u_int16_t queuenum,
+                                  unsigned char *data, int len, u_int32_t id,
+                                  u_int32_t wholemark, bool headersonly) 
 {
-  int id = 0, ret, dataoffset, datalen;
-  u_int32_t wholemark, mark, ifi; 
-  struct nfqnl_msg_packet_hdr *ph;
-  unsigned char * data;
-  l7_connection * connection;
+  // If it already has a mark (and we don't want to clobber it), 
+  // just pass it back with the same mark
+  if((wholemark<<maskfirstbit)&markmask != UNTOUCHED && !clobbermark){
+    static unsigned int naaltered = 0;
+    naaltered++;
+    if((naaltered^(naaltered-1)) == (2*naaltered-1)) // is it a power of 2?
+      cerr << "My part of the mark has already been altered, ignoring these "
+              "packets!\n(" << naaltered << " ignored so far.) "
+              "Fix your rules or use l7-filter -c.\n";
+    send_verdict(qh, queuenum, id, wholemark);
+    return 0;
+  }
 
-  ph = nfq_get_msg_packet_hdr(tb);
-  if(ph){
-    id = ntohl(ph->packet_id);
-    l7printf(4, "hw_protocol = 0x%04x hook = %u id = %u ", 
-      ntohs(ph->hw_protocol), ph->hook, id);
+  // Ignore anything that's not TCP or UDP, leaving its mark as it is
+  if(!data || len < 20 || (data[9] != IPPROTO_TCP && data[9] != IPPROTO_UDP)){
+    send_verdict(qh, queuenum, id, wholemark);
+    return 0;
   }
 
   // Need to get the wholemark so that we can pass the unmasked part back
   // Except for the print statement and debugging, there's not really any
   // reason to pull out the masked part, because it's always modified without
   // looking at it...
-  wholemark = (nfq_get_nfmark(tb));
+  u_int32_t mark;
   if(clobbermark){
      mark = UNTOUCHED;
      wholemark = wholemark&(~markmask); // zero out our part of the mark
   }
   else mark = ((wholemark&markmask) >> maskfirstbit);
   l7printf(4, "wholemark = %#08x ", wholemark);
-  l7printf(4, "mark = %d ", mark);
+  l7printf(4, "mark = %d\n", mark);
+
+  // The data stays where it is, in its receive buffer, until the batch is
+  // done.
+  if(nbatched == L7_QUEUE_BATCH) flush_batch();
+  l7_queued_packet & packet = batch[nbatched++];
+  packet.qh = qh;
+  packet.queuenum = queuenum;
+  packet.data = data;
+  packet.len = len;
+  packet.id = id;
+  packet.wholemark = wholemark;
+  packet.headersonly = headersonly;
+  return 0;
+}
 
-  ifi = nfq_get_indev(tb);
-  if(ifi) l7printf(4, "indev = %d ", ifi);
+// Puts the packets in what the direct backend has read into the batch
+void l7_queue::take_messages(unsigned char *buf, int len)
+{
+  l7_nfq_packet packets[L7_QUEUE_BATCH];
+  while(len > 0){
+    int used, nerrors;
+    int n = l7_nfq_parse(buf, len, packets, L7_QUEUE_BATCH, used, nerrors);
+    if(nerrors) nverdicterrors.add(nerrors);
+    if(n < 0){
+      nbadmessages.add();
+      l7printf(1, "Ignoring %d bytes from the queue that aren't netlink "
+                  "messages\n", len);
+      return;
+    }
+    for(int i = 0; i < n; i++)
+      handle_packet(NULL, packets[i].queuenum, packets[i].payload,
+                    packets[i].len, packets[i].id, packets[i].mark,
+                    packets[i].queuenum == headersqueuenum);
+    if(used == 0) return;
+    buf += used;
+    len -= used;
+  }
+}
 
-  ifi = nfq_get_outdev(tb);
-  if(ifi) l7printf(4, "outdev = %d ", ifi);
+// Works out the marks for the packets read so far and lets them go
+void l7_queue::flush_batch()
+{
+  if(nbatched == 0) return;
+  handle_batch(batch, nbatched);
+
+  u_int64_t usec = recorder ? record_usec() : 0;
+
+  for(int i = 0; i < nbatched; i++){
+    // Those that went to a worker are recorded when their verdicts come back
+    if(batch[i].mark == L7_VERDICT_LATER) continue;
+    if(recorder && recorder->wants(batch[i].packetnum))
+      recorder->record(batch[i].data, batch[i].len, batch[i].mark, usec);
+    send_verdict(batch[i].qh, batch[i].queuenum, batch[i].id,
+                 (batch[i].mark<<maskfirstbit)|batch[i].wholemark);
+  }
+  nbatched = 0;
+}
 
-  ret = nfq_get_payload(tb, &data);
-  if(ret >= 0) l7printf(4, "payload_len = %d\n", ret);
-  
-  char ip_protocol = data[9];
+// Works out the marks (our part of them) for some TCP and UDP packets, and
+// puts them in each packet's mark, or L7_VERDICT_LATER if the packet has gone
+// to a worker, which will give its verdict.  Only data, len, id, wholemark
+// and headersonly need to be filled in.
+//
+// Finding each packet's connection is likely to be two cache misses, one
+// for the table and one for the connection, each depending on the one
+// before.  So instead of looking them up one at a time, we make all the
+// tuples first and ask for the table slots they need, then for the
+// connections in those slots, and only then do the real work on each
+// packet.  The misses for the whole batch then overlap.
+void l7_queue::handle_batch(l7_queued_packet *packets, int n)
+{
+  const l7_flow_table & flows = l7_connection_tracker->get_flows();
+
+  // Bring the connections up to date with what conntrack has told us
+  l7_connection_tracker->handle_events();
+  nbatches.add();
+
+  for(int i = 0; i < n; i++){
+    unsigned long start = l7_timing ? l7_now_ns() : 0;
+    l7_queued_packet & packet = packets[i];
+    packet.tuple = l7_connection_tracker->make_tuple(packet.data, false);
+    packet.reply = l7_connection_tracker->make_tuple(packet.data, true);
+    packet.hash = l7_tuple_hash(packet.tuple);
+    packet.replyhash = l7_tuple_hash(packet.reply);
+    flows.prefetch_slot(packet.hash);
+    flows.prefetch_slot(packet.replyhash);
+    L7_PROBE1(key_made, packet.hash);
+    if(l7_timing) l7_stage(hkey, start);
+  }
 
-  // Ignore anything that's not TCP or UDP
-  if(ip_protocol != IPPROTO_TCP && ip_protocol != IPPROTO_UDP)
-    return nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL);
+  for(int i = 0; i < n; i++){
+    flows.prefetch_connection(packets[i].tuple, packets[i].hash);
+    flows.prefetch_connection(packets[i].reply, packets[i].replyhash);
+  }
+
+  for(int i = 0; i < n; i++){
+    unsigned long start = l7_timing ? l7_now_ns() : 0;
+    packets[i].mark = handle_one(packets[i]);
+    if(l7_timing) l7_stage(hpacket, start);
+  }
+}
+
+// Works out the mark (our part of it) for a TCP or UDP packet.  data is the
+// packet from its IP header on, of which len bytes are there.  If the
+// packet has gone to a worker, which will give its verdict, returns
+// L7_VERDICT_LATER.  Packets that come in batches should go to
+// handle_batch() instead.
+u_int32_t l7_queue::handle_data(unsigned char *data, int len, u_int32_t id,
+                                u_int32_t wholemark, bool headersonly)
+{
+  l7_queued_packet packet;
+  packet.qh = NULL;
+  packet.queuenum = 0;
+  packet.data = data;
+  packet.len = len;
+  packet.id = id;
+  packet.wholemark = wholemark;
+  packet.headersonly = headersonly;
+  handle_batch(&packet, 1);
+  return packet.mark;
+}
+
+// Makes packets start connections themselves and end them with FINs and
+// RSTs, instead of waiting to hear from conntrack, for when we only see
+// copies of the packets (see l7-capture.cpp).  Packets then need their time
+// set, and expire_connections() should be called now and then.
+void l7_queue::track_connections()
+{
+  tracking = true;
+}
+
+// Starts following the connection that the packet is part of.  Its first
+// packet is taken to be in the original direction, unless it is a SYN/ACK,
+// in which case the SYN went by before we were looking.  TCP packets with
+// no data that aren't SYNs, like the last ACK of a connection we have
+// already forgotten, don't start anything and get NULL.
+l7_connection *l7_queue::new_connection(const l7_queued_packet & packet,
+                                        int datalen, int & direction)
+{
+  int ip_hl = 4*(packet.data[0] & 0x0f);
+  bool tcp = packet.tuple.proto == IPPROTO_TCP;
+  if(tcp && datalen <= 0 && !(packet.data[ip_hl + 13] & 0x02)) return NULL;
+  direction = tcp && (packet.data[ip_hl + 13] & 0x12) == 0x12;
+
+  l7_connection *connection = new l7_connection(
+    l7_connection_tracker->make_key(packet.data, direction),
+    direction ? packet.reply : packet.tuple);
+  l7printf(3, "Following new connection\t%s\n", connection->key.c_str());
+
+  // One reference for the table, one for us
+  connection->hold();
+  l7_connection_tracker->add_l7_connection(connection);
+  return connection;
+}
+
+// Notes when the connection was last heard from and stops following it
+// once it is over: at a RST, or when both ends have sent a FIN.
+void l7_queue::follow_connection(l7_connection *connection,
+                                 const l7_queued_packet & packet,
+                                 int direction)
+{
+  connection->lastseen = packet.time;
+  if(packet.tuple.proto != IPPROTO_TCP) return;
+
+  int ip_hl = 4*(packet.data[0] & 0x0f);
+  unsigned char flags = packet.data[ip_hl + 13];
+  if(flags & 0x01) connection->fins |= 1 << direction;
+  if(flags & 0x04 || connection->fins == 3)
+    l7_connection_tracker->remove_l7_connection(connection->tuple);
+}
+
+// Does the work of handle_batch() for one packet, once its tuples and their
+// hashes have been made.
+u_int32_t l7_queue::handle_one(l7_queued_packet & packet)
+{
+  unsigned char *data = packet.data;
+  u_int32_t id = packet.id, wholemark = packet.wholemark;
+  bool headersonly = packet.headersonly;
+  int dataoffset, datalen;
+  packet.packetnum = 0;
+  u_int32_t mark;
+  l7_connection * connection;
+  int direction = 0; // 0 if the packet goes the way the connection started
 
   dataoffset = app_data_offset(data);
-  datalen = ret - dataoffset;
+  datalen = packet.len - dataoffset;
+  // Only the headers were copied, but we want to know whether there's data
+  if(headersonly)
+    datalen = (data[2] << 8 | data[3]) - dataoffset;
 
   //find the conntrack 
-  string key = l7_connection_tracker->make_key(data, false);
-  connection = l7_connection_tracker->get_l7_connection(key);
+  unsigned long start = l7_timing ? l7_now_ns() : 0;
+  connection = l7_connection_tracker->get_l7_connection(packet.tuple,
+                                                        packet.hash);
   
   if(connection)
-    l7printf(3, "Found connection orig:\t%s\n", key.c_str());
+    l7printf(3, "Found connection orig:\t%s\n", connection->key.c_str());
 
   if(!connection){
     //find the conntrack (backwards)
-    string key = l7_connection_tracker->make_key(data, true);
-    connection = l7_connection_tracker->get_l7_connection(key);
+    connection = l7_connection_tracker->get_l7_connection(packet.reply,
+                                                          packet.replyhash);
+    direction = 1;
   
     if(connection)
-      l7printf(3, "Found connection reply:\t%s\n", key.c_str());
+      l7printf(3, "Found connection reply:\t%s\n", connection->key.c_str());
   
+    if(!connection && tracking)
+      connection = new_connection(packet, datalen, direction);
+
     // It seems to routinely not get the UDP conntrack until the 2nd or 3rd
     // packet.  Tested with DNS.
-    if(!connection)
-      l7printf(2, "Got packet, had no ct:\t%s\n", key.c_str());
+    if(!connection && verbosity >= 2)
+      l7printf(2, "Got packet, had no ct:\t%s\n",
+               l7_connection_tracker->make_key(data, true).c_str());
   }
+  L7_PROBE2(lookup_done, connection != NULL, direction);
+  if(l7_timing) l7_stage(hlookup, start);
 
   // mark = the mark we found on the packet
   // connection->get_mark() = the mark that we have made internally
   if(connection){
+    l7_segment segment = get_segment(data, connection, direction);
     connection->increment_num_packets();
+    unsigned int packetnum = connection->get_num_packets();
+    packet.packetnum = packetnum;
+    bool classified = connection->get_mark() != NO_MATCH_YET && 
+                      connection->get_mark() != UNTOUCHED;
+
+    // Another l7-filter may have classified it already
+    if(!classified && shared_flows){
+      u_int32_t sharedmark = shared_flows->lookup(connection->tuple);
+      if(sharedmark != UNTOUCHED){
+        connection->adopt_mark(sharedmark);
+        classified = true;
+      }
+    }
+
+    // Or its server may be one whose connections always go the same way
+    if(!classified && predictor && datalen > 0 && !headersonly &&
+       !connection->guessed)
+      classified = connection->try_prediction(packetnum);
+
+    if(headersonly){
+      // We don't have its data, so all we can do is pass on what we know.
+      nheadersonly.add();
+      if(!classified && datalen > 0){
+        l7printf(2, "Got only the headers of %s, which isn't classified\n",
+                 connection->key.c_str());
+        nheadersunclassified.add();
+      }
+      mark = classified ? connection->get_mark() : NO_MATCH_YET;
+      connection->release();
+      return mark;
+    }
   
+    if(pipeline && !pipeline->is_async() && 
+       ((datalen > 0 && !classified) || connection->inflight > 0)){
+      // Let a worker decide.  Once any packet of a connection is waiting on
+      // a worker, the rest follow it there so that they keep their order.
+      // If it is to be recorded, that waits for its mark too.
+      connection->inflight++;
+      bool record = recorder && recorder->wants(packetnum);
+      pipeline->submit(connection, data+dataoffset, datalen > 0 ? datalen : 0,
+                       packetnum, segment, id, wholemark, 
+                       record ? data : NULL, packet.len);
+      connection->release();
+      return L7_VERDICT_LATER;
+    }
+
     if(datalen <= 0){
       l7printf(3, "Connection with no new application data ignored.\n");
       mark = NO_MATCH_YET; // no application data
     }
+    else if(classified){
+      // It is classified already.  Reapply existing mark.
+      mark = connection->get_mark();
+    }
+    else if(pipeline){
+      // Don't wait for the classification.  This packet goes out with what
+      // we know now and the result is applied to the ones after it.  The
+      // worker decides when it is past the patterns' window, since only
+      // it knows how many packets were retransmissions that don't count.
+      pipeline->submit(connection, data+dataoffset, datalen, packetnum, 
+                       segment, id, wholemark, NULL, 0);
+      mark = NO_MATCH_YET;
+    }
     else{
-      if(connection->get_mark() != NO_MATCH_YET && 
-         connection->get_mark() != UNTOUCHED){
-        // It is classified already.  Reapply existing mark.
-        mark = connection->get_mark();
-      }
-      else if(connection->get_num_packets() <= maxpackets){
-        // Do the heavy lifting.
-        connection->append_to_buffer((char*)(data+dataoffset),ret-dataoffset); 
-        l7printf(3, "Packet #%d, data is: %s\n", connection->get_num_packets(),
-                 friendly_print((unsigned char *)connection->buffer,
-                                connection->lengthsofar).c_str());
-          
-        mark = connection->classify();
-        if(mark != NO_MATCH_YET){ // Got a match, no need to keep data
-          free(connection->buffer);
-          connection->buffer = NULL; // marks it not to be free'd again
-        }
-      }
-      else{ // num_packets > maxpackets and hasn't been classified
-        mark = NO_MATCH;
-        // if this is the first packet after we've given up, clean up
-        if(connection->get_num_packets() == maxpackets+1){
-          print_give_up(key, (unsigned char *)connection->buffer, 
-                        connection->lengthsofar);
-        
-          free(connection->buffer);
-          connection->buffer = NULL; // marks it not to be free'd again
-        } // endif should clean up
-      } // endif whether should run match or what
-    } // endif there is any new data
+      // Do the heavy lifting.
+      mark = connection->inspect((char*)(data+dataoffset), datalen, packetnum,
+                                 segment);
+    } // endif whether should run match or what
+
+    if(tracking) follow_connection(connection, packet, direction);
+    connection->release();
   } // endif we found the connection
   else{
-    l7printf(3, "Didn't yet find\t%s\n", key.c_str());
+    if(verbosity >= 3)
+      l7printf(3, "Didn't yet find\t%s\n",
+               l7_connection_tracker->make_key(data, false).c_str());
     mark = NO_MATCH_YET;
+
+    // We may have started after the connection did, but another l7-filter 
+    // sharing the table (or our previous self) may know about it.
+    if(shared_flows){
+      mark = shared_flows->lookup(packet.tuple);
+      if(mark == UNTOUCHED)
+        mark = shared_flows->lookup(packet.reply);
+      if(mark == UNTOUCHED)
+        mark = NO_MATCH_YET;
+    }
   }
 
   if(mark == UNTOUCHED) cerr << "NOT REACHED. mark is still UNTOUCHED.\n";
 
-  l7printf(4,"Set verdict ACCEPT, mark %#08x\n",(mark<<maskfirstbit)|wholemark);
-  return nfq_set_verdict_mark(qh, id, NF_ACCEPT, 
-                              htonl((mark<<maskfirstbit)|wholemark), 0, NULL);
+  return mark;
+}
+
+// Finds where the packet's data goes in its TCP stream.  If it is a SYN,
+// also tells the connection where that direction's stream starts.
+l7_segment l7_queue::get_segment(const unsigned char *data, 
+                                 l7_connection *connection, int direction)
+{
+  l7_segment segment;
+  segment.direction = L7_NOT_TCP;
+  segment.seq = 0;
+
+  if(data[9] == IPPROTO_TCP){
+    int ip_hl = 4*(data[0] & 0x0f);
+    segment.direction = direction;
+    segment.seq = ntohl(*(u_int32_t *)(data + ip_hl + 4));
+    if(data[ip_hl + 13] & 0x02){ // SYN, which takes up a sequence number
+      segment.seq++;
+      connection->start_stream(direction, segment.seq);
+    }
+  }
+  return segment;
 }
 
 /* Returns offset the into the skb->data that the application data starts */
@@ -19,22 +19,94 @@
 #define L7_QUEUE_H
 
 #include "l7-conntrack.h"
+#include "l7-pipeline.h"
+#include "l7-stats.h"
 
 #define UNTOUCHED 0
 #define NO_MATCH_YET 1
 #define NO_MATCH 2
+#define L7_VERDICT_LATER 0xffffffff // see handle_data()
+
+// How packets are read and given verdicts (--queue-backend)
+enum { L7_QUEUE_DIRECT, L7_QUEUE_LIBRARY };
+
+// How many packets to read before looking for anything else to do, and so
+// the most that are worked on together (see handle_batch())
+#define L7_QUEUE_BATCH 16
+
+struct nfq_q_handle;
+class l7_nfq_verdicts;
+
+// A packet read from the queue, waiting for the rest of its batch
+struct l7_queued_packet {
+  struct nfq_q_handle *qh; // where its verdict goes
+  u_int16_t queuenum;      // the same, for the direct backend
+  unsigned char *data;     // from the IP header on
+  int len;
+  u_int32_t id;
+  u_int32_t wholemark;
+  bool headersonly;
+  l7_tuple tuple;          // the way the packet is going
+  l7_tuple reply;          // and the other way
+  u_int32_t hash;          // l7_tuple_hash() of each
+  u_int32_t replyhash;
+  u_int32_t mark;          // what handle_batch() decided
+  unsigned int packetnum;  // and which packet of its connection it was, or
+                           // 0 if it has none
+  u_int32_t time;          // when it came, seconds since the epoch.  Only
+                           // needed if following connections ourselves.
+};
 
 class l7_queue {
  private:
   l7_conntrack* l7_connection_tracker;
+  l7_pipeline* pipeline; // NULL unless giving verdicts asynchronously
+  int queuenum;
+  struct nfq_q_handle *mainqh;
+  l7_nfq_verdicts *verdicts; // waiting to be sent, if using the direct backend
+  l7_queued_packet batch[L7_QUEUE_BATCH];
+  int nbatched;
+  bool tracking; // we follow connections ourselves, see track_connections()
+  void recv_failed(int rv);
   int app_data_offset(const unsigned char *data);
+  l7_segment get_segment(const unsigned char *data, l7_connection *connection,
+                         int direction);
   string get_conntrack_key(const unsigned char *data, bool reverse);
+  u_int32_t handle_one(l7_queued_packet & packet);
+  l7_connection *new_connection(const l7_queued_packet & packet,
+                                int datalen, int & direction);
+  void follow_connection(l7_connection *connection,
+                         const l7_queued_packet & packet, int direction);
+  void flush_batch();
+  void take_messages(unsigned char *buf, int len);
+  void flush_verdicts();
 
  public:
-  l7_queue(l7_conntrack* connection_tracker);
+  l7_queue(l7_conntrack* connection_tracker, l7_pipeline* pipeline);
   ~l7_queue();
   void start(int queuenum);
-  u_int32_t handle_packet(struct nfq_data *nfa, struct nfq_q_handle *qh);
+  u_int32_t handle_packet(struct nfq_q_handle *qh, u_int16_t queuenum,
+                          unsigned char *data, int len, u_int32_t id,
+                          u_int32_t wholemark, bool headersonly);
+  void send_verdict(struct nfq_q_handle *qh, u_int16_t queuenum, u_int32_t id,
+                    u_int32_t wholemark);
+  struct nfq_q_handle *get_main_handle();
+  int get_queuenum();
+  void handle_batch(l7_queued_packet *packets, int n);
+  void track_connections();
+  u_int32_t handle_data(unsigned char *data, int len, u_int32_t id,
+                        u_int32_t wholemark, bool headersonly);
+  void read_kernel_stats();
+
+  l7_counter nenobufs;
+  l7_counter nkerneldropped;
+  l7_counter nuserdropped;
+  l7_counter nbacklog;
+  l7_counter nheadersonly;
+  l7_counter nheadersunclassified;
+  l7_counter nbatches;
+  l7_counter nverdicterrors;
+  l7_counter nbadmessages;
 };
 
 #endif
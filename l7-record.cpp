@@ -0,0 +1,288 @@
+/*
+  Recording what l7-filter sees.  See l7-record.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "l7-record.h"
+#include "l7-classify.h"
+#include "l7-queue.h"
+#include "util.h"
+#include "config.h"
+
+extern l7_classify *l7_classifier;
+
+// pcapng block types, and the options we use
+#define PCAPNG_SECTION_HEADER 0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_INTERFACE 1
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_USERAPPL 4
+
+#define LINKTYPE_IPV4 228
+
+// Room for a packet's block besides the packet itself
+#define L7_RECORD_OVERHEAD 256
+
+static unsigned int pad4(unsigned int n)
+{
+  return (n + 3) & ~3;
+}
+
+static unsigned int put32(unsigned char *p, u_int32_t value)
+{
+  memcpy(p, &value, 4);
+  return 4;
+}
+
+// Puts an option (with its padding) at p and returns its length
+static unsigned int put_option(unsigned char *p, u_int16_t code,
+                               const char *value)
+{
+  u_int16_t header[2] = { code, (u_int16_t)strlen(value) };
+  memcpy(p, header, 4);
+  memset(p + 4, 0, pad4(header[1]));
+  memcpy(p + 4, value, header[1]);
+  return 4 + pad4(header[1]);
+}
+
+// Finishes off a block that starts at start and whose options end at p.
+// Returns its length.
+static unsigned int end_block(unsigned char *start, unsigned char *p)
+{
+  p += put32(p, PCAPNG_OPT_END); // code and length both 0
+  u_int32_t len = p + 4 - start;
+  put32(start + 4, len);
+  put32(p, len);
+  return len;
+}
+
+l7_recorder::l7_recorder(string prefix, unsigned long filesize,
+                         unsigned int nfiles, unsigned int firstpackets) :
+  packets(L7_RECORD_SLOTS),
+  npackets("record.packets"), ndropped("record.dropped"),
+  nbytes("record.bytes"), nfilesmade("record.files"),
+  nerrors("record.errors")
+{
+  this->prefix = prefix;
+  this->filesize = filesize;
+  this->nfiles = nfiles;
+  this->firstpackets = firstpackets;
+  slots = block = NULL;
+  nslots = packets.capacity() + 1;
+  snaplen = 0;
+  pushed = popped = 0;
+  sleeping = 0;
+  sem_init(&wakeup, 0, 0);
+  file = NULL;
+  written = 0;
+  sequence = 0;
+}
+
+void *l7_recorder::start_thread(void *recorder)
+{
+  ((l7_recorder *)recorder)->run();
+  pthread_exit(NULL);
+}
+
+// Sets aside room for snaplen bytes of each packet, which is as much as
+// the queue gives us, and starts writing.
+void l7_recorder::start(unsigned int snaplen)
+{
+  this->snaplen = snaplen;
+  slots = (unsigned char *)malloc((size_t)nslots*snaplen);
+  block = (unsigned char *)malloc(pad4(snaplen) + L7_RECORD_OVERHEAD);
+  if(!slots || !block){
+    cerr << "Out of memory for recording packets\n";
+    exit(1);
+  }
+
+  int rc = pthread_create(&thread, NULL, start_thread, this);
+  if(rc){
+    cerr << "Error creating recording thread. pthread_create returned "
+         << rc << endl;
+    exit(1);
+  }
+}
+
+// Called from the queue thread.  Never blocks: if the writer hasn't kept
+// up, the packet isn't recorded.
+void l7_recorder::record(const unsigned char *data, int len, u_int32_t mark,
+                         u_int64_t usec)
+{
+  // The ring only has room if it had room when we looked, since only we
+  // add to it
+  if(packets.count() >= packets.capacity()){
+    ndropped.add();
+    return;
+  }
+
+  l7_recorded_packet packet;
+  packet.usec = usec;
+  packet.caplen = (unsigned int)len < snaplen ? len : snaplen;
+  packet.len = len >= 4 ? (data[2] << 8 | data[3]) : len;
+  if(packet.len < packet.caplen) packet.len = packet.caplen;
+  packet.mark = mark;
+  memcpy(slots + (pushed % nslots)*snaplen, data, packet.caplen);
+  packets.push(packet);
+  pushed++;
+
+  if(__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))
+    sem_post(&wakeup);
+}
+
+// Sleeps until the queue thread gives us a packet.  What has been written
+// is flushed first, so that the file is all there while traffic is slow.
+void l7_recorder::wait_for_packet(l7_recorded_packet & packet)
+{
+  while(!packets.pop(packet)){
+    if(file) fflush(file);
+    // As l7_worker::wait_for_job() does, so that a packet pushed between
+    // the pop above and the sem_wait below still wakes us
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if(packets.pop(packet)){
+      __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+      return;
+    }
+    while(sem_wait(&wakeup) != 0 && errno == EINTR);
+  }
+}
+
+void l7_recorder::run()
+{
+  l7_recorded_packet packet;
+
+  while(true){
+    wait_for_packet(packet);
+    write_packet(packet, slots + (popped++ % nslots)*snaplen);
+  }
+}
+
+void l7_recorder::write_block(const unsigned char *data, unsigned int len)
+{
+  if(fwrite(data, 1, len, file) != len){
+    nerrors.add();
+    unsigned long n = nerrors.get();
+    if((n^(n-1)) == (2*n-1)) // is it a power of 2?
+      cerr << "Couldn't write recorded packets: " << strerror(errno) << " ("
+           << n << " times so far.)\n";
+  }
+  written += len;
+  nbytes.add(len);
+}
+
+// Starts a new file, with the pcapng headers that say what is in it, and
+// removes the oldest one if that makes too many.  Files are named for when
+// they were started, so they sort in order.
+void l7_recorder::open_file()
+{
+  if(file) fclose(file);
+
+  char name[64];
+  time_t now = time(NULL);
+  strftime(name, sizeof(name), "-%Y%m%d-%H%M%S", localtime(&now));
+  string filename = prefix + name;
+  snprintf(name, sizeof(name), "-%04u.pcapng", sequence++ % 10000);
+  filename += name;
+
+  file = fopen(filename.c_str(), "w");
+  written = 0;
+  if(!file){
+    nerrors.add();
+    cerr << "Can't record packets to " << filename << ": " << strerror(errno)
+         << endl;
+    return;
+  }
+  setvbuf(file, NULL, _IOFBF, 1 << 20);
+  nfilesmade.add();
+  l7printf(2, "Recording packets to %s\n", filename.c_str());
+
+  filenames.push_back(filename);
+  while(filenames.size() > nfiles){
+    unlink(filenames.front().c_str());
+    filenames.pop_front();
+  }
+
+  // The section header, in our own byte order, which readers go by
+  unsigned char *p = block;
+  p += put32(p, PCAPNG_SECTION_HEADER);
+  p += 4; // the length, once we know it
+  p += put32(p, PCAPNG_BYTE_ORDER_MAGIC);
+  u_int16_t version[2] = { 1, 0 };
+  memcpy(p, version, 4);
+  p += 4;
+  memset(p, 0xff, 8); // the length of the section, which we don't know
+  p += 8;
+  p += put_option(p, PCAPNG_OPT_USERAPPL, "l7-filter " VERSION);
+  write_block(block, end_block(block, p));
+
+  // One interface, with IPv4 packets from the header on, as the queue
+  // gives them to us
+  p = block;
+  p += put32(p, PCAPNG_INTERFACE);
+  p += 4;
+  u_int16_t linktype[2] = { LINKTYPE_IPV4, 0 };
+  memcpy(p, linktype, 4);
+  p += 4;
+  p += put32(p, snaplen);
+  write_block(block, end_block(block, p));
+}
+
+// What to say about a packet's mark
+static void describe_mark(char *comment, size_t size, u_int32_t mark)
+{
+  if(mark == NO_MATCH_YET)
+    snprintf(comment, size, "l7-filter: mark %u (not classified yet)", mark);
+  else if(mark == NO_MATCH)
+    snprintf(comment, size, "l7-filter: mark %u (no match)", mark);
+  else{
+    const string & name = l7_classifier->get_name(mark);
+    if(name == "") snprintf(comment, size, "l7-filter: mark %u", mark);
+    else snprintf(comment, size, "l7-filter: mark %u (%s)", mark,
+                  name.c_str());
+  }
+}
+
+void l7_recorder::write_packet(const l7_recorded_packet & packet,
+                               const unsigned char *data)
+{
+  if(!file || written >= filesize) open_file();
+  if(!file) return;
+
+  unsigned char *p = block;
+  p += put32(p, PCAPNG_ENHANCED_PACKET);
+  p += 4;
+  p += put32(p, 0); // the interface
+  p += put32(p, packet.usec >> 32);
+  p += put32(p, packet.usec & 0xffffffff);
+  p += put32(p, packet.caplen);
+  p += put32(p, packet.len);
+  memcpy(p, data, packet.caplen);
+  memset(p + packet.caplen, 0, pad4(packet.caplen) - packet.caplen);
+  p += pad4(packet.caplen);
+
+  char comment[128];
+  describe_mark(comment, sizeof(comment), packet.mark);
+  p += put_option(p, PCAPNG_OPT_COMMENT, comment);
+  write_block(block, end_block(block, p));
+  npackets.add();
+}
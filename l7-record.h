@@ -0,0 +1,104 @@
+/*
+  Recording what l7-filter sees.  tcpdump on an interface shows traffic
+  from before the rules pick what goes to the queue, and without the marks
+  we give it, so it's no good for finding out how we do on real traffic.
+  With --record, the packets that we work out marks for are written out in
+  pcapng, each with a comment saying what mark it got, to a set of files
+  that is rotated so as to take up no more than a given amount of disk.
+  l7-filter --pcap reads them back in.
+
+  The queue thread only copies each packet into a slot that was set aside
+  for it when we started, so recording allocates nothing on the packet
+  path.  A thread of our own does the writing.  If it falls behind and the
+  slots are all taken, packets go unrecorded (and are counted) rather than
+  making the queue wait.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_RECORD_H
+#define L7_RECORD_H
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string>
+#include <deque>
+#include "l7-ring.h"
+#include "l7-stats.h"
+
+using namespace std;
+
+// How many packets can wait to be written
+#define L7_RECORD_SLOTS 512
+
+// A packet waiting to be written.  Its data is in the slot for it.
+struct l7_recorded_packet {
+  u_int64_t usec;   // when it got its mark, since the epoch
+  u_int32_t len;    // from its IP header
+  u_int32_t caplen; // how much of it we have
+  u_int32_t mark;   // our part of its mark
+};
+
+class l7_recorder {
+ private:
+  string prefix;
+  unsigned long filesize;    // start another file once one is this big
+  unsigned int nfiles;       // and keep this many
+  unsigned int firstpackets; // of each connection, or 0 for all of them
+
+  // A packet's data goes in slot number (its place in line) % nslots.
+  // There is one more slot than fits in the ring, so the one being written
+  // out is never one that the queue thread can be copying into.
+  l7_ring<l7_recorded_packet> packets;
+  unsigned char *slots;
+  unsigned int nslots;
+  unsigned int snaplen;      // the size of each slot
+  unsigned long pushed;      // only touched by the queue thread
+  unsigned long popped;      // only touched by the writer
+  int sleeping;
+  sem_t wakeup;
+  pthread_t thread;
+
+  FILE *file;
+  unsigned long written;     // to this file so far
+  unsigned int sequence;     // of the files we have made
+  deque<string> filenames;   // the ones we're keeping, oldest first
+  unsigned char *block;      // where each packet's block is put together
+
+  static void *start_thread(void *recorder);
+  void run();
+  void wait_for_packet(l7_recorded_packet & packet);
+  void open_file();
+  void write_block(const unsigned char *data, unsigned int len);
+  void write_packet(const l7_recorded_packet & packet,
+                    const unsigned char *data);
+
+ public:
+  l7_counter npackets;
+  l7_counter ndropped;
+  l7_counter nbytes;
+  l7_counter nfilesmade;
+  l7_counter nerrors;
+
+  l7_recorder(string prefix, unsigned long filesize, unsigned int nfiles,
+              unsigned int firstpackets);
+  void start(unsigned int snaplen);
+  // Whether to record packet number packetnum of a connection (0 if it
+  // doesn't have one)
+  bool wants(unsigned int packetnum) const
+  {
+    return firstpackets == 0 || packetnum <= firstpackets;
+  }
+  void record(const unsigned char *data, int len, u_int32_t mark,
+              u_int64_t usec);
+};
+
+#endif
@@ -0,0 +1,82 @@
+/*
+  A fixed size, lock-free ring for passing items from exactly one producer
+  thread to exactly one consumer thread.  Neither side ever blocks: push()
+  fails when the ring is full and pop() fails when it is empty, and it is
+  up to the caller whether to wait, retry or drop.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_RING_H
+#define L7_RING_H
+
+#include <stdlib.h>
+
+template <class T> class l7_ring {
+ private:
+  T * slots;
+  unsigned int mask; // size-1, size is a power of two
+
+  // head is only written by the producer and tail only by the consumer.
+  // Keep them on separate cache lines so the two threads don't fight over
+  // one line.
+  volatile unsigned int head __attribute__((aligned(64)));
+  volatile unsigned int tail __attribute__((aligned(64)));
+
+  l7_ring(const l7_ring &);
+  l7_ring & operator=(const l7_ring &);
+
+ public:
+  // The size is rounded up to a power of two
+  l7_ring(unsigned int size)
+  {
+    unsigned int n = 1;
+    while(n < size) n <<= 1;
+    slots = new T[n];
+    mask = n - 1;
+    head = tail = 0;
+  }
+
+  ~l7_ring() { delete [] slots; }
+
+  unsigned int capacity() const { return mask + 1; }
+
+  // Approximate when called from a third thread, exact from either end
+  unsigned int count() const
+  {
+    return __atomic_load_n(&head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+  }
+
+  bool empty() const { return count() == 0; }
+
+  // Producer side
+  bool push(const T & item)
+  {
+    unsigned int h = head;
+    if(h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) > mask)
+      return false;
+    slots[h & mask] = item;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Consumer side
+  bool pop(T & item)
+  {
+    unsigned int t = tail;
+    if(__atomic_load_n(&head, __ATOMIC_ACQUIRE) == t)
+      return false;
+    item = slots[t & mask];
+    __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+};
+
+#endif
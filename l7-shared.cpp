@@ -0,0 +1,283 @@
+/*
+  A table of classification results in shared memory, so that several
+  l7-filter processes can see each other's results.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+
+#include "l7-shared.h"
+#include "util.h"
+
+#define L7_SHARED_MAGIC 0x6c377368 // "l7sh"
+#define L7_SHARED_VERSION 1
+#define HEADER_SIZE 64 // keeps the entries cache aligned
+#define MAX_PROBES 32
+
+enum { EMPTY = 0, USED, DELETED };
+
+static inline u_int32_t seq_of(u_int64_t version)
+{
+  return version >> 32;
+}
+
+static inline u_int32_t pid_of(u_int64_t version)
+{
+  return version & 0xffffffff;
+}
+
+l7_shared_table::l7_shared_table(string filename, unsigned int nentries) :
+  nhits("shared.hits"), nmisses("shared.misses"),
+  npublished("shared.published"), nfull("shared.full"),
+  nstolen("shared.stolen")
+{
+  u_int32_t n = 1;
+  while(n < nentries) n <<= 1;
+
+  // Whoever manages to create the file sets it up.  Everyone else uses it
+  // as it is, including its size.
+  bool creator = true;
+  fd = open(filename.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+  if(fd < 0 && errno == EEXIST){
+    creator = false;
+    fd = open(filename.c_str(), O_RDWR);
+  }
+  if(fd < 0){
+    perror(filename.c_str());
+    cerr << "Couldn't open shared flow table.\n";
+    exit(1);
+  }
+
+  if(creator){
+    mapsize = HEADER_SIZE + (size_t)n*sizeof(l7_shared_entry);
+    if(ftruncate(fd, mapsize) != 0){
+      perror(filename.c_str());
+      exit(1);
+    }
+  }
+  else{
+    // Wait (briefly) for the creator to finish setting it up
+    l7_shared_header h;
+    int tries;
+    for(tries = 0; tries < 50; tries++){
+      if(pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+         h.magic == L7_SHARED_MAGIC)
+        break;
+      usleep(100000);
+    }
+    if(tries == 50 || h.version != L7_SHARED_VERSION){
+      cerr << filename << " is not a shared flow table I can use.  If no "
+              "other l7-filter is using it, remove it and try again.\n";
+      exit(1);
+    }
+    if(h.nentries != n)
+      l7printf(0, "Using the existing shared flow table's size of %u "
+                  "entries\n", h.nentries);
+    n = h.nentries;
+    mapsize = HEADER_SIZE + (size_t)n*sizeof(l7_shared_entry);
+  }
+
+  void *map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED){
+    perror("mmap");
+    cerr << "Couldn't map shared flow table " << filename << endl;
+    exit(1);
+  }
+  header = (l7_shared_header *)map;
+  entries = (l7_shared_entry *)((char *)map + HEADER_SIZE);
+  mask = n - 1;
+
+  if(creator){
+    header->version = L7_SHARED_VERSION;
+    header->nentries = n;
+    __atomic_store_n(&header->magic, L7_SHARED_MAGIC, __ATOMIC_RELEASE);
+  }
+}
+
+l7_shared_table::~l7_shared_table()
+{
+  munmap(header, mapsize);
+  close(fd);
+}
+
+u_int32_t l7_shared_table::slot_for(const l7_tuple & tuple) const
+{
+  return l7_tuple_hash(tuple) & mask;
+}
+
+// Makes us the writer of the entry.  Returns false if someone else is
+// (still) writing it.
+bool l7_shared_table::claim(l7_shared_entry *entry)
+{
+  u_int64_t me = getpid();
+
+  for(int tries = 0; tries < 100; tries++){
+    u_int64_t v = __atomic_load_n(&entry->version, __ATOMIC_ACQUIRE);
+    u_int32_t seq = seq_of(v);
+
+    if(seq % 2 == 0){
+      if(__atomic_compare_exchange_n(&entry->version, &v,
+           (u_int64_t)(seq+1) << 32 | me, false,
+           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return true;
+      continue;
+    }
+
+    // Someone is writing it.  If they died doing so, take it over.  The
+    // sequence number stays odd, since the entry is still half written.
+    // What is in it can't be trusted, so it is thrown away, the same as if
+    // it had been removed.
+    u_int32_t writer = pid_of(v);
+    if(writer != me && kill(writer, 0) < 0 && errno == ESRCH){
+      if(__atomic_compare_exchange_n(&entry->version, &v,
+           (u_int64_t)(seq+2) << 32 | me, false,
+           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        if(entry->state == USED) entry->state = DELETED;
+        nstolen.add();
+        l7printf(1, "Took over a shared flow table entry from dead process "
+                    "%u and threw it away\n", writer);
+        return true;
+      }
+      continue;
+    }
+    sched_yield();
+  }
+  return false;
+}
+
+void l7_shared_table::finish(l7_shared_entry *entry)
+{
+  u_int64_t v = entry->version;
+  __atomic_store_n(&entry->version, (u_int64_t)(seq_of(v)+1) << 32 |
+                   pid_of(v), __ATOMIC_RELEASE);
+}
+
+// Copies out the entry if nobody is in the middle of writing it.
+bool l7_shared_table::read(l7_shared_entry *entry, l7_shared_entry & copy)
+{
+  for(int tries = 0; tries < 4; tries++){
+    u_int64_t before = __atomic_load_n(&entry->version, __ATOMIC_ACQUIRE);
+    if(seq_of(before) % 2) return false;
+
+    copy.state = entry->state;
+    copy.tuple = entry->tuple;
+    copy.mark = entry->mark;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&entry->version, __ATOMIC_RELAXED) == before)
+      return true;
+  }
+  return false;
+}
+
+// Returns the mark some process gave the connection, or 0 if none has.
+u_int32_t l7_shared_table::lookup(const l7_tuple & tuple)
+{
+  u_int32_t slot = slot_for(tuple);
+
+  for(int i = 0; i < MAX_PROBES; i++){
+    l7_shared_entry copy;
+    if(!read(&entries[(slot + i) & mask], copy))
+      continue;
+    if(copy.state == EMPTY)
+      break;
+    if(copy.state == USED && copy.tuple == tuple){
+      nhits.add();
+      return copy.mark;
+    }
+  }
+  nmisses.add();
+  return 0;
+}
+
+void l7_shared_table::publish(const l7_tuple & tuple, u_int32_t mark)
+{
+  u_int32_t slot = slot_for(tuple);
+  l7_shared_entry *free_entry = NULL;
+
+  // If it's there already, update it.  Otherwise note the first free slot.
+  for(int i = 0; i < MAX_PROBES; i++){
+    l7_shared_entry *entry = &entries[(slot + i) & mask];
+    l7_shared_entry copy;
+    if(!read(entry, copy))
+      continue;
+    if(copy.state != USED){
+      if(!free_entry) free_entry = entry;
+      if(copy.state == EMPTY) break;
+      continue;
+    }
+    if(copy.tuple == tuple){
+      if(!claim(entry)) return;
+      if(entry->state == USED && entry->tuple == tuple){
+        entry->mark = mark;
+        finish(entry);
+        npublished.add();
+        return;
+      }
+      finish(entry);
+    }
+  }
+
+  // Take a free slot.  Another process may have beaten us to it, in which
+  // case keep looking.
+  for(int i = 0; i < MAX_PROBES; i++){
+    l7_shared_entry *entry = &entries[(slot + i) & mask];
+    if(free_entry && entry != free_entry) continue;
+    free_entry = NULL;
+
+    if(!claim(entry)) continue;
+    if(entry->state == USED){
+      finish(entry);
+      continue;
+    }
+    entry->tuple = tuple;
+    entry->mark = mark;
+    // Only once the rest is there, in case we die before finishing
+    __atomic_store_n(&entry->state, USED, __ATOMIC_RELEASE);
+    finish(entry);
+    npublished.add();
+    return;
+  }
+
+  nfull.add();
+}
+
+void l7_shared_table::remove(const l7_tuple & tuple)
+{
+  u_int32_t slot = slot_for(tuple);
+
+  for(int i = 0; i < MAX_PROBES; i++){
+    l7_shared_entry *entry = &entries[(slot + i) & mask];
+    l7_shared_entry copy;
+    if(read(entry, copy)){
+      if(copy.state == EMPTY) return;
+      if(copy.state != USED || !(copy.tuple == tuple)) continue;
+    }
+    if(!claim(entry)) continue;
+    // Leave a marker rather than emptying it, so that lookups for entries
+    // further along don't stop here.
+    if(entry->state == USED && entry->tuple == tuple)
+      entry->state = DELETED;
+    finish(entry);
+  }
+}
@@ -0,0 +1,74 @@
+/*
+  A table of classification results in shared memory, so that several
+  l7-filter processes (each reading its own queue) can see each other's
+  results, and a process that restarts can pick up where it left off.
+
+  The table is a memory-mapped file of fixed size entries, looked up by
+  hashing the connection's tuple.  There are no locks: each entry has a
+  sequence number that is odd while it is being written, so readers can
+  tell a half written entry from a whole one.  A process that dies in the
+  middle of a write leaves the entry odd; since the writer's pid is
+  recorded, other processes notice that it is gone and take it over.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_SHARED_H
+#define L7_SHARED_H
+
+#include <sys/types.h>
+#include "l7-conntrack.h"
+#include "l7-stats.h"
+
+struct l7_shared_entry {
+  // The high 32 bits are a sequence number that is odd while the entry is
+  // being written, and the low 32 bits are the pid of the last process to
+  // write it.  Keeping them in one word means they change together.
+  volatile u_int64_t version;
+  u_int8_t state;            // EMPTY, USED or DELETED
+  u_int8_t pad[7];
+  l7_tuple tuple;
+  u_int32_t mark;            // our part of the mark, as in l7_connection
+} __attribute__((aligned(32)));
+
+struct l7_shared_header {
+  volatile u_int32_t magic;  // written last by whoever creates the table
+  u_int32_t version;
+  u_int32_t nentries;        // a power of two
+  u_int32_t pad;
+};
+
+class l7_shared_table {
+ private:
+  int fd;
+  l7_shared_header *header;
+  l7_shared_entry *entries;
+  u_int32_t mask;
+  size_t mapsize;
+
+  u_int32_t slot_for(const l7_tuple & tuple) const;
+  bool claim(l7_shared_entry *entry);
+  void finish(l7_shared_entry *entry);
+  bool read(l7_shared_entry *entry, l7_shared_entry & copy);
+
+ public:
+  l7_counter nhits;
+  l7_counter nmisses;
+  l7_counter npublished;
+  l7_counter nfull;
+  l7_counter nstolen;
+
+  l7_shared_table(string filename, unsigned int nentries);
+  ~l7_shared_table();
+  u_int32_t lookup(const l7_tuple & tuple);
+  void publish(const l7_tuple & tuple, u_int32_t mark);
+  void remove(const l7_tuple & tuple);
+};
+
+#endif
@@ -0,0 +1,288 @@
+/*
+  Saving what we know about each connection to a file, and reading it back
+  when we start.  See l7-snapshot.h.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "l7-snapshot.h"
+#include "l7-queue.h"
+#include "util.h"
+
+string snapshotfilename = ""; // where to save connections, if anywhere
+int snapshotbuffers = 0;      // whether to save the data of connections
+                              // that are still being classified
+
+extern l7_classify* l7_classifier;
+
+// Room for stdio to work in, so that a million connections are a few dozen
+// writes instead of a million.
+#define L7_SNAPSHOT_IOBUF (1 << 20)
+
+// How many slots ahead to ask for connections while writing, since each
+// one is likely to be a cache miss
+#define L7_SNAPSHOT_PREFETCH 8
+
+static volatile sig_atomic_t snapshot_requested = 0;
+static volatile sig_atomic_t exit_requested = 0;
+
+static l7_counter nwritten("snapshot.written");
+static l7_counter nflows("snapshot.flows");
+static l7_counter nmsec("snapshot.msec");
+
+// Safe to call from a signal handler
+void l7_snapshot_request(int wakefd, bool thenexit)
+{
+  if(thenexit) exit_requested = 1;
+  snapshot_requested = 1;
+
+  // Wake the queue thread up, in case no packets are coming
+  u_int64_t one = 1;
+  ssize_t ignored = write(wakefd, &one, sizeof(one));
+  (void)ignored;
+}
+
+bool l7_snapshot_requested()
+{
+  return snapshot_requested;
+}
+
+static unsigned long now_msec()
+{
+  return l7_now_ns()/1000000;
+}
+
+// Called from the queue thread, which is the only one that changes the
+// table, so it holds still while we go through it.
+void l7_snapshot_take(const l7_flow_table & flows)
+{
+  snapshot_requested = 0;
+
+  if(snapshotfilename == ""){
+    cerr << "Asked to save connections, but there's nowhere to.  Use "
+            "--snapshot.\n";
+  }
+  else{
+    unsigned long start = now_msec();
+    if(l7_snapshot_write(flows, snapshotfilename)){
+      nwritten.add();
+      nflows.set(flows.size());
+      nmsec.set(now_msec() - start);
+      l7printf(1, "Saved %u connections to %s in %lu ms\n", flows.size(),
+               snapshotfilename.c_str(), now_msec() - start);
+    }
+  }
+
+  if(exit_requested) exit(2);
+}
+
+// Writes every connection in flows to filename.  As with the statistics,
+// it goes to a temporary file that is then renamed, so there is never half
+// of a snapshot to read.  Returns false if it couldn't.
+bool l7_snapshot_write(const l7_flow_table & flows, string filename)
+{
+  string tmpname = filename + ".tmp";
+  FILE *f = fopen(tmpname.c_str(), "wb");
+  if(!f){
+    cerr << "Couldn't save connections to " << tmpname << ": "
+         << strerror(errno) << endl;
+    return false;
+  }
+  // Only we use it, so stdio needn't lock it for every record
+  vector<char> iobuf(L7_SNAPSHOT_IOBUF);
+  setvbuf(f, &iobuf[0], _IOFBF, iobuf.size());
+  __fsetlocking(f, FSETLOCKING_BYCALLER);
+
+  const list<l7_pattern *> & patterns = l7_classifier->get_patterns();
+  l7_snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, L7_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = L7_SNAPSHOT_VERSION;
+  header.flowsize = sizeof(l7_snapshot_flow);
+  header.nprotocols = patterns.size();
+  header.nflows = flows.size();
+  header.time = time(NULL);
+  fwrite(&header, sizeof(header), 1, f);
+
+  list<l7_pattern *>::const_iterator p = patterns.begin();
+  for(; p != patterns.end(); p++){
+    string name = (*p)->getName();
+    u_int32_t mark = (*p)->getMark(), len = name.size();
+    fwrite(&mark, sizeof(mark), 1, f);
+    fwrite(&len, sizeof(len), 1, f);
+    fwrite(name.data(), 1, len, f);
+  }
+
+  u_int32_t nslots = flows.get_nslots();
+  for(u_int32_t i = 0; i < nslots; i++){
+    if(i + L7_SNAPSHOT_PREFETCH < nslots &&
+       flows.get_slot(i + L7_SNAPSHOT_PREFETCH))
+      __builtin_prefetch(flows.get_slot(i + L7_SNAPSHOT_PREFETCH));
+    l7_connection *connection = flows.get_slot(i);
+    if(!connection) continue;
+
+    l7_snapshot_flow flow;
+    memset(&flow, 0, sizeof(flow));
+    flow.saddr = connection->tuple.saddr;
+    flow.daddr = connection->tuple.daddr;
+    flow.sport = connection->tuple.sport;
+    flow.dport = connection->tuple.dport;
+    flow.proto = connection->tuple.proto;
+
+    // Workers may be adding to the buffer
+    pthread_mutex_lock(&connection->buffer_mutex);
+    flow.mark = connection->mark;
+    flow.packets = connection->num_packets;
+    flow.duplicates = connection->nduplicates;
+    for(int d = 0; d < 2; d++){
+      if(connection->streams[d].started) flow.streams |= 1 << d;
+      flow.next[d] = connection->streams[d].next;
+    }
+    flow.started = connection->started;
+    if(snapshotbuffers && connection->buffer)
+      flow.buflen = connection->lengthsofar;
+    fwrite(&flow, sizeof(flow), 1, f);
+    if(flow.buflen) fwrite(connection->buffer, 1, flow.buflen, f);
+    pthread_mutex_unlock(&connection->buffer_mutex);
+  }
+
+  bool failed = ferror(f);
+  if(fclose(f) != 0) failed = true;
+  if(failed){
+    cerr << "Couldn't save connections to " << tmpname << ": "
+         << strerror(errno) << endl;
+    unlink(tmpname.c_str());
+    return false;
+  }
+  if(rename(tmpname.c_str(), filename.c_str()) != 0){
+    cerr << "Couldn't rename " << tmpname << " to " << filename << ": "
+         << strerror(errno) << endl;
+    return false;
+  }
+  return true;
+}
+
+// Makes a connection for each one saved in filename and puts it in flows,
+// which holds the only reference to it.  Marks are translated by protocol
+// name to what they are in the current configuration; connections
+// classified as a protocol that is no longer in it count as unmatched.
+// Returns the number read, or -1 if there was no usable snapshot.
+long l7_snapshot_read(string filename, l7_flow_table & flows)
+{
+  FILE *f = fopen(filename.c_str(), "rb");
+  if(!f){
+    if(errno != ENOENT)
+      cerr << "Couldn't read saved connections from " << filename << ": "
+           << strerror(errno) << endl;
+    return -1;
+  }
+  vector<char> iobuf(L7_SNAPSHOT_IOBUF);
+  setvbuf(f, &iobuf[0], _IOFBF, iobuf.size());
+  __fsetlocking(f, FSETLOCKING_BYCALLER);
+
+  l7_snapshot_header header;
+  if(fread(&header, sizeof(header), 1, f) != 1 ||
+     memcmp(header.magic, L7_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+     header.version != L7_SNAPSHOT_VERSION ||
+     header.flowsize != sizeof(l7_snapshot_flow)){
+    cerr << filename << " isn't a snapshot that this l7-filter can read, "
+            "ignoring it.\n";
+    fclose(f);
+    return -1;
+  }
+
+  // What each saved mark is now
+  map<u_int32_t, u_int32_t> marks;
+  const list<l7_pattern *> & patterns = l7_classifier->get_patterns();
+  for(u_int32_t i = 0; i < header.nprotocols; i++){
+    u_int32_t mark, len;
+    char name[256];
+    if(fread(&mark, sizeof(mark), 1, f) != 1 ||
+       fread(&len, sizeof(len), 1, f) != 1 || len >= sizeof(name) ||
+       fread(name, 1, len, f) != len){
+      cerr << filename << " is damaged, ignoring it.\n";
+      fclose(f);
+      return -1;
+    }
+    name[len] = '\0';
+    marks[mark] = NO_MATCH;
+    list<l7_pattern *>::const_iterator p = patterns.begin();
+    for(; p != patterns.end(); p++)
+      if((*p)->getName() == name) marks[mark] = (*p)->getMark();
+  }
+
+  flows.reserve(flows.size() + header.nflows);
+  long n = 0;
+  vector<char> data;
+  for(; (u_int64_t)n < header.nflows; n++){
+    l7_snapshot_flow flow;
+    if(fread(&flow, sizeof(flow), 1, f) != 1) break;
+    data.resize(flow.buflen + 1);
+    if(flow.buflen && fread(&data[0], 1, flow.buflen, f) != flow.buflen)
+      break;
+
+    l7_tuple tuple;
+    tuple.saddr = flow.saddr;
+    tuple.daddr = flow.daddr;
+    tuple.sport = flow.sport;
+    tuple.dport = flow.dport;
+    tuple.proto = flow.proto;
+    l7_connection *connection = new l7_connection(l7_tuple_key(tuple), tuple);
+
+    u_int32_t mark = flow.mark;
+    if(mark != UNTOUCHED && mark != NO_MATCH_YET && mark != NO_MATCH){
+      map<u_int32_t, u_int32_t>::iterator m = marks.find(mark);
+      mark = m == marks.end() ? NO_MATCH : m->second;
+    }
+    connection->mark = mark;
+    connection->num_packets = flow.packets;
+    connection->nduplicates = flow.duplicates;
+    for(int d = 0; d < 2; d++){
+      connection->streams[d].started = flow.streams & (1 << d);
+      connection->streams[d].next = flow.next[d];
+    }
+    if(flow.started) connection->started = flow.started;
+
+    // The data only comes back if it still fits.  Without it, the
+    // connection carries on being classified from what comes next.
+    pthread_mutex_lock(&connection->buffer_mutex);
+    if(flow.buflen && flow.buflen <= connection->bufsize &&
+       (mark == UNTOUCHED || mark == NO_MATCH_YET) &&
+       connection->alloc_buffer()){
+      memcpy(connection->buffer, &data[0], flow.buflen);
+      connection->buffer[flow.buflen] = '\0';
+      connection->lengthsofar = flow.buflen;
+    }
+    pthread_mutex_unlock(&connection->buffer_mutex);
+
+    l7_connection *old = flows.insert(tuple, connection);
+    if(old) old->release();
+  }
+
+  if((u_int64_t)n < header.nflows)
+    cerr << filename << " ends early, only read " << n << " of its "
+         << header.nflows << " connections.\n";
+  fclose(f);
+  return n;
+}
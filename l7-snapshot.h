@@ -0,0 +1,71 @@
+/*
+  Saving what we know about each connection to a file, and reading it back
+  when we start, so that a restart (an upgrade, say) doesn't forget which
+  connections are classified.  Without this, connections that were already
+  past the packets any pattern looks at never get their marks back.
+
+  The file is binary and only meant to be read by the same build on the
+  same machine: a header, the names of the protocols the marks stand for
+  (so that a changed configuration file doesn't mix them up), and a fixed
+  size record per connection, each followed by its buffer if buffers are
+  being saved.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_SNAPSHOT_H
+#define L7_SNAPSHOT_H
+
+#include <sys/types.h>
+#include <string>
+#include "l7-conntrack.h"
+
+using namespace std;
+
+#define L7_SNAPSHOT_MAGIC "l7snap\n"
+#define L7_SNAPSHOT_VERSION 1
+
+struct l7_snapshot_header {
+  char magic[8];
+  u_int32_t version;
+  u_int32_t flowsize;   // sizeof(l7_snapshot_flow), as a sanity check
+  u_int32_t nprotocols; // names that follow, as a mark and a length each
+  u_int32_t pad;
+  u_int64_t nflows;     // records that follow the names
+  u_int64_t time;       // when it was written, seconds since the epoch
+};
+
+struct l7_snapshot_flow {
+  u_int32_t saddr;      // the tuple, as in l7_tuple
+  u_int32_t daddr;
+  u_int16_t sport;
+  u_int16_t dport;
+  u_int8_t proto;
+  u_int8_t streams;     // bit n set if we know where direction n starts
+  u_int16_t pad;
+  u_int32_t mark;       // as in l7_connection
+  u_int32_t packets;
+  u_int32_t duplicates;
+  u_int32_t next[2];    // the next sequence number wanted each way
+  u_int32_t buflen;     // bytes of buffer that follow
+  u_int64_t started;    // as in l7_connection
+};
+
+// Safe to call from a signal handler.  The queue thread does the writing,
+// and then exits if thenexit is set.  wakefd is its conntrack notify fd.
+void l7_snapshot_request(int wakefd, bool thenexit);
+bool l7_snapshot_requested();
+
+// For the queue thread, once l7_snapshot_requested() says so
+void l7_snapshot_take(const l7_flow_table & flows);
+
+bool l7_snapshot_write(const l7_flow_table & flows, string filename);
+long l7_snapshot_read(string filename, l7_flow_table & flows);
+
+#endif
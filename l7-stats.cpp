@@ -0,0 +1,235 @@
+/*
+  Counters that describe what l7-filter is doing, and the thread that
+  periodically writes them out.
+
+  The output is one "name value" pair per line, so it can be read by
+  scripts as well as by people.  It is written to a file every few seconds
+  (if a file was given with --stats-file) and to standard out on SIGUSR1.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+using namespace std;
+#include <pthread.h>
+
+#include <iostream>
+#include <fstream>
+#include <list>
+#include <map>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "l7-stats.h"
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static string stats_filename;
+static int stats_interval;
+static volatile int dump_requested = 0;
+
+// A function rather than a global so that counters which are themselves
+// globals in other files can register regardless of initialization order.
+static list<l7_counter *> & registry()
+{
+  static list<l7_counter *> counters;
+  return counters;
+}
+
+bool l7_timing = false;
+
+struct l7_stats_hook_entry {
+  l7_stats_hook hook;
+  void *data;
+};
+
+// Like registry(), so that histograms can be globals
+static list<l7_stats_hook_entry> & hooks()
+{
+  static list<l7_stats_hook_entry> entries;
+  return entries;
+}
+
+l7_counter::l7_counter(string name)
+{
+  this->name = name;
+  value = 0;
+  pthread_mutex_lock(&registry_mutex);
+  registry().push_back(this);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+l7_counter::~l7_counter()
+{
+  pthread_mutex_lock(&registry_mutex);
+  registry().remove(this);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void l7_stats_add_hook(l7_stats_hook hook, void *data)
+{
+  l7_stats_hook_entry entry;
+  entry.hook = hook;
+  entry.data = data;
+  pthread_mutex_lock(&registry_mutex);
+  hooks().push_back(entry);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void l7_stats_write(ostream & out)
+{
+  pthread_mutex_lock(&registry_mutex);
+  list<l7_stats_hook_entry> now = hooks();
+  pthread_mutex_unlock(&registry_mutex);
+  // Not under the lock, since hooks may make counters
+  for(list<l7_stats_hook_entry>::iterator i = now.begin(); i != now.end(); i++)
+    i->hook(i->data);
+
+  // Counters with the same name, such as those of each capture thread, are
+  // added together, and come out where the first of them was made.
+  list<string> names;
+  map<string, unsigned long> values;
+  pthread_mutex_lock(&registry_mutex);
+  list<l7_counter *>::iterator current = registry().begin();
+  while(current != registry().end()){
+    string name = (*current)->get_name();
+    if(values.find(name) == values.end()) names.push_back(name);
+    values[name] += (*current)->get();
+    current++;
+  }
+  pthread_mutex_unlock(&registry_mutex);
+
+  for(list<string>::iterator i = names.begin(); i != names.end(); i++)
+    out << *i << " " << values[*i] << "\n";
+  out.flush();
+}
+
+unsigned long l7_now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+l7_histogram::l7_histogram(string name) :
+  ncount(name + ".count"), np50(name + ".p50"), np90(name + ".p90"),
+  np99(name + ".p99"), np999(name + ".p999"), nmax(name + ".max")
+{
+  for(int i = 0; i < L7_HISTOGRAM_BUCKETS; i++)
+    buckets[i] = 0;
+  l7_stats_add_hook(update, this);
+}
+
+// Values under 16 get a bucket each.  Above that, each power of two is
+// split into 16 by the four bits after the highest one.
+static inline int bucket_of(unsigned long value)
+{
+  if(value < 16) return value;
+  int exponent = 63 - __builtin_clzl(value);
+  return 16 + (exponent-4)*16 + ((value >> (exponent-4)) & 15);
+}
+
+// The biggest value that goes in the bucket
+static unsigned long bucket_top(int bucket)
+{
+  if(bucket < 16) return bucket;
+  int exponent = (bucket-16)/16 + 4;
+  unsigned long width = 1UL << (exponent-4);
+  return (16 + (bucket-16)%16) * width + width - 1;
+}
+
+void l7_histogram::record(unsigned long value)
+{
+  __sync_fetch_and_add(&buckets[bucket_of(value)], 1);
+  ncount.add();
+  nmax.max(value);
+}
+
+void l7_histogram::update(void *data)
+{
+  l7_histogram *h = (l7_histogram *)data;
+  unsigned long counts[L7_HISTOGRAM_BUCKETS], total = 0;
+
+  // The buckets may change as we go, so work from one copy
+  for(int i = 0; i < L7_HISTOGRAM_BUCKETS; i++)
+    total += counts[i] = h->buckets[i];
+  if(total == 0) return;
+
+  l7_counter *outputs[] = { &h->np50, &h->np90, &h->np99, &h->np999 };
+  double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+  unsigned long sofar = 0, max = h->nmax.get();
+  int next = 0;
+  for(int i = 0; i < L7_HISTOGRAM_BUCKETS && next < 4; i++){
+    sofar += counts[i];
+    while(next < 4 && sofar >= fractions[next]*total){
+      // The top of the bucket can be past anything we've actually seen
+      outputs[next]->set(bucket_top(i) < max ? bucket_top(i) : max);
+      next++;
+    }
+  }
+}
+
+// Safe to call from a signal handler.  The stats thread does the writing.
+void l7_stats_request_dump()
+{
+  dump_requested = 1;
+}
+
+static void write_stats_file()
+{
+  // Write to a temporary file and rename it, so that readers never see
+  // half of an update.
+  string tmpname = stats_filename + ".tmp";
+  ofstream out(tmpname.c_str());
+  if(!out.is_open()){
+    cerr << "Couldn't write statistics to " << tmpname << endl;
+    return;
+  }
+  l7_stats_write(out);
+  out.close();
+  if(rename(tmpname.c_str(), stats_filename.c_str()) != 0)
+    perror(stats_filename.c_str());
+}
+
+static void * stats_thread(void *data)
+{
+  int ticks = 0;
+  while(true){
+    sleep(1);
+    ticks++;
+
+    if(dump_requested){
+      dump_requested = 0;
+      l7_stats_write(cout);
+    }
+
+    if(stats_filename != "" && ticks % stats_interval == 0)
+      write_stats_file();
+  }
+  return NULL;
+}
+
+// filename may be empty, in which case statistics are only printed on
+// request.
+void l7_stats_start(string filename, int interval)
+{
+  pthread_t thread;
+
+  stats_filename = filename;
+  stats_interval = interval;
+
+  int rc = pthread_create(&thread, NULL, stats_thread, NULL);
+  if(rc){
+    cerr << "Error creating stats thread. pthread_create returned " << rc
+         << endl;
+    exit(1);
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,98 @@
+/*
+  Counters that describe what l7-filter is doing, and the thread that
+  periodically writes them out.
+
+  http://l7-filter.sf.net
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version
+  2 of the License, or (at your option) any later version.
+  http://www.gnu.org/licenses/gpl.txt
+*/
+
+#ifndef L7_STATS_H
+#define L7_STATS_H
+
+using namespace std;
+#include <string>
+#include <ostream>
+
+// A named number that shows up in the statistics output.  Counters register
+// themselves when constructed, so they can be globals in the module that
+// updates them or members of longer lived objects.  Updates are atomic but
+// don't order anything else, which is all statistics need.
+class l7_counter {
+ private:
+  string name;
+  volatile unsigned long value;
+  l7_counter(const l7_counter &);
+  l7_counter & operator=(const l7_counter &);
+
+ public:
+  l7_counter(string name);
+  ~l7_counter();
+
+  void add(unsigned long n = 1) { __sync_fetch_and_add(&value, n); }
+  void sub(unsigned long n = 1) { __sync_fetch_and_sub(&value, n); }
+  void set(unsigned long n) { value = n; }
+  // Remember the largest value ever given, for high water marks
+  void max(unsigned long n)
+  {
+    unsigned long old;
+    while(n > (old = value) && !__sync_bool_compare_and_swap(&value, old, n));
+  }
+  unsigned long get() const { return value; }
+  string get_name() const { return name; }
+};
+
+// A distribution of values, such as how long something took.  Values are
+// counted in buckets a sixteenth of a power of two wide, so what comes out
+// is within about 6% of what went in, however big it is.  It shows up in
+// the statistics as NAME.count, NAME.p50, NAME.p90, NAME.p99, NAME.p999 and
+// NAME.max.
+#define L7_HISTOGRAM_BUCKETS (16 + 60*16)
+
+class l7_histogram {
+ private:
+  volatile unsigned long buckets[L7_HISTOGRAM_BUCKETS];
+  l7_counter ncount;
+  l7_counter np50;
+  l7_counter np90;
+  l7_counter np99;
+  l7_counter np999;
+  l7_counter nmax;
+  l7_histogram(const l7_histogram &);
+  l7_histogram & operator=(const l7_histogram &);
+  static void update(void *histogram);
+
+ public:
+  l7_histogram(string name);
+  void record(unsigned long value);
+};
+
+// If set, the time taken by each stage of the packet path is recorded in
+// histograms, in nanoseconds.
+extern bool l7_timing;
+
+unsigned long l7_now_ns();
+
+// Records the time since start and returns the time now, which is when the
+// next stage starts.
+inline unsigned long l7_stage(l7_histogram & histogram, unsigned long start)
+{
+  unsigned long now = l7_now_ns();
+  histogram.record(now - start);
+  return now;
+}
+
+// Called before the statistics are written, to bring up to date counters
+// that are too expensive to keep current all the time
+typedef void (*l7_stats_hook)(void *data);
+void l7_stats_add_hook(l7_stats_hook hook, void *data);
+
+void l7_stats_write(ostream & out);
+void l7_stats_start(string filename, int interval);
+void l7_stats_request_dump();
+
+#endif
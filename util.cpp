@@ -35,11 +35,14 @@ string friendly_print(unsigned char * s, int size)
   return result;
 }
 
-void print_give_up(string key, unsigned char * buf, int len)
+void print_give_up(const string & key, unsigned char * buf, int len)
 {
+  // Only make the printable copy if it is going to be printed, since this
+  // happens on the packet path
   if(len > 1){
     l7printf(1, "Gave up: %s. ", key.c_str());
-    l7printf(1, "Data was:\n%s\n", friendly_print(buf, len).c_str());
+    if(verbosity >= 1)
+      l7printf(1, "Data was:\n%s\n", friendly_print(buf, len).c_str());
    }
    else{
     l7printf(2, "Gave up: %s. ", key.c_str());
@@ -5,6 +5,6 @@
 
 void l7printf(int triviality, const char * format, ...);
 string friendly_print(unsigned char * s, int size);
-void print_give_up(string key, unsigned char * buf, int len);
+void print_give_up(const string & key, unsigned char * buf, int len);
 
 #endif